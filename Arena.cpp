@@ -0,0 +1,123 @@
+#include "Arena.h"
+
+#include <algorithm>
+#include <atomic>
+#include <cstdlib>
+
+#ifdef __linux__
+#include <sys/mman.h>
+#endif
+
+/* Huge pages are 2 MB on x86-64, blocks backed by them are rounded up to that */
+static const size_t HUGE_PAGE_SIZE = 2 << 20;
+
+Arena::Arena(size_t block_size, bool huge_pages) : current_(nullptr), end_(nullptr), block_size_(block_size), huge_pages_(huge_pages) {
+
+}
+
+Arena::~Arena() {
+    Release();
+}
+
+void * Arena::Allocate(size_t size, size_t alignment) {
+    uintptr_t p = (reinterpret_cast<uintptr_t>(current_) + alignment - 1) & ~uintptr_t(alignment - 1);
+    if (current_ == nullptr || p + size > reinterpret_cast<uintptr_t>(end_)) {
+        /* Allocations larger than a block get a block of their own */
+        Block block = NewBlock(std::max(block_size_, size + alignment));
+        blocks_.push_back(block);
+        current_ = block.memory_;
+        end_ = block.memory_ + block.size_;
+        p = (reinterpret_cast<uintptr_t>(current_) + alignment - 1) & ~uintptr_t(alignment - 1);
+    }
+
+    current_ = reinterpret_cast<char *>(p + size);
+    return reinterpret_cast<void *>(p);
+}
+
+void Arena::Release() {
+    for (size_t i = 0; i < blocks_.size(); i++) {
+#ifdef __linux__
+        if (blocks_[i].mapped_) {
+            munmap(blocks_[i].memory_, blocks_[i].size_);
+            continue;
+        }
+#endif
+        std::free(blocks_[i].memory_);
+    }
+    blocks_.clear();
+    current_ = end_ = nullptr;
+}
+
+size_t Arena::Reserved() const {
+    size_t size = 0;
+    for (size_t i = 0; i < blocks_.size(); i++)
+        size += blocks_[i].size_;
+    return size;
+}
+
+Arena::Block Arena::NewBlock(size_t size) {
+    Block block;
+#ifdef __linux__
+    if (huge_pages_) {
+        /* Transparent huge pages, if the kernel has them enabled for madvise */
+        size_t mapped_size = (size + HUGE_PAGE_SIZE - 1) / HUGE_PAGE_SIZE * HUGE_PAGE_SIZE;
+        void * memory = mmap(nullptr, mapped_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (memory != MAP_FAILED) {
+            madvise(memory, mapped_size, MADV_HUGEPAGE);
+            block.memory_ = static_cast<char *>(memory);
+            block.size_ = mapped_size;
+            block.mapped_ = true;
+            return block;
+        }
+    }
+#endif
+    block.memory_ = static_cast<char *>(std::malloc(size));
+    if (block.memory_ == nullptr) throw std::bad_alloc();
+    block.size_ = size;
+    block.mapped_ = false;
+    return block;
+}
+
+static uint64_t NewAllocatorId() {
+    static std::atomic<uint64_t> next_id(1);
+    return next_id++;
+}
+
+/* The arena of the last allocator used by this thread */
+static thread_local uint64_t cached_allocator = 0;
+static thread_local Arena * cached_arena = nullptr;
+
+ArenaAllocator::ArenaAllocator(bool huge_pages) : id_(NewAllocatorId()), huge_pages_(huge_pages) {
+
+}
+
+ArenaAllocator::~ArenaAllocator() {
+    Release();
+}
+
+void ArenaAllocator::Release() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    arenas_.clear();
+    /* The arenas cached by the threads are gone */
+    id_ = NewAllocatorId();
+}
+
+size_t ArenaAllocator::Reserved() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    size_t size = 0;
+    for (auto& arena : arenas_)
+        size += arena.second->Reserved();
+    return size;
+}
+
+Arena& ArenaAllocator::LocalArena() {
+    if (cached_allocator == id_) return *cached_arena;
+
+    std::lock_guard<std::mutex> lock(mutex_);
+    std::unique_ptr<Arena>& arena = arenas_[std::this_thread::get_id()];
+    if (!arena) arena.reset(new Arena(huge_pages_ ? HUGE_PAGE_SIZE : Arena::DEFAULT_BLOCK_SIZE, huge_pages_));
+
+    cached_allocator = id_;
+    cached_arena = arena.get();
+    return *arena;
+}
@@ -0,0 +1,164 @@
+#ifndef __Arena_h__
+#define __Arena_h__
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <new>
+#include <thread>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+/**
+    A bump allocator. Memory is taken from large blocks and only given back all at once,
+    by Release or by the destructor. Not thread safe
+*/
+class Arena {
+public:
+    /**
+        @param block_size The size of the blocks to allocate from
+        @param huge_pages Ask the operating system to back the blocks with huge pages, if it can
+    */
+    Arena(size_t block_size = DEFAULT_BLOCK_SIZE, bool huge_pages = false);
+    ~Arena();
+
+    Arena(const Arena&) = delete;
+    Arena& operator=(const Arena&) = delete;
+
+    static const size_t DEFAULT_BLOCK_SIZE = 1 << 20;
+
+    void * Allocate(size_t size, size_t alignment);
+
+    /**
+        Free all the blocks at once
+    */
+    void Release();
+
+    /**
+        @return The bytes held in blocks
+    */
+    size_t Reserved() const;
+
+private:
+    struct Block {
+        char * memory_;
+        size_t size_;
+        bool mapped_;
+    };
+
+    std::vector<Block> blocks_;
+    char * current_;
+    char * end_;
+    size_t block_size_;
+    bool huge_pages_;
+
+    Block NewBlock(size_t size);
+};
+
+/**
+    Node allocator backed by one Arena per thread, so that the threads of a parallel build
+    allocate without locking. Deallocate does nothing, the nodes are freed all at once by
+    Release. The memory of nodes removed before that is not reused
+*/
+class ArenaAllocator {
+public:
+    ArenaAllocator(bool huge_pages = false);
+    ~ArenaAllocator();
+
+    ArenaAllocator(const ArenaAllocator&) = delete;
+    ArenaAllocator& operator=(const ArenaAllocator&) = delete;
+
+    /* Release frees everything, the nodes need not be freed one by one */
+    static const bool RELEASES_ALL = true;
+
+    void * Allocate(size_t size, size_t alignment) {
+        return LocalArena().Allocate(size, alignment);
+    }
+
+    void Deallocate(void * /*p*/, size_t /*size*/) {
+    }
+
+    /**
+        Free all the memory, of all the threads. No other thread may allocate during the call
+    */
+    void Release();
+
+    size_t Reserved();
+
+private:
+    /* Unique for each allocator and each Release, it tells whether a thread cached arena is current */
+    uint64_t id_;
+    bool huge_pages_;
+
+    std::mutex mutex_;
+    std::unordered_map<std::thread::id, std::unique_ptr<Arena> > arenas_;
+
+    Arena& LocalArena();
+};
+
+/**
+    ArenaAllocator with blocks backed by huge pages where the operating system supports them,
+    for large trees that miss the TLB
+*/
+class HugePageArenaAllocator : public ArenaAllocator {
+public:
+    HugePageArenaAllocator() : ArenaAllocator(true) {};
+};
+
+/**
+    Node allocator with the global operator new, the nodes are freed one by one
+*/
+class HeapAllocator {
+public:
+    HeapAllocator() : allocated_(0) {};
+
+    static const bool RELEASES_ALL = false;
+
+    /* operator new aligns for any fundamental type, enough for the nodes */
+    void * Allocate(size_t size, size_t /*alignment*/) {
+        allocated_.fetch_add(size, std::memory_order_relaxed);
+        return ::operator new(size);
+    }
+
+    void Deallocate(void * p, size_t size) {
+        allocated_.fetch_sub(size, std::memory_order_relaxed);
+        ::operator delete(p);
+    }
+
+    void Release() {
+    }
+
+    /**
+        @return The bytes of the nodes not freed yet
+    */
+    size_t Reserved() const {
+        return allocated_.load(std::memory_order_relaxed);
+    }
+
+private:
+    std::atomic<size_t> allocated_;
+};
+
+/**
+    Construct an object with a node allocator
+*/
+template<typename T, typename Allocator, typename... Args>
+T * AllocatorNew(Allocator& allocator, Args&&... args) {
+    void * p = allocator.Allocate(sizeof(T), alignof(T));
+    return new (p) T(std::forward<Args>(args)...);
+}
+
+/**
+    Destroy an object created with AllocatorNew. T must be the type it was created with, or have
+    a virtual destructor and size
+*/
+template<typename T, typename Allocator>
+void AllocatorDelete(Allocator& allocator, T * p, size_t size = sizeof(T)) {
+    p->~T();
+    allocator.Deallocate(p, size);
+}
+
+#endif
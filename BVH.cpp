@@ -0,0 +1,249 @@
+#include "BVH.h"
+
+#include <algorithm>
+
+BVH::BVH(const std::vector<glm::vec3>& in_vertices, const std::vector<unsigned int>& in_triangles) {
+    size_t triangle_count = in_triangles.size() / 3;
+
+    std::vector<Bounds> bounds(triangle_count);
+    std::vector<glm::vec3> centroids(triangle_count);
+    triangles_.resize(triangle_count);
+    for (size_t i = 0; i < triangle_count; i++) {
+        bounds[i].Grow(in_vertices[in_triangles[3 * i]]);
+        bounds[i].Grow(in_vertices[in_triangles[3 * i + 1]]);
+        bounds[i].Grow(in_vertices[in_triangles[3 * i + 2]]);
+        centroids[i] = 0.5f * (bounds[i].min_ + bounds[i].max_);
+        triangles_[i] = static_cast<unsigned int>(i);
+    }
+
+    if (triangle_count == 0) return;
+
+    /* A binary tree with leaves of at least one triangle has less than 2n nodes */
+    nodes_.reserve(2 * std::max<size_t>(triangle_count, 1));
+    nodes_.push_back(BVHNode());
+    Build(0, 0, triangle_count, 0, bounds, centroids);
+}
+
+void BVH::Build(size_t index, size_t begin, size_t end, size_t depth, const std::vector<Bounds>& bounds, const std::vector<glm::vec3>& centroids) {
+    Bounds node_bounds, centroid_bounds;
+    for (size_t i = begin; i < end; i++) {
+        node_bounds.Grow(bounds[triangles_[i]]);
+        centroid_bounds.Grow(centroids[triangles_[i]]);
+    }
+
+    for (int i = 0; i < 3; i++) {
+        nodes_[index].min_[i] = node_bounds.min_[i];
+        nodes_[index].max_[i] = node_bounds.max_[i];
+    }
+
+    size_t count = end - begin;
+    auto make_leaf = [&]() {
+        nodes_[index].first_ = static_cast<unsigned int>(begin);
+        nodes_[index].count_ = static_cast<unsigned int>(count);
+    };
+
+    if (count <= 1 || depth + 1 >= MAX_DEPTH) {
+        make_leaf();
+        return;
+    }
+
+    /*
+        Sort the centroids into bins along each axis, and evaluate the cost of splitting at
+        every border between two bins:
+            TRAVERSAL_COST + (area(left) * count(left) + area(right) * count(right)) / area(node)
+    */
+    int best_axis = -1;
+    int best_split = 0;
+    float best_cost = std::numeric_limits<float>::max();
+    for (int axis = 0; axis < 3; axis++) {
+        float extent = centroid_bounds.max_[axis] - centroid_bounds.min_[axis];
+        if (extent <= 0) continue;
+        float scale = BINS / extent;
+
+        Bounds bin_bounds[BINS];
+        size_t bin_counts[BINS] = {};
+        for (size_t i = begin; i < end; i++) {
+            unsigned int t = triangles_[i];
+            int bin = std::min(BINS - 1, static_cast<int>((centroids[t][axis] - centroid_bounds.min_[axis]) * scale));
+            bin_counts[bin]++;
+            bin_bounds[bin].Grow(bounds[t]);
+        }
+
+        /* Sweep from the right to find the area and count right of each border */
+        float right_cost[BINS];
+        Bounds right;
+        size_t right_count = 0;
+        for (int b = BINS - 1; b > 0; b--) {
+            right.Grow(bin_bounds[b]);
+            right_count += bin_counts[b];
+            right_cost[b] = right.HalfArea() * right_count;
+        }
+
+        Bounds left;
+        size_t left_count = 0;
+        for (int b = 0; b < BINS - 1; b++) {
+            left.Grow(bin_bounds[b]);
+            left_count += bin_counts[b];
+            float cost = left.HalfArea() * left_count + right_cost[b + 1];
+            if (left_count > 0 && left_count < count && cost < best_cost) {
+                best_cost = cost;
+                best_axis = axis;
+                best_split = b + 1;
+            }
+        }
+    }
+
+    float node_area = node_bounds.HalfArea();
+    float split_cost = (node_area > 0) ? TRAVERSAL_COST + best_cost / node_area : std::numeric_limits<float>::max();
+    if (count <= MAX_LEAF_SIZE && (best_axis < 0 || split_cost >= count)) {
+        make_leaf();
+        return;
+    }
+
+    size_t middle;
+    if (best_axis >= 0) {
+        float scale = BINS / (centroid_bounds.max_[best_axis] - centroid_bounds.min_[best_axis]);
+        float axis_min = centroid_bounds.min_[best_axis];
+        unsigned int * split = std::partition(&triangles_[begin], &triangles_[0] + end, [&](unsigned int t) {
+            int bin = std::min(BINS - 1, static_cast<int>((centroids[t][best_axis] - axis_min) * scale));
+            return bin < best_split;
+        });
+        middle = split - &triangles_[0];
+    }
+    else {
+        /* All centroids coincide, split the list in half */
+        middle = begin + count / 2;
+    }
+
+    size_t left_index = nodes_.size();
+    nodes_.push_back(BVHNode());
+    Build(left_index, begin, middle, depth + 1, bounds, centroids);
+
+    size_t right_index = nodes_.size();
+    nodes_.push_back(BVHNode());
+    Build(right_index, middle, end, depth + 1, bounds, centroids);
+
+    nodes_[index].first_ = static_cast<unsigned int>(right_index);
+    nodes_[index].count_ = 0;
+}
+
+Real_t BVH::IntersectBox(const BVHNode& node, const Real_t origin[3], const Real_t inverse[3], Real_t tmin, Real_t tmax) {
+    for (int i = 0; i < 3; i++) {
+        Real_t t0 = (node.min_[i] - origin[i]) * inverse[i];
+        Real_t t1 = (node.max_[i] - origin[i]) * inverse[i];
+        if (t0 > t1) std::swap(t0, t1);
+        tmin = std::max(tmin, t0);
+        tmax = std::min(tmax, t1);
+    }
+    return (tmin <= tmax) ? tmin : std::numeric_limits<Real_t>::infinity();
+}
+
+bool BVH::RayCast(const std::vector<glm::vec3>& in_vertices, const std::vector<unsigned int>& in_triangles, Ray3D r, RayHit& hit, Real_t tmin, Real_t tmax) const {
+    hit = RayHit();
+    hit.t_ = tmax;
+
+    Real_t origin[3] = { r.Origin()[0], r.Origin()[1], r.Origin()[2] };
+    Real_t direction[3] = { r.Direction()[0], r.Direction()[1], r.Direction()[2] };
+    Real_t inverse[3];
+    for (int i = 0; i < 3; i++) {
+        /* Same as the octree traversal, a zero component is tilted by a negligible amount */
+        Real_t d = (direction[i] == 0) ? std::numeric_limits<Real_t>::epsilon() : direction[i];
+        inverse[i] = Real_t(1) / d;
+    }
+
+    if (nodes_.empty() || IntersectBox(nodes_[0], origin, inverse, tmin, hit.t_) == std::numeric_limits<Real_t>::infinity()) return false;
+
+    unsigned int stack[MAX_DEPTH];
+    int top = 0;
+    unsigned int index = 0;
+    for (;;) {
+        const BVHNode& node = nodes_[index];
+        if (node.IsLeaf()) {
+            for (unsigned int i = node.first_; i < node.first_ + node.count_; i++) {
+                unsigned int triangle_id = triangles_[i];
+                int tp = 3 * triangle_id;
+                Real_t t, u, v;
+                if (!rayTriangleIntersect(origin, direction, in_vertices[in_triangles[tp]], in_vertices[in_triangles[tp + 1]], in_vertices[in_triangles[tp + 2]], t, u, v)) continue;
+                if (t < tmin || t >= hit.t_) continue;
+
+                hit.triangle_id_ = triangle_id;
+                hit.t_ = t;
+                hit.u_ = u;
+                hit.v_ = v;
+            }
+        }
+        else {
+            /* Visit the nearer child first, the hits found there shorten the ray for the other one */
+            unsigned int left = index + 1;
+            unsigned int right = node.first_;
+            Real_t t_left = IntersectBox(nodes_[left], origin, inverse, tmin, hit.t_);
+            Real_t t_right = IntersectBox(nodes_[right], origin, inverse, tmin, hit.t_);
+            if (t_left > t_right) {
+                std::swap(left, right);
+                std::swap(t_left, t_right);
+            }
+
+            if (t_left != std::numeric_limits<Real_t>::infinity()) {
+                if (t_right != std::numeric_limits<Real_t>::infinity()) stack[top++] = right;
+                index = left;
+                continue;
+            }
+        }
+
+        /* Skip the nodes the ray has been shortened past */
+        bool found = false;
+        while (top > 0 && !found) {
+            index = stack[--top];
+            found = IntersectBox(nodes_[index], origin, inverse, tmin, hit.t_) != std::numeric_limits<Real_t>::infinity();
+        }
+        if (!found) break;
+    }
+
+    return hit.Valid();
+}
+
+bool BVH::Occluded(const std::vector<glm::vec3>& in_vertices, const std::vector<unsigned int>& in_triangles, Ray3D r, Real_t tmax, Real_t tmin) const {
+    Real_t origin[3] = { r.Origin()[0], r.Origin()[1], r.Origin()[2] };
+    Real_t direction[3] = { r.Direction()[0], r.Direction()[1], r.Direction()[2] };
+    Real_t inverse[3];
+    for (int i = 0; i < 3; i++) {
+        Real_t d = (direction[i] == 0) ? std::numeric_limits<Real_t>::epsilon() : direction[i];
+        inverse[i] = Real_t(1) / d;
+    }
+
+    if (nodes_.empty()) return false;
+
+    /* Any hit ends the query, so the order the nodes are visited in does not matter */
+    unsigned int stack[MAX_DEPTH];
+    int top = 0;
+    stack[top++] = 0;
+    while (top > 0) {
+        const BVHNode& node = nodes_[stack[--top]];
+        if (IntersectBox(node, origin, inverse, tmin, tmax) == std::numeric_limits<Real_t>::infinity()) continue;
+
+        if (!node.IsLeaf()) {
+            stack[top++] = node.first_;
+            stack[top++] = static_cast<unsigned int>(&node - &nodes_[0]) + 1;
+            continue;
+        }
+
+        for (unsigned int i = node.first_; i < node.first_ + node.count_; i++) {
+            int tp = 3 * triangles_[i];
+            Real_t t, u, v;
+            if (!rayTriangleIntersect(origin, direction, in_vertices[in_triangles[tp]], in_vertices[in_triangles[tp + 1]], in_vertices[in_triangles[tp + 2]], t, u, v)) continue;
+            if (t >= tmin && t <= tmax) return true;
+        }
+    }
+
+    return false;
+}
+
+size_t BVH::Depth() const {
+    return nodes_.empty() ? 0 : Depth(0);
+}
+
+size_t BVH::Depth(size_t index) const {
+    const BVHNode& node = nodes_[index];
+    if (node.IsLeaf()) return 0;
+    return std::max(Depth(index + 1), Depth(node.first_)) + 1;
+}
@@ -0,0 +1,121 @@
+#ifndef __BVH_h__
+#define __BVH_h__
+
+#include <limits>
+#include <vector>
+
+#include <glm/glm.hpp>
+
+#include "Ray.hpp"
+#include "RayTriangleIntersection.hpp"
+
+/**
+    A node of a bounding volume hierarchy. The left child of an inner node is stored right
+    after it in the nodes array, the right child at first_
+*/
+struct BVHNode {
+    float min_[3];
+    /* Inner node: index of the right child. Leaf: index of the first triangle in the triangles array */
+    unsigned int first_;
+    float max_[3];
+    /* Leaf: number of triangles. Zero for inner nodes */
+    unsigned int count_;
+
+    bool IsLeaf() const {
+        return count_ != 0;
+    }
+};
+
+/**
+    A bounding volume hierarchy over the triangles of a mesh, built top down with the surface
+    area heuristic evaluated at the borders of a fixed number of bins. Every triangle is stored
+    once, so long thin triangles that overlap many octree cells cost no more than others. The
+    queries have the same interface as the ones of TrianglesOctree
+*/
+class BVH {
+public:
+    /**
+        Build the hierarchy of all the triangles of a mesh
+        @param in_vertices The vertices of the mesh
+        @param in_triangles Three vertex indices per triangle
+    */
+    BVH(const std::vector<glm::vec3>& in_vertices, const std::vector<unsigned int>& in_triangles);
+
+    /**
+        Find the closest triangle hit by a ray
+        @param r The 3D space ray
+        @param[out] hit The closest hit. If nothing is hit, hit.Valid() is false
+        @param tmin The start of the ray interval
+        @param tmax The end of the ray interval
+        @return true if a triangle was hit inside [tmin, tmax]
+    */
+    bool RayCast(const std::vector<glm::vec3>& in_vertices, const std::vector<unsigned int>& in_triangles, Ray3D r, RayHit& hit, Real_t tmin = 0, Real_t tmax = std::numeric_limits<Real_t>::max()) const;
+
+    /**
+        Check if a ray hits any triangle. The traversal ends at the first hit found
+        @param r The 3D space ray
+        @param tmax The end of the ray interval
+        @param tmin The start of the ray interval
+        @return true if any triangle is hit inside [tmin, tmax]
+    */
+    bool Occluded(const std::vector<glm::vec3>& in_vertices, const std::vector<unsigned int>& in_triangles, Ray3D r, Real_t tmax, Real_t tmin = 0) const;
+
+    size_t Depth() const;
+
+    size_t NodeCount() const {
+        return nodes_.size();
+    }
+
+private:
+    /* Number of bins along each axis the split planes are chosen from */
+    static const int BINS = 16;
+    /* Nodes with more triangles are always split */
+    static const unsigned int MAX_LEAF_SIZE = 8;
+    /* Deepest node, the size of the traversal stack */
+    static const int MAX_DEPTH = 64;
+    /* Cost of visiting a node, relative to one ray/triangle test */
+    static constexpr float TRAVERSAL_COST = 1.0f;
+
+    struct Bounds {
+        Bounds() : min_(std::numeric_limits<float>::max()), max_(-std::numeric_limits<float>::max()) {};
+
+        void Grow(const glm::vec3& point) {
+            min_ = glm::min(min_, point);
+            max_ = glm::max(max_, point);
+        }
+
+        void Grow(const Bounds& other) {
+            min_ = glm::min(min_, other.min_);
+            max_ = glm::max(max_, other.max_);
+        }
+
+        /* Half of the surface area, enough to compare costs */
+        float HalfArea() const {
+            glm::vec3 e = glm::max(max_ - min_, glm::vec3(0));
+            return e.x * e.y + e.y * e.z + e.z * e.x;
+        }
+
+        glm::vec3 min_;
+        glm::vec3 max_;
+    };
+
+    /**
+        Build the subtree of triangles_[begin, end) at the node index
+        @param bounds The bounds of each triangle
+        @param centroids The centre of the bounds of each triangle
+    */
+    void Build(size_t index, size_t begin, size_t end, size_t depth, const std::vector<Bounds>& bounds, const std::vector<glm::vec3>& centroids);
+
+    /**
+        Slab test of a ray against the box of a node
+        @return The entry value clipped to [tmin, tmax], or infinity if the box is missed
+    */
+    static Real_t IntersectBox(const BVHNode& node, const Real_t origin[3], const Real_t inverse[3], Real_t tmin, Real_t tmax);
+
+    size_t Depth(size_t index) const;
+
+    std::vector<BVHNode> nodes_;
+    std::vector<unsigned int> triangles_;
+};
+
+#endif
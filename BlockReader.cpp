@@ -0,0 +1,71 @@
+#include "BlockReader.h"
+
+#include <cstring>
+
+BlockReader::BlockReader(size_t block_size, size_t carry_size) : block_size_(block_size), carry_size_(carry_size), current_(0), data_(nullptr), available_(0), position_(0) {
+
+}
+
+BlockReader::~BlockReader() {
+    Close();
+}
+
+bool BlockReader::Open(const std::string& path, uint64_t offset) {
+    Close();
+
+    in_.open(path.c_str(), std::ios_base::in | std::ios_base::binary);
+    if (!in_.is_open()) return false;
+    in_.seekg(static_cast<std::streamoff>(offset));
+    if (!in_) {
+        in_.close();
+        return false;
+    }
+
+    for (int i = 0; i < 2; i++)
+        buffers_[i].resize(carry_size_ + block_size_);
+    current_ = 1;
+    data_ = buffers_[current_].data() + carry_size_;
+    available_ = 0;
+    position_ = offset;
+
+    /* An empty file is open, with nothing available */
+    Read(0);
+    Refill();
+    return true;
+}
+
+void BlockReader::Close() {
+    if (pending_.valid()) pending_.wait();
+    pending_ = std::future<size_t>();
+    if (in_.is_open()) in_.close();
+    in_.clear();
+    data_ = nullptr;
+    available_ = 0;
+}
+
+bool BlockReader::Refill() {
+    if (!pending_.valid() || available_ > carry_size_) return false;
+
+    size_t count = pending_.get();
+    if (count == 0) return false;
+
+    /* Put the unread bytes right before the new block */
+    int next = 1 - current_;
+    char * start = buffers_[next].data() + carry_size_ - available_;
+    std::memcpy(start, data_, available_);
+    current_ = next;
+    data_ = start;
+    available_ += count;
+
+    /* The other buffer is free again, a short block is the end of the file */
+    if (count == block_size_) Read(1 - current_);
+    return true;
+}
+
+void BlockReader::Read(int buffer) {
+    char * destination = buffers_[buffer].data() + carry_size_;
+    pending_ = std::async(std::launch::async, [this, destination]() {
+        in_.read(destination, static_cast<std::streamsize>(block_size_));
+        return static_cast<size_t>(in_.gcount());
+    });
+}
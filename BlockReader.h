@@ -0,0 +1,82 @@
+#ifndef __BlockReader_h__
+#define __BlockReader_h__
+
+#include <cstddef>
+#include <cstdint>
+#include <fstream>
+#include <future>
+#include <string>
+#include <vector>
+
+/**
+    Reads a file sequentially in blocks of a fixed size, with two buffers: the next block is
+    read on another thread while the current one is used. Records that straddle two blocks are
+    made contiguous, by carrying the unread bytes of a block over to the front of the next one
+*/
+class BlockReader {
+public:
+    /**
+        @param block_size The bytes read at once
+        @param carry_size The most bytes that can be left unread when refilling, the size of
+            the longest record
+    */
+    BlockReader(size_t block_size = 4 << 20, size_t carry_size = 64 << 10);
+    ~BlockReader();
+
+    BlockReader(const BlockReader&) = delete;
+    BlockReader& operator=(const BlockReader&) = delete;
+
+    /**
+        Open a file and read its first block
+        @param offset Where to start reading
+        @return false if the file can't be opened
+    */
+    bool Open(const std::string& path, uint64_t offset = 0);
+    void Close();
+
+    /* The unread bytes of the current block */
+    const char * Data() const {
+        return data_;
+    }
+
+    size_t Available() const {
+        return available_;
+    }
+
+    /* Mark bytes of the current block as read */
+    void Advance(size_t count) {
+        data_ += count;
+        available_ -= count;
+        position_ += count;
+    }
+
+    /**
+        Append the next block to the unread bytes, waiting for its read to finish
+        @return false at the end of the file, or if more than carry_size bytes are unread
+    */
+    bool Refill();
+
+    /* The offset of Data() in the file */
+    uint64_t Position() const {
+        return position_;
+    }
+
+private:
+    size_t block_size_;
+    size_t carry_size_;
+    std::ifstream in_;
+
+    /* Blocks are read at carry_size_ from the start of a buffer */
+    std::vector<char> buffers_[2];
+    int current_;
+    std::future<size_t> pending_;
+
+    const char * data_;
+    size_t available_;
+    uint64_t position_;
+
+    /* Start reading the next block into a buffer */
+    void Read(int buffer);
+};
+
+#endif
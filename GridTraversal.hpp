@@ -0,0 +1,166 @@
+#ifndef __GridTraversal_hpp__
+#define __GridTraversal_hpp__
+
+#include <algorithm>
+#include <cmath>
+#include <limits>
+#include <vector>
+
+#include <glm/glm.hpp>
+
+#include "Ray.hpp"
+#include "ThreadPool.h"
+#include "TriangleBoxOverlapping.hpp"
+
+/* Triangles per task when binning */
+static const size_t GRID_BIN_CHUNK_SIZE = 4096;
+
+/**
+    Bin triangles into the cells of a uniform grid. The references of all cells are stored in
+    one array, cell i owns the range [cell_offsets[i], cell_offsets[i + 1]), with the cells
+    numbered x + resolution[0] * (y + resolution[1] * z). A triangle is tested against every
+    cell its bounding box touches, with slightly larger cells so that triangles on the border
+    of two cells are never lost. Cells list their triangles in the order of ids
+    @param ids The triangles to bin
+    @param count The number of triangles
+    @param grid_min The "bottom left" point of the grid
+    @param cell_size The size of a cell along each axis
+    @param resolution The number of cells along each axis
+    @param[out] cell_offsets The start of the range of each cell, and the end of the last one
+    @param[out] cell_triangles The triangle references
+    @param pool The threads to bin with, or nullptr to bin on the calling thread
+*/
+inline void BinTriangles(const std::vector<glm::vec3>& in_vertices, const std::vector<unsigned int>& in_triangles, const unsigned int * ids, size_t count,
+    const glm::vec3& grid_min, const glm::vec3& cell_size, const int resolution[3], std::vector<unsigned int>& cell_offsets, std::vector<unsigned int>& cell_triangles, ThreadPool * pool) {
+
+    /* Each chunk lists the (cell, triangle) pairs of its triangles */
+    size_t chunks = (count + GRID_BIN_CHUNK_SIZE - 1) / GRID_BIN_CHUNK_SIZE;
+    std::vector<std::vector<unsigned int> > chunk_cells(chunks), chunk_triangles(chunks);
+    glm::vec3 half_size = 0.5f * cell_size * 1.001f;
+    auto bin = [&](size_t begin, size_t end) {
+        for (size_t chunk = begin; chunk < end; chunk++) {
+            for (size_t k = chunk * GRID_BIN_CHUNK_SIZE; k < std::min(count, (chunk + 1) * GRID_BIN_CHUNK_SIZE); k++) {
+                unsigned int t = ids[k];
+                const glm::vec3& v0 = in_vertices[in_triangles[3 * t]];
+                const glm::vec3& v1 = in_vertices[in_triangles[3 * t + 1]];
+                const glm::vec3& v2 = in_vertices[in_triangles[3 * t + 2]];
+                glm::vec3 low = (glm::min(glm::min(v0, v1), v2) - grid_min) / cell_size;
+                glm::vec3 high = (glm::max(glm::max(v0, v1), v2) - grid_min) / cell_size;
+
+                int lo[3], hi[3];
+                for (int i = 0; i < 3; i++) {
+                    lo[i] = std::min(resolution[i] - 1, std::max(0, static_cast<int>(low[i])));
+                    hi[i] = std::min(resolution[i] - 1, std::max(0, static_cast<int>(high[i])));
+                }
+                bool single_cell = lo[0] == hi[0] && lo[1] == hi[1] && lo[2] == hi[2];
+
+                for (int z = lo[2]; z <= hi[2]; z++) {
+                    for (int y = lo[1]; y <= hi[1]; y++) {
+                        for (int x = lo[0]; x <= hi[0]; x++) {
+                            glm::vec3 center = grid_min + (glm::vec3(x, y, z) + glm::vec3(0.5f)) * cell_size;
+                            if (!single_cell && !triBoxOverlap(center, half_size, v0, v1, v2)) continue;
+                            chunk_cells[chunk].push_back(static_cast<unsigned int>(x + resolution[0] * (y + static_cast<size_t>(resolution[1]) * z)));
+                            chunk_triangles[chunk].push_back(t);
+                        }
+                    }
+                }
+            }
+        }
+    };
+    if (pool) pool->ParallelFor(chunks, 1, bin);
+    else bin(0, chunks);
+
+    /* Counting sort of the pairs by cell. Chunks are scattered in order, which keeps the order of ids */
+    size_t cells = static_cast<size_t>(resolution[0]) * resolution[1] * resolution[2];
+    cell_offsets.assign(cells + 1, 0);
+    for (size_t chunk = 0; chunk < chunks; chunk++) {
+        for (size_t i = 0; i < chunk_cells[chunk].size(); i++)
+            cell_offsets[chunk_cells[chunk][i] + 1]++;
+    }
+    for (size_t i = 0; i < cells; i++)
+        cell_offsets[i + 1] += cell_offsets[i];
+
+    cell_triangles.resize(cell_offsets[cells]);
+    std::vector<unsigned int> next(cell_offsets.begin(), cell_offsets.end() - 1);
+    for (size_t chunk = 0; chunk < chunks; chunk++) {
+        for (size_t i = 0; i < chunk_cells[chunk].size(); i++)
+            cell_triangles[next[chunk_cells[chunk][i]]++] = chunk_triangles[chunk][i];
+    }
+}
+
+/**
+    Walk the cells of a uniform grid crossed by a ray inside [tmin, tmax] in order, with the
+    Amanatides-Woo 3D-DDA:
+
+        bool visitor(int x, int y, int z, Real_t t_enter, Real_t t_exit)
+
+    is called with the cell coordinates and the t values where the ray enters and leaves the
+    cell. The visitor returns true to end the walk
+    @param grid_min, grid_max The box of the grid
+    @param cell_size The size of a cell along each axis
+    @param resolution The number of cells along each axis
+    @param tmax The end of the ray interval. A reference, the visitor can shorten the ray
+    @return true if the visitor ended the walk
+*/
+template<typename CellVisitor>
+bool WalkGrid(const glm::vec3& grid_min, const glm::vec3& grid_max, const glm::vec3& cell_size, const int resolution[3],
+    const Real_t origin[3], const Real_t direction[3], Real_t tmin, const Real_t& tmax, CellVisitor& visitor) {
+
+    /* Clip the ray interval to the box of the grid */
+    Real_t t_enter = tmin, t_exit = tmax;
+    for (int i = 0; i < 3; i++) {
+        if (direction[i] == 0) {
+            if (origin[i] < grid_min[i] || origin[i] > grid_max[i]) return false;
+            continue;
+        }
+        Real_t t0 = (grid_min[i] - origin[i]) / direction[i];
+        Real_t t1 = (grid_max[i] - origin[i]) / direction[i];
+        if (t0 > t1) std::swap(t0, t1);
+        t_enter = std::max(t_enter, t0);
+        t_exit = std::min(t_exit, t1);
+    }
+    if (t_enter > t_exit) return false;
+
+    /*
+        The cell of the entry point, then per axis: the step to the next cell, the t value of the
+        next cell border, and the t distance between two borders
+    */
+    int cell[3], step[3];
+    Real_t t_next[3], t_delta[3];
+    for (int i = 0; i < 3; i++) {
+        Real_t p = origin[i] + direction[i] * t_enter;
+        cell[i] = std::min(resolution[i] - 1, std::max(0, static_cast<int>(std::floor((p - grid_min[i]) / cell_size[i]))));
+
+        if (direction[i] > 0) {
+            step[i] = 1;
+            t_next[i] = (grid_min[i] + Real_t(cell[i] + 1) * cell_size[i] - origin[i]) / direction[i];
+            t_delta[i] = cell_size[i] / direction[i];
+        }
+        else if (direction[i] < 0) {
+            step[i] = -1;
+            t_next[i] = (grid_min[i] + Real_t(cell[i]) * cell_size[i] - origin[i]) / direction[i];
+            t_delta[i] = -cell_size[i] / direction[i];
+        }
+        else {
+            step[i] = 0;
+            t_next[i] = std::numeric_limits<Real_t>::infinity();
+            t_delta[i] = 0;
+        }
+    }
+
+    Real_t cell_enter = t_enter;
+    for (;;) {
+        int axis = (t_next[0] < t_next[1]) ? ((t_next[0] < t_next[2]) ? 0 : 2) : ((t_next[1] < t_next[2]) ? 1 : 2);
+        Real_t cell_exit = std::min(t_next[axis], t_exit);
+
+        if (visitor(cell[0], cell[1], cell[2], cell_enter, cell_exit)) return true;
+        if (t_next[axis] > std::min(t_exit, tmax)) return false;
+
+        cell[axis] += step[axis];
+        if (cell[axis] < 0 || cell[axis] >= resolution[axis]) return false;
+        cell_enter = t_next[axis];
+        t_next[axis] += t_delta[axis];
+    }
+}
+
+#endif
@@ -0,0 +1,93 @@
+#ifndef __InlineBucket_hpp__
+#define __InlineBucket_hpp__
+
+#include <algorithm>
+#include <cstddef>
+#include <new>
+
+/**
+    The items of an octree leaf. The first N are stored inline, so a leaf that holds at most
+    N items allocates nothing. Leaves the octree does not split hold more, at its maximum depth
+    or where its build decides a split does not pay, e.g. the surface area heuristic of
+    TrianglesOctree. Those go to an overflow array taken from the node allocator. The overflow
+    array must be given back with Free before the bucket is destroyed
+*/
+template<typename T, int N>
+class InlineBucket {
+public:
+    InlineBucket() : size_(0), overflow_capacity_(0), overflow_(nullptr) {};
+
+    size_t Size() const {
+        return size_;
+    }
+
+    T& operator[](size_t i) {
+        return (i < N) ? inline_[i] : overflow_[i - N];
+    }
+
+    const T& operator[](size_t i) const {
+        return (i < N) ? inline_[i] : overflow_[i - N];
+    }
+
+    template<typename Allocator>
+    void Reserve(Allocator& allocator, size_t count) {
+        if (count > N + overflow_capacity_) Grow(allocator, count - N);
+    }
+
+    template<typename Allocator>
+    void PushBack(Allocator& allocator, const T& item) {
+        if (size_ < N) {
+            inline_[size_++] = item;
+            return;
+        }
+
+        if (size_ - N == overflow_capacity_) Grow(allocator, std::max<size_t>(2 * overflow_capacity_, N));
+        new (&overflow_[size_ - N]) T(item);
+        size_++;
+    }
+
+    /**
+        Remove item i, the items after it move one place down
+    */
+    void Erase(size_t i) {
+        for (size_t j = i; j + 1 < size_; j++)
+            (*this)[j] = (*this)[j + 1];
+        size_--;
+        if (size_ >= N) overflow_[size_ - N].~T();
+    }
+
+    /**
+        Give back the overflow array
+    */
+    template<typename Allocator>
+    void Free(Allocator& allocator) {
+        if (overflow_ == nullptr) return;
+
+        for (size_t i = N; i < size_; i++)
+            overflow_[i - N].~T();
+        allocator.Deallocate(overflow_, overflow_capacity_ * sizeof(T));
+        size_ = std::min<size_t>(size_, N);
+        overflow_ = nullptr;
+        overflow_capacity_ = 0;
+    }
+
+private:
+    T inline_[N];
+    unsigned int size_;
+    unsigned int overflow_capacity_;
+    T * overflow_;
+
+    template<typename Allocator>
+    void Grow(Allocator& allocator, size_t capacity) {
+        T * overflow = static_cast<T *>(allocator.Allocate(capacity * sizeof(T), alignof(T)));
+        for (size_t i = N; i < size_; i++) {
+            new (&overflow[i - N]) T(overflow_[i - N]);
+            overflow_[i - N].~T();
+        }
+        if (overflow_ != nullptr) allocator.Deallocate(overflow_, overflow_capacity_ * sizeof(T));
+        overflow_ = overflow;
+        overflow_capacity_ = static_cast<unsigned int>(capacity);
+    }
+};
+
+#endif
@@ -0,0 +1,305 @@
+#include "LeafIntersection.h"
+
+#if defined(__x86_64__) || defined(_M_X64) || defined(__i386__) || defined(_M_IX86)
+#define LEAF_KERNEL_X86
+#include <immintrin.h>
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
+#endif
+
+/*
+    The vector kernels are compiled for their instruction set whatever the flags of the build,
+    and only called if the CPU supports it. Visual Studio needs no flags for intrinsics
+*/
+#if defined(__GNUC__) || defined(__clang__)
+#define LEAF_KERNEL_TARGET(isa) __attribute__((target(isa)))
+#else
+#define LEAF_KERNEL_TARGET(isa)
+#endif
+
+static int LeafIntersectScalar(const float origin[3], const float direction[3], const TriangleBuffer& triangles, size_t first, size_t count, float tmin, float tmax, float& t, float& u, float& v) {
+    int best = -1;
+    for (size_t i = 0; i < count; i++) {
+        size_t k = first + i;
+        float e1[3] = { triangles.e1_x_[k], triangles.e1_y_[k], triangles.e1_z_[k] };
+        float e2[3] = { triangles.e2_x_[k], triangles.e2_y_[k], triangles.e2_z_[k] };
+
+        float p[3] = {
+            direction[1] * e2[2] - direction[2] * e2[1],
+            direction[2] * e2[0] - direction[0] * e2[2],
+            direction[0] * e2[1] - direction[1] * e2[0]
+        };
+        float det = e1[0] * p[0] + e1[1] * p[1] + e1[2] * p[2];
+        if (det == 0) continue;
+        float inv_det = 1.0f / det;
+
+        float s[3] = { origin[0] - triangles.v0_x_[k], origin[1] - triangles.v0_y_[k], origin[2] - triangles.v0_z_[k] };
+        float hit_u = (s[0] * p[0] + s[1] * p[1] + s[2] * p[2]) * inv_det;
+        if (!(hit_u >= 0 && hit_u <= 1)) continue;
+
+        float q[3] = {
+            s[1] * e1[2] - s[2] * e1[1],
+            s[2] * e1[0] - s[0] * e1[2],
+            s[0] * e1[1] - s[1] * e1[0]
+        };
+        float hit_v = (direction[0] * q[0] + direction[1] * q[1] + direction[2] * q[2]) * inv_det;
+        if (!(hit_v >= 0 && hit_u + hit_v <= 1)) continue;
+
+        float hit_t = (e2[0] * q[0] + e2[1] * q[1] + e2[2] * q[2]) * inv_det;
+        if (!(hit_t >= tmin && hit_t <= tmax)) continue;
+        if (best >= 0 && hit_t >= t) continue;
+
+        best = static_cast<int>(i);
+        t = hit_t;
+        u = hit_u;
+        v = hit_v;
+    }
+    return best;
+}
+
+#ifdef LEAF_KERNEL_X86
+
+/*
+    Each kernel tests WIDTH triangles at a time and writes a bit mask of the lanes that hit.
+    The nearest of them is then picked on the scalar side, the ranges are short
+*/
+
+LEAF_KERNEL_TARGET("sse4.2")
+static int LeafIntersectSse42(const float origin[3], const float direction[3], const TriangleBuffer& triangles, size_t first, size_t count, float tmin, float tmax, float& t, float& u, float& v) {
+    const size_t WIDTH = 4;
+    const __m128 ox = _mm_set1_ps(origin[0]), oy = _mm_set1_ps(origin[1]), oz = _mm_set1_ps(origin[2]);
+    const __m128 dx = _mm_set1_ps(direction[0]), dy = _mm_set1_ps(direction[1]), dz = _mm_set1_ps(direction[2]);
+    const __m128 zero = _mm_setzero_ps(), one = _mm_set1_ps(1.0f), vtmin = _mm_set1_ps(tmin);
+
+    int best = -1;
+    float ts[WIDTH], us[WIDTH], vs[WIDTH];
+    for (size_t i = 0; i < count; i += WIDTH) {
+        size_t k = first + i;
+        __m128 e1x = _mm_loadu_ps(&triangles.e1_x_[k]), e1y = _mm_loadu_ps(&triangles.e1_y_[k]), e1z = _mm_loadu_ps(&triangles.e1_z_[k]);
+        __m128 e2x = _mm_loadu_ps(&triangles.e2_x_[k]), e2y = _mm_loadu_ps(&triangles.e2_y_[k]), e2z = _mm_loadu_ps(&triangles.e2_z_[k]);
+
+        __m128 px = _mm_sub_ps(_mm_mul_ps(dy, e2z), _mm_mul_ps(dz, e2y));
+        __m128 py = _mm_sub_ps(_mm_mul_ps(dz, e2x), _mm_mul_ps(dx, e2z));
+        __m128 pz = _mm_sub_ps(_mm_mul_ps(dx, e2y), _mm_mul_ps(dy, e2x));
+        __m128 det = _mm_add_ps(_mm_add_ps(_mm_mul_ps(e1x, px), _mm_mul_ps(e1y, py)), _mm_mul_ps(e1z, pz));
+        __m128 inv_det = _mm_div_ps(one, det);
+
+        __m128 sx = _mm_sub_ps(ox, _mm_loadu_ps(&triangles.v0_x_[k]));
+        __m128 sy = _mm_sub_ps(oy, _mm_loadu_ps(&triangles.v0_y_[k]));
+        __m128 sz = _mm_sub_ps(oz, _mm_loadu_ps(&triangles.v0_z_[k]));
+        __m128 hit_u = _mm_mul_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(sx, px), _mm_mul_ps(sy, py)), _mm_mul_ps(sz, pz)), inv_det);
+
+        __m128 qx = _mm_sub_ps(_mm_mul_ps(sy, e1z), _mm_mul_ps(sz, e1y));
+        __m128 qy = _mm_sub_ps(_mm_mul_ps(sz, e1x), _mm_mul_ps(sx, e1z));
+        __m128 qz = _mm_sub_ps(_mm_mul_ps(sx, e1y), _mm_mul_ps(sy, e1x));
+        __m128 hit_v = _mm_mul_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(dx, qx), _mm_mul_ps(dy, qy)), _mm_mul_ps(dz, qz)), inv_det);
+        __m128 hit_t = _mm_mul_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(e2x, qx), _mm_mul_ps(e2y, qy)), _mm_mul_ps(e2z, qz)), inv_det);
+
+        __m128 mask = _mm_and_ps(_mm_cmpneq_ps(det, zero), _mm_cmpge_ps(hit_u, zero));
+        mask = _mm_and_ps(mask, _mm_and_ps(_mm_cmpge_ps(hit_v, zero), _mm_cmple_ps(_mm_add_ps(hit_u, hit_v), one)));
+        mask = _mm_and_ps(mask, _mm_and_ps(_mm_cmpge_ps(hit_t, vtmin), _mm_cmple_ps(hit_t, _mm_set1_ps(tmax))));
+        int lanes = _mm_movemask_ps(mask);
+        if (count - i < WIDTH) lanes &= (1 << (count - i)) - 1;
+        if (lanes == 0) continue;
+
+        _mm_storeu_ps(ts, hit_t);
+        _mm_storeu_ps(us, hit_u);
+        _mm_storeu_ps(vs, hit_v);
+        for (size_t l = 0; l < WIDTH; l++) {
+            if (!((lanes >> l) & 1) || (best >= 0 && ts[l] >= t)) continue;
+            best = static_cast<int>(i + l);
+            t = tmax = ts[l];
+            u = us[l];
+            v = vs[l];
+        }
+    }
+    return best;
+}
+
+LEAF_KERNEL_TARGET("avx2")
+static int LeafIntersectAvx2(const float origin[3], const float direction[3], const TriangleBuffer& triangles, size_t first, size_t count, float tmin, float tmax, float& t, float& u, float& v) {
+    const size_t WIDTH = 8;
+    const __m256 ox = _mm256_set1_ps(origin[0]), oy = _mm256_set1_ps(origin[1]), oz = _mm256_set1_ps(origin[2]);
+    const __m256 dx = _mm256_set1_ps(direction[0]), dy = _mm256_set1_ps(direction[1]), dz = _mm256_set1_ps(direction[2]);
+    const __m256 zero = _mm256_setzero_ps(), one = _mm256_set1_ps(1.0f), vtmin = _mm256_set1_ps(tmin);
+
+    int best = -1;
+    float ts[WIDTH], us[WIDTH], vs[WIDTH];
+    for (size_t i = 0; i < count; i += WIDTH) {
+        size_t k = first + i;
+        __m256 e1x = _mm256_loadu_ps(&triangles.e1_x_[k]), e1y = _mm256_loadu_ps(&triangles.e1_y_[k]), e1z = _mm256_loadu_ps(&triangles.e1_z_[k]);
+        __m256 e2x = _mm256_loadu_ps(&triangles.e2_x_[k]), e2y = _mm256_loadu_ps(&triangles.e2_y_[k]), e2z = _mm256_loadu_ps(&triangles.e2_z_[k]);
+
+        __m256 px = _mm256_sub_ps(_mm256_mul_ps(dy, e2z), _mm256_mul_ps(dz, e2y));
+        __m256 py = _mm256_sub_ps(_mm256_mul_ps(dz, e2x), _mm256_mul_ps(dx, e2z));
+        __m256 pz = _mm256_sub_ps(_mm256_mul_ps(dx, e2y), _mm256_mul_ps(dy, e2x));
+        __m256 det = _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(e1x, px), _mm256_mul_ps(e1y, py)), _mm256_mul_ps(e1z, pz));
+        __m256 inv_det = _mm256_div_ps(one, det);
+
+        __m256 sx = _mm256_sub_ps(ox, _mm256_loadu_ps(&triangles.v0_x_[k]));
+        __m256 sy = _mm256_sub_ps(oy, _mm256_loadu_ps(&triangles.v0_y_[k]));
+        __m256 sz = _mm256_sub_ps(oz, _mm256_loadu_ps(&triangles.v0_z_[k]));
+        __m256 hit_u = _mm256_mul_ps(_mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(sx, px), _mm256_mul_ps(sy, py)), _mm256_mul_ps(sz, pz)), inv_det);
+
+        __m256 qx = _mm256_sub_ps(_mm256_mul_ps(sy, e1z), _mm256_mul_ps(sz, e1y));
+        __m256 qy = _mm256_sub_ps(_mm256_mul_ps(sz, e1x), _mm256_mul_ps(sx, e1z));
+        __m256 qz = _mm256_sub_ps(_mm256_mul_ps(sx, e1y), _mm256_mul_ps(sy, e1x));
+        __m256 hit_v = _mm256_mul_ps(_mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(dx, qx), _mm256_mul_ps(dy, qy)), _mm256_mul_ps(dz, qz)), inv_det);
+        __m256 hit_t = _mm256_mul_ps(_mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(e2x, qx), _mm256_mul_ps(e2y, qy)), _mm256_mul_ps(e2z, qz)), inv_det);
+
+        __m256 mask = _mm256_and_ps(_mm256_cmp_ps(det, zero, _CMP_NEQ_OQ), _mm256_cmp_ps(hit_u, zero, _CMP_GE_OQ));
+        mask = _mm256_and_ps(mask, _mm256_and_ps(_mm256_cmp_ps(hit_v, zero, _CMP_GE_OQ), _mm256_cmp_ps(_mm256_add_ps(hit_u, hit_v), one, _CMP_LE_OQ)));
+        mask = _mm256_and_ps(mask, _mm256_and_ps(_mm256_cmp_ps(hit_t, vtmin, _CMP_GE_OQ), _mm256_cmp_ps(hit_t, _mm256_set1_ps(tmax), _CMP_LE_OQ)));
+        int lanes = _mm256_movemask_ps(mask);
+        if (count - i < WIDTH) lanes &= (1 << (count - i)) - 1;
+        if (lanes == 0) continue;
+
+        _mm256_storeu_ps(ts, hit_t);
+        _mm256_storeu_ps(us, hit_u);
+        _mm256_storeu_ps(vs, hit_v);
+        for (size_t l = 0; l < WIDTH; l++) {
+            if (!((lanes >> l) & 1) || (best >= 0 && ts[l] >= t)) continue;
+            best = static_cast<int>(i + l);
+            t = tmax = ts[l];
+            u = us[l];
+            v = vs[l];
+        }
+    }
+    return best;
+}
+
+LEAF_KERNEL_TARGET("avx512f")
+static int LeafIntersectAvx512(const float origin[3], const float direction[3], const TriangleBuffer& triangles, size_t first, size_t count, float tmin, float tmax, float& t, float& u, float& v) {
+    const size_t WIDTH = 16;
+    const __m512 ox = _mm512_set1_ps(origin[0]), oy = _mm512_set1_ps(origin[1]), oz = _mm512_set1_ps(origin[2]);
+    const __m512 dx = _mm512_set1_ps(direction[0]), dy = _mm512_set1_ps(direction[1]), dz = _mm512_set1_ps(direction[2]);
+    const __m512 zero = _mm512_setzero_ps(), one = _mm512_set1_ps(1.0f), vtmin = _mm512_set1_ps(tmin);
+
+    int best = -1;
+    float ts[WIDTH], us[WIDTH], vs[WIDTH];
+    for (size_t i = 0; i < count; i += WIDTH) {
+        size_t k = first + i;
+        __m512 e1x = _mm512_loadu_ps(&triangles.e1_x_[k]), e1y = _mm512_loadu_ps(&triangles.e1_y_[k]), e1z = _mm512_loadu_ps(&triangles.e1_z_[k]);
+        __m512 e2x = _mm512_loadu_ps(&triangles.e2_x_[k]), e2y = _mm512_loadu_ps(&triangles.e2_y_[k]), e2z = _mm512_loadu_ps(&triangles.e2_z_[k]);
+
+        __m512 px = _mm512_sub_ps(_mm512_mul_ps(dy, e2z), _mm512_mul_ps(dz, e2y));
+        __m512 py = _mm512_sub_ps(_mm512_mul_ps(dz, e2x), _mm512_mul_ps(dx, e2z));
+        __m512 pz = _mm512_sub_ps(_mm512_mul_ps(dx, e2y), _mm512_mul_ps(dy, e2x));
+        __m512 det = _mm512_add_ps(_mm512_add_ps(_mm512_mul_ps(e1x, px), _mm512_mul_ps(e1y, py)), _mm512_mul_ps(e1z, pz));
+        __m512 inv_det = _mm512_div_ps(one, det);
+
+        __m512 sx = _mm512_sub_ps(ox, _mm512_loadu_ps(&triangles.v0_x_[k]));
+        __m512 sy = _mm512_sub_ps(oy, _mm512_loadu_ps(&triangles.v0_y_[k]));
+        __m512 sz = _mm512_sub_ps(oz, _mm512_loadu_ps(&triangles.v0_z_[k]));
+        __m512 hit_u = _mm512_mul_ps(_mm512_add_ps(_mm512_add_ps(_mm512_mul_ps(sx, px), _mm512_mul_ps(sy, py)), _mm512_mul_ps(sz, pz)), inv_det);
+
+        __m512 qx = _mm512_sub_ps(_mm512_mul_ps(sy, e1z), _mm512_mul_ps(sz, e1y));
+        __m512 qy = _mm512_sub_ps(_mm512_mul_ps(sz, e1x), _mm512_mul_ps(sx, e1z));
+        __m512 qz = _mm512_sub_ps(_mm512_mul_ps(sx, e1y), _mm512_mul_ps(sy, e1x));
+        __m512 hit_v = _mm512_mul_ps(_mm512_add_ps(_mm512_add_ps(_mm512_mul_ps(dx, qx), _mm512_mul_ps(dy, qy)), _mm512_mul_ps(dz, qz)), inv_det);
+        __m512 hit_t = _mm512_mul_ps(_mm512_add_ps(_mm512_add_ps(_mm512_mul_ps(e2x, qx), _mm512_mul_ps(e2y, qy)), _mm512_mul_ps(e2z, qz)), inv_det);
+
+        __mmask16 lanes = _mm512_cmp_ps_mask(det, zero, _CMP_NEQ_OQ) & _mm512_cmp_ps_mask(hit_u, zero, _CMP_GE_OQ);
+        lanes &= _mm512_cmp_ps_mask(hit_v, zero, _CMP_GE_OQ) & _mm512_cmp_ps_mask(_mm512_add_ps(hit_u, hit_v), one, _CMP_LE_OQ);
+        lanes &= _mm512_cmp_ps_mask(hit_t, vtmin, _CMP_GE_OQ) & _mm512_cmp_ps_mask(hit_t, _mm512_set1_ps(tmax), _CMP_LE_OQ);
+        if (count - i < WIDTH) lanes &= (1 << (count - i)) - 1;
+        if (lanes == 0) continue;
+
+        _mm512_storeu_ps(ts, hit_t);
+        _mm512_storeu_ps(us, hit_u);
+        _mm512_storeu_ps(vs, hit_v);
+        for (size_t l = 0; l < WIDTH; l++) {
+            if (!((lanes >> l) & 1) || (best >= 0 && ts[l] >= t)) continue;
+            best = static_cast<int>(i + l);
+            t = tmax = ts[l];
+            u = us[l];
+            v = vs[l];
+        }
+    }
+    return best;
+}
+
+#endif
+
+/**
+    @return true if the CPU, and the operating system for the wider registers, support the kernel
+*/
+static bool CpuSupports(LeafKernelType type) {
+    if (type == LeafKernelType::SCALAR) return true;
+
+#if defined(LEAF_KERNEL_X86) && (defined(__GNUC__) || defined(__clang__))
+    __builtin_cpu_init();
+    switch (type) {
+    case LeafKernelType::SSE42: return __builtin_cpu_supports("sse4.2");
+    case LeafKernelType::AVX2: return __builtin_cpu_supports("avx2");
+    case LeafKernelType::AVX512: return __builtin_cpu_supports("avx512f");
+    default: return false;
+    }
+#elif defined(LEAF_KERNEL_X86) && defined(_MSC_VER)
+    int info[4];
+    __cpuid(info, 1);
+    bool sse42 = (info[2] >> 20) & 1;
+    bool osxsave = (info[2] >> 27) & 1;
+    /* The operating system must save the AVX (bits 1, 2) and AVX-512 (bits 5, 6, 7) registers */
+    unsigned long long xcr0 = osxsave ? _xgetbv(0) : 0;
+    __cpuidex(info, 7, 0);
+    switch (type) {
+    case LeafKernelType::SSE42: return sse42;
+    case LeafKernelType::AVX2: return ((info[1] >> 5) & 1) && (xcr0 & 0x6) == 0x6;
+    case LeafKernelType::AVX512: return ((info[1] >> 16) & 1) && (xcr0 & 0xe6) == 0xe6;
+    default: return false;
+    }
+#else
+    return false;
+#endif
+}
+
+LeafIntersectionKernel GetLeafIntersectionKernel(LeafKernelType type) {
+    if (!CpuSupports(type)) return nullptr;
+
+    switch (type) {
+#ifdef LEAF_KERNEL_X86
+    case LeafKernelType::SSE42: return LeafIntersectSse42;
+    case LeafKernelType::AVX2: return LeafIntersectAvx2;
+    case LeafKernelType::AVX512: return LeafIntersectAvx512;
+#endif
+    case LeafKernelType::SCALAR: return LeafIntersectScalar;
+    default: return nullptr;
+    }
+}
+
+/* The widest kernel the CPU supports, detected on the first call */
+static LeafKernelType BestLeafKernelType() {
+    static const LeafKernelType best = []() {
+        const LeafKernelType types[] = { LeafKernelType::AVX512, LeafKernelType::AVX2, LeafKernelType::SSE42 };
+        for (size_t i = 0; i < 3; i++) {
+            if (GetLeafIntersectionKernel(types[i])) return types[i];
+        }
+        return LeafKernelType::SCALAR;
+    }();
+    return best;
+}
+
+LeafIntersectionKernel GetLeafIntersectionKernel() {
+    static const LeafIntersectionKernel kernel = GetLeafIntersectionKernel(BestLeafKernelType());
+    return kernel;
+}
+
+size_t GetLeafIntersectionKernelWidth() {
+    switch (BestLeafKernelType()) {
+    case LeafKernelType::AVX512: return 16;
+    case LeafKernelType::AVX2: return 8;
+    case LeafKernelType::SSE42: return 4;
+    default: return 1;
+    }
+}
+
+const char * GetLeafIntersectionKernelName() {
+    switch (BestLeafKernelType()) {
+    case LeafKernelType::AVX512: return "AVX-512";
+    case LeafKernelType::AVX2: return "AVX2";
+    case LeafKernelType::SSE42: return "SSE4.2";
+    default: return "Scalar";
+    }
+}
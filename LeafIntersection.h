@@ -0,0 +1,49 @@
+#ifndef __LeafIntersection_h__
+#define __LeafIntersection_h__
+
+#include <cstddef>
+
+#include "RayTriangleIntersection.hpp"
+
+/**
+    Vectorised Möller–Trumbore tests of one ray against the triangles of a leaf, in single
+    precision. Finds the nearest triangle of the range [first, first + count) of a triangle
+    buffer hit inside [tmin, tmax]
+    @param origin The ray origin
+    @param direction The ray direction
+    @param triangles The triangle buffer. The kernels read up to TriangleBuffer::PADDING
+        triangles past the end of the range, from the padding of the buffer
+    @param[out] t, u, v The hit distance and barycentrics, written only on a hit
+    @return The index of the triangle hit relative to first, its lane, or -1 if none is hit
+*/
+typedef int (*LeafIntersectionKernel)(const float origin[3], const float direction[3], const TriangleBuffer& triangles, size_t first, size_t count, float tmin, float tmax, float& t, float& u, float& v);
+
+enum class LeafKernelType {
+    SCALAR,
+    SSE42,
+    AVX2,
+    AVX512,
+};
+
+/**
+    @return The kernel of that type, or nullptr if the CPU or the compiler does not support it
+*/
+LeafIntersectionKernel GetLeafIntersectionKernel(LeafKernelType type);
+
+/**
+    @return The widest kernel the CPU supports, detected once
+*/
+LeafIntersectionKernel GetLeafIntersectionKernel();
+
+/**
+    @return The number of triangles the kernel returned by GetLeafIntersectionKernel() tests at
+        once, 1 for the scalar one
+*/
+size_t GetLeafIntersectionKernelWidth();
+
+/**
+    @return The name of the kernel returned by GetLeafIntersectionKernel()
+*/
+const char * GetLeafIntersectionKernelName();
+
+#endif
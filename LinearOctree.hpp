@@ -0,0 +1,251 @@
+#ifndef __LinearOctree_hpp__
+#define __LinearOctree_hpp__
+
+#include <algorithm>
+#include <limits>
+
+#include "Ray.hpp"
+
+/**
+    Count the set bits of a child mask
+*/
+inline unsigned int PopCount8(unsigned char x) {
+    unsigned int v = x;
+    v = v - ((v >> 1) & 0x55u);
+    v = (v & 0x33u) + ((v >> 2) & 0x33u);
+    return (v + (v >> 4)) & 0x0Fu;
+}
+
+/**
+    A node of an octree packed in a contiguous array. The non empty children of an inner
+    node are stored next to each other in the node array. The items of a leaf are stored
+    next to each other in a separate items array
+*/
+struct LinearOctreeNode {
+    /* Inner node: index of the first child in the nodes array. Leaf: index of the first item in the items array */
+    unsigned int first_;
+    /* Leaf: number of items */
+    unsigned int count_;
+    /* Bit i is set if octant i has a child. Zero for leaves */
+    unsigned char child_mask_;
+
+    bool IsLeaf() const {
+        return child_mask_ == 0;
+    }
+
+    bool HasChild(int octant) const {
+        return (child_mask_ >> octant) & 1;
+    }
+
+    /* Index of the child at that octant, the child must exist */
+    unsigned int Child(int octant) const {
+        return first_ + PopCount8(child_mask_ & ((1u << octant) - 1));
+    }
+};
+
+/**
+    Revelles ray traversal over a linear octree. Leaves are reported to a visitor in the order
+    the ray hits them:
+
+        bool visitor(const LinearOctreeNode& leaf, Real_t t_enter, Real_t t_exit)
+
+    The visitor returns true to end the traversal. The traversal is iterative, it keeps the 
+    inner nodes of the current path in a fixed size stack of MAX_DEPTH frames, so the octree 
+    must not have inner nodes deeper than MAX_DEPTH - 1
+*/
+template<int MAX_DEPTH>
+class LinearOctreeTraversal {
+public:
+
+    /**
+        @param nodes The node array, the root is at index 0
+        @param origin The "bottom left" point of the octree area
+        @param length The size of the octree region in all directions
+        @param r The 3D space ray
+        @param tmin The start of the ray interval
+        @param tmax The end of the ray interval. This is a reference, a visitor can shorten the
+            ray while traversing by changing the referenced value
+        @param visitor Called for every leaf hit
+    */
+    template<typename LeafVisitor>
+    static void RayCast(const LinearOctreeNode * nodes, Point3D& origin, Real_t length, Ray3D r, Real_t tmin, const Real_t& tmax, LeafVisitor& visitor) {
+        unsigned char a = 0;
+
+        /**
+            If ray has negative components calculate the reflection of the ray
+        */
+        if (r.Direction()[0] < 0) {
+            r.Origin()[0] = (origin[0] + length / 2.0) * 2 - r.Origin()[0];
+            r.Direction()[0] = -r.Direction()[0];
+            a |= 4;
+        }
+        if (r.Direction()[1] < 0) {
+            r.Origin()[1] = (origin[1] + length / 2.0) * 2 - r.Origin()[1];
+            r.Direction()[1] = -r.Direction()[1];
+            a |= 2;
+        }
+        if (r.Direction()[2] < 0) {
+            r.Origin()[2] = (origin[2] + length / 2.0) * 2 - r.Origin()[2];
+            r.Direction()[2] = -r.Direction()[2];
+            a |= 1;
+        }
+
+        /* 
+            A zero component would give infinite entry and exit values along that axis and their 
+            middle is not defined. Tilt the ray by a negligible amount instead
+        */
+        for (size_t i = 0; i < 3; i++) {
+            if (r.Direction()[i] == 0) r.Direction()[i] = std::numeric_limits<Real_t>::epsilon();
+        }
+
+        /*
+            Compute the starting parametric values of entry and exit for the root node
+        */
+
+        Real_t divx = Real_t(1) / r.Direction()[0];
+        Real_t divy = Real_t(1) / r.Direction()[1];
+        Real_t divz = Real_t(1) / r.Direction()[2];
+
+        Real_t tx0 = (origin[0] - r.Origin()[0]) * divx;
+        Real_t tx1 = (origin[0] + length - r.Origin()[0]) * divx;
+        Real_t ty0 = (origin[1] - r.Origin()[1]) * divy;
+        Real_t ty1 = (origin[1] + length - r.Origin()[1]) * divy;
+        Real_t tz0 = (origin[2] - r.Origin()[2]) * divz;
+        Real_t tz1 = (origin[2] + length - r.Origin()[2]) * divz;
+
+        /* If there is intersection, continue */
+        if (std::max(std::max(tx0, ty0), tz0) < std::min(std::min(tx1, ty1), tz1)) {
+            Traverse(nodes, tx0, ty0, tz0, tx1, ty1, tz1, a, tmin, tmax, visitor);
+        }
+    }
+
+private:
+
+    /**
+        An inner node on the current path of the traversal
+    */
+    struct Frame {
+        /* Entry, middle and exit parametric values */
+        Real_t t0_[3];
+        Real_t tm_[3];
+        Real_t t1_[3];
+        /* The node in the nodes array */
+        unsigned int node_;
+        /* The next child to visit, in the reflected octant order. 8 if all children were visited */
+        int current_;
+    };
+
+    template<typename LeafVisitor>
+    static void Traverse(const LinearOctreeNode * nodes, Real_t tx0, Real_t ty0, Real_t tz0, Real_t tx1, Real_t ty1, Real_t tz1, unsigned char a, Real_t tmin, const Real_t& tmax, LeafVisitor& visitor) {
+        Frame stack[MAX_DEPTH];
+        int top = -1;
+
+        /* Skip the root if it lies outside of the [tmin, tmax] interval of the ray */
+        Real_t t_exit = std::min(std::min(tx1, ty1), tz1);
+        Real_t t_enter = std::max(std::max(tx0, ty0), tz0);
+        if (t_exit < tmin || t_enter > tmax) return;
+
+        if (nodes[0].IsLeaf()) {
+            visitor(nodes[0], t_enter, t_exit);
+            return;
+        }
+        Push(stack, top, 0, tx0, ty0, tz0, tx1, ty1, tz1);
+
+        while (top >= 0) {
+            Frame& frame = stack[top];
+            int current_node = frame.current_;
+            if (current_node >= 8) {
+                top--;
+                continue;
+            }
+
+            /* 
+                The interval of the child along each axis is the lower or the upper half of the 
+                interval of the parent. The next node to visit is the neighbour across the axis
+                with the closest exit, or none if that axis was already at the upper half
+            */
+            Real_t cx0 = (current_node & 4) ? frame.tm_[0] : frame.t0_[0];
+            Real_t cx1 = (current_node & 4) ? frame.t1_[0] : frame.tm_[0];
+            Real_t cy0 = (current_node & 2) ? frame.tm_[1] : frame.t0_[1];
+            Real_t cy1 = (current_node & 2) ? frame.t1_[1] : frame.tm_[1];
+            Real_t cz0 = (current_node & 1) ? frame.tm_[2] : frame.t0_[2];
+            Real_t cz1 = (current_node & 1) ? frame.t1_[2] : frame.tm_[2];
+
+            frame.current_ = NewNode(
+                cx1, (current_node & 4) ? 8 : (current_node | 4),
+                cy1, (current_node & 2) ? 8 : (current_node | 2),
+                cz1, (current_node & 1) ? 8 : (current_node | 1));
+
+            const LinearOctreeNode& node = nodes[frame.node_];
+            int index = current_node ^ a;
+            if (!node.HasChild(index)) continue;
+
+            t_exit = std::min(std::min(cx1, cy1), cz1);
+            t_enter = std::max(std::max(cx0, cy0), cz0);
+            if (t_exit < tmin || t_enter > tmax) continue;
+
+            unsigned int child_index = node.Child(index);
+            const LinearOctreeNode& child = nodes[child_index];
+            if (child.IsLeaf()) {
+                if (visitor(child, t_enter, t_exit)) return;
+                continue;
+            }
+
+            Push(stack, top, child_index, cx0, cy0, cz0, cx1, cy1, cz1);
+        }
+    }
+
+    static void Push(Frame * stack, int& top, unsigned int node, Real_t tx0, Real_t ty0, Real_t tz0, Real_t tx1, Real_t ty1, Real_t tz1) {
+        Frame& frame = stack[++top];
+        frame.node_ = node;
+        frame.t0_[0] = tx0;
+        frame.t0_[1] = ty0;
+        frame.t0_[2] = tz0;
+        frame.t1_[0] = tx1;
+        frame.t1_[1] = ty1;
+        frame.t1_[2] = tz1;
+
+        /* Calculate the middle of the entry and exit point */
+        frame.tm_[0] = Real_t(0.5)*(tx0 + tx1);
+        frame.tm_[1] = Real_t(0.5)*(ty0 + ty1);
+        frame.tm_[2] = Real_t(0.5)*(tz0 + tz1);
+
+        /* Calculate the first node to be visited */
+        frame.current_ = FirstNode(tx0, ty0, tz0, frame.tm_[0], frame.tm_[1], frame.tm_[2]);
+    }
+
+    static int FirstNode(Real_t tx0, Real_t ty0, Real_t tz0, Real_t txm, Real_t tym, Real_t tzm) {
+        unsigned char answer = 0;
+
+        if (tx0 > ty0) {
+            if (tx0 > tz0) {
+                if (tym < tx0) answer |= 2;
+                if (tzm < tx0) answer |= 1;
+                return (int)answer;
+            }
+        }
+        else {
+            if (ty0 > tz0) {
+                if (txm < ty0) answer |= 4;
+                if (tzm < ty0) answer |= 1;
+                return (int)answer;
+            }
+        }
+
+        if (txm < tz0) answer |= 4;
+        if (tym < tz0) answer |= 2;
+        return (int)answer;
+    }
+
+    static int NewNode(Real_t txm, int x, Real_t tym, int y, Real_t tzm, int z) {
+        if (txm < tym) {
+            if (txm < tzm) { return x; }
+        }
+        else {
+            if (tym < tzm) { return y; }
+        }
+        return z;
+    }
+};
+
+#endif
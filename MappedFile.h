@@ -0,0 +1,48 @@
+#ifndef __MappedFile_h__
+#define __MappedFile_h__
+
+#include <cstddef>
+#include <string>
+
+/**
+    A file mapped read only into memory. Pages are read by the operating system when they are
+    first touched, and shared with other processes that map the same file
+*/
+class MappedFile {
+public:
+    MappedFile();
+    ~MappedFile();
+
+    MappedFile(const MappedFile&) = delete;
+    MappedFile& operator=(const MappedFile&) = delete;
+
+    /**
+        Map a whole file, after unmapping the current one
+        @return false if the file can't be opened or is empty
+    */
+    bool Open(const std::string& path);
+    void Close();
+
+    bool IsOpen() const {
+        return data_ != nullptr;
+    }
+
+    /* The contents of the file, page aligned */
+    const char * Data() const {
+        return data_;
+    }
+
+    size_t Size() const {
+        return size_;
+    }
+
+private:
+    const char * data_;
+    size_t size_;
+#ifdef _WIN32
+    void * file_;
+    void * mapping_;
+#endif
+};
+
+#endif
@@ -0,0 +1,346 @@
+#include "MeshBuckets.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+#include <deque>
+#include <fstream>
+#include <limits>
+
+#include "BlockReader.h"
+#include "MappedFile.h"
+#include "PLYReader.h"
+#include "TriangleBoxOverlapping.hpp"
+
+/* Bump whenever the layout of the index or of the bucket files changes */
+static const uint32_t BUCKETS_VERSION = 2;
+static const char BUCKETS_MAGIC[8] = { 'R', 'T', 'B', 'U', 'C', 'K', 'E', 'T' };
+/* While the mesh is streamed its cube is split into this many cells per axis, level 2 of the octree */
+static const int ROOT_SIDE = 4;
+static const int ROOT_LEVEL = 2;
+
+struct IndexHeader {
+    char magic_[8];
+    uint32_t version_;
+    uint32_t bucket_size_;
+    uint64_t bucket_count_;
+    float origin_[3];
+    float length_;
+    float center_[3];
+    float scale_;
+    uint64_t vertex_count_;
+    uint64_t triangle_count_;
+    uint64_t content_key_;
+};
+
+/* FNV-1a over the 32 bit words of a block of vertices or triangles, the same for any block size */
+static uint64_t HashWords(uint64_t hash, const void * data, size_t bytes) {
+    const unsigned char * p = static_cast<const unsigned char *>(data);
+    for (size_t i = 0; i + sizeof(uint32_t) <= bytes; i += sizeof(uint32_t)) {
+        uint32_t word;
+        std::memcpy(&word, p + i, sizeof(word));
+        hash = (hash ^ word) * 0x100000001b3ull;
+    }
+    return hash;
+}
+
+/**
+    Call write(cell) for every cell of a cube split into side^3 cells that a triangle overlaps,
+    cells numbered x + side * (y + side * z)
+*/
+template<typename Write>
+static void SpillTriangle(const glm::vec3 (&vertices)[3], glm::vec3 origin, float length, int side, Write write) {
+    glm::vec3 low = glm::min(glm::min(vertices[0], vertices[1]), vertices[2]);
+    glm::vec3 high = glm::max(glm::max(vertices[0], vertices[1]), vertices[2]);
+    float cell = length / side;
+
+    int first[3], last[3];
+    for (int axis = 0; axis < 3; axis++) {
+        first[axis] = std::min(std::max(static_cast<int>(std::floor((low[axis] - origin[axis]) / cell)), 0), side - 1);
+        last[axis] = std::min(std::max(static_cast<int>(std::floor((high[axis] - origin[axis]) / cell)), 0), side - 1);
+    }
+
+    /* Slightly larger cells, so that a triangle on the face between two cells is in both */
+    glm::vec3 half(0.5f * cell * 1.0001f);
+    bool written = false;
+    for (int z = first[2]; z <= last[2]; z++)
+        for (int y = first[1]; y <= last[1]; y++)
+            for (int x = first[0]; x <= last[0]; x++) {
+                glm::vec3 center = origin + cell * glm::vec3(x + 0.5f, y + 0.5f, z + 0.5f);
+                bool single = first[0] == last[0] && first[1] == last[1] && first[2] == last[2];
+                if (single || triBoxOverlap(center, half, vertices[0], vertices[1], vertices[2])) {
+                    write(x + side * (y + side * z));
+                    written = true;
+                }
+            }
+
+    /* Rounding may miss every cell, keep the triangle in the cell of its first vertex */
+    if (!written) write(first[0] + side * (first[1] + side * first[2]));
+}
+
+MeshBuckets::MeshBuckets() : origin_(0.0f), length_(0.0f), center_(0.0f), scale_(1.0f), vertex_count_(0), triangle_count_(0), content_key_(0xcbf29ce484222325ull) {
+
+}
+
+std::string MeshBuckets::BucketPath(const Bucket& bucket) const {
+    return prefix_ + ".bucket" + std::to_string(bucket.file_);
+}
+
+std::shared_ptr<MeshBuckets> MeshBuckets::Ingest(const std::string& ply_path, const std::string& prefix, size_t memory_cap, size_t block_size) {
+    /* 
+        Remove the buckets of an earlier ingest, they would not be overwritten by fewer buckets,
+        and the octree pages and triangle ids PagedTrianglesOctree built from them
+    */
+    if (std::shared_ptr<MeshBuckets> old = Open(prefix)) {
+        for (size_t i = 0; i < old->buckets_.size(); i++) {
+            std::string path = old->BucketPath(old->buckets_[i]);
+            std::remove(path.c_str());
+            std::remove((path + ".octree").c_str());
+            std::remove((path + ".octree.ids").c_str());
+        }
+        std::remove((prefix + ".buckets").c_str());
+    }
+
+    std::shared_ptr<MeshBuckets> mesh(new MeshBuckets());
+    mesh->prefix_ = prefix;
+
+    /* The first pass writes the vertices to a file, mapped by the second pass to find the vertices of the triangles */
+    std::string vertex_path = prefix + ".vertices";
+    std::ofstream vertex_out(vertex_path.c_str(), std::ios_base::out | std::ios_base::binary | std::ios_base::trunc);
+    if (!vertex_out.is_open()) return nullptr;
+
+    glm::dvec3 sum(0.0);
+    glm::vec3 low(std::numeric_limits<float>::max()), high(-std::numeric_limits<float>::max());
+    MappedFile vertex_file;
+    const int cell_count = ROOT_SIDE * ROOT_SIDE * ROOT_SIDE;
+    std::vector<std::unique_ptr<std::ofstream> > outs;
+    std::vector<uint64_t> counts(cell_count, 0);
+
+    /* Called once all the vertices are read */
+    auto start_spilling = [&]() {
+        vertex_out.close();
+        if (!vertex_out || mesh->vertex_count_ == 0 || !vertex_file.Open(vertex_path)) return false;
+
+        glm::vec3 extent = high - low;
+        mesh->scale_ = std::max(extent.x, std::max(extent.y, extent.z));
+        mesh->center_ = glm::vec3(sum / static_cast<double>(mesh->vertex_count_));
+        /* A little larger than the bounds, so that no vertex is on the far faces of the cube */
+        mesh->length_ = std::max(mesh->scale_ * 1.001f, std::numeric_limits<float>::min());
+        mesh->origin_ = low - 0.0005f * glm::vec3(mesh->scale_);
+
+        for (int i = 0; i < cell_count; i++) {
+            Bucket bucket;
+            bucket.file_ = i;
+            outs.emplace_back(new std::ofstream(mesh->BucketPath(bucket).c_str(), std::ios_base::out | std::ios_base::binary | std::ios_base::trunc));
+            if (!outs.back()->is_open()) return false;
+        }
+        return true;
+    };
+
+    bool spilling = false;
+    bool read = PLYReader::streamMesh(ply_path, block_size, [&](const glm::vec3 * vertices, size_t count) {
+        for (size_t i = 0; i < count; i++) {
+            sum += glm::dvec3(vertices[i]);
+            low = glm::min(low, vertices[i]);
+            high = glm::max(high, vertices[i]);
+        }
+        vertex_out.write(reinterpret_cast<const char *>(vertices), static_cast<std::streamsize>(count * sizeof(glm::vec3)));
+        mesh->vertex_count_ += count;
+        mesh->content_key_ = HashWords(mesh->content_key_, vertices, count * sizeof(glm::vec3));
+        return static_cast<bool>(vertex_out);
+    }, [&](const unsigned int * triangles, size_t count) {
+        if (!spilling && !(spilling = start_spilling())) return false;
+        mesh->content_key_ = HashWords(mesh->content_key_, triangles, 3 * count * sizeof(unsigned int));
+
+        for (size_t i = 0; i < count; i++) {
+            Triangle triangle;
+            for (int j = 0; j < 3; j++)
+                std::memcpy(&triangle.vertices_[j], vertex_file.Data() + triangles[3 * i + j] * sizeof(glm::vec3), sizeof(glm::vec3));
+            triangle.id_ = mesh->triangle_count_++;
+            SpillTriangle(triangle.vertices_, mesh->origin_, mesh->length_, ROOT_SIDE, [&](int cell) {
+                outs[cell]->write(reinterpret_cast<const char *>(&triangle), sizeof(Triangle));
+                counts[cell]++;
+            });
+        }
+        return true;
+    });
+    if (read && !spilling) read = spilling = start_spilling();
+
+    for (size_t i = 0; i < outs.size(); i++) {
+        outs[i]->close();
+        read = read && static_cast<bool>(*outs[i]);
+    }
+    vertex_out.close();
+    vertex_file.Close();
+    std::remove(vertex_path.c_str());
+
+    /* The non empty cells are the first buckets */
+    std::deque<Bucket> queue;
+    float cell = mesh->length_ / ROOT_SIDE;
+    for (int i = 0; i < static_cast<int>(outs.size()); i++) {
+        Bucket bucket;
+        bucket.origin_ = mesh->origin_ + cell * glm::vec3(i % ROOT_SIDE, i / ROOT_SIDE % ROOT_SIDE, i / (ROOT_SIDE * ROOT_SIDE));
+        bucket.length_ = cell;
+        bucket.level_ = ROOT_LEVEL;
+        bucket.triangle_count_ = counts[i];
+        bucket.file_ = i;
+        if (read && counts[i] > 0) queue.push_back(bucket);
+        else std::remove(mesh->BucketPath(bucket).c_str());
+    }
+    if (!read) return nullptr;
+
+    /* Split the buckets that don't fit in memory */
+    uint64_t max_triangles = std::max(memory_cap / BYTES_PER_TRIANGLE, static_cast<size_t>(1));
+    uint32_t next_file = cell_count;
+    while (!queue.empty()) {
+        Bucket bucket = queue.front();
+        queue.pop_front();
+
+        std::vector<Bucket> children;
+        if (bucket.triangle_count_ > max_triangles && bucket.level_ < MAX_LEVEL && mesh->Split(bucket, next_file, children, block_size)) {
+            std::remove(mesh->BucketPath(bucket).c_str());
+            queue.insert(queue.end(), children.begin(), children.end());
+        }
+        else mesh->buckets_.push_back(bucket);
+    }
+
+    if (!mesh->WriteIndex()) return nullptr;
+    return mesh;
+}
+
+bool MeshBuckets::Split(const Bucket& bucket, uint32_t& next_file, std::vector<Bucket>& children, size_t block_size) const {
+    BlockReader reader(block_size, sizeof(Triangle));
+    if (!reader.Open(BucketPath(bucket))) return false;
+
+    children.resize(8);
+    std::unique_ptr<std::ofstream> outs[8];
+    for (int i = 0; i < 8; i++) {
+        Bucket& child = children[i];
+        child.length_ = 0.5f * bucket.length_;
+        child.origin_ = bucket.origin_ + child.length_ * glm::vec3(i & 1, (i >> 1) & 1, i >> 2);
+        child.level_ = bucket.level_ + 1;
+        child.triangle_count_ = 0;
+        child.file_ = next_file++;
+        outs[i].reset(new std::ofstream(BucketPath(child).c_str(), std::ios_base::out | std::ios_base::binary | std::ios_base::trunc));
+    }
+
+    bool valid = true;
+    uint64_t count = 0;
+    while (count < bucket.triangle_count_ && valid) {
+        if (reader.Available() < sizeof(Triangle) && !reader.Refill()) {
+            valid = false;
+            break;
+        }
+        Triangle triangle;
+        std::memcpy(&triangle, reader.Data(), sizeof(Triangle));
+        reader.Advance(sizeof(Triangle));
+        count++;
+        SpillTriangle(triangle.vertices_, bucket.origin_, bucket.length_, 2, [&](int cell) {
+            outs[cell]->write(reinterpret_cast<const char *>(&triangle), sizeof(Triangle));
+            children[cell].triangle_count_++;
+        });
+    }
+
+    /* Splitting is pointless if some child has every triangle, e.g. around a vertex shared by many triangles */
+    uint64_t largest = 0;
+    for (int i = 0; i < 8; i++) {
+        outs[i]->close();
+        valid = valid && static_cast<bool>(*outs[i]);
+        largest = std::max(largest, children[i].triangle_count_);
+    }
+    valid = valid && largest < bucket.triangle_count_;
+
+    std::vector<Bucket> kept;
+    for (int i = 0; i < 8; i++) {
+        if (valid && children[i].triangle_count_ > 0) kept.push_back(children[i]);
+        else std::remove(BucketPath(children[i]).c_str());
+    }
+    children.swap(kept);
+    return valid;
+}
+
+bool MeshBuckets::WriteIndex() const {
+    IndexHeader header;
+    std::memset(&header, 0, sizeof(header));
+    std::memcpy(header.magic_, BUCKETS_MAGIC, sizeof(BUCKETS_MAGIC));
+    header.version_ = BUCKETS_VERSION;
+    header.bucket_size_ = sizeof(Bucket);
+    header.bucket_count_ = buckets_.size();
+    for (int i = 0; i < 3; i++) {
+        header.origin_[i] = origin_[i];
+        header.center_[i] = center_[i];
+    }
+    header.length_ = length_;
+    header.scale_ = scale_;
+    header.vertex_count_ = vertex_count_;
+    header.triangle_count_ = triangle_count_;
+    header.content_key_ = content_key_;
+
+    std::ofstream out((prefix_ + ".buckets").c_str(), std::ios_base::out | std::ios_base::binary | std::ios_base::trunc);
+    out.write(reinterpret_cast<const char *>(&header), sizeof(header));
+    out.write(reinterpret_cast<const char *>(buckets_.data()), static_cast<std::streamsize>(buckets_.size() * sizeof(Bucket)));
+    out.close();
+    return static_cast<bool>(out);
+}
+
+std::shared_ptr<MeshBuckets> MeshBuckets::Open(const std::string& prefix) {
+    std::ifstream in((prefix + ".buckets").c_str(), std::ios_base::in | std::ios_base::binary);
+    if (!in.is_open()) return nullptr;
+
+    IndexHeader header;
+    in.read(reinterpret_cast<char *>(&header), sizeof(header));
+    if (!in || std::memcmp(header.magic_, BUCKETS_MAGIC, sizeof(BUCKETS_MAGIC)) != 0) return nullptr;
+    if (header.version_ != BUCKETS_VERSION || header.bucket_size_ != sizeof(Bucket)) return nullptr;
+
+    std::shared_ptr<MeshBuckets> mesh(new MeshBuckets());
+    mesh->prefix_ = prefix;
+    mesh->origin_ = glm::vec3(header.origin_[0], header.origin_[1], header.origin_[2]);
+    mesh->length_ = header.length_;
+    mesh->center_ = glm::vec3(header.center_[0], header.center_[1], header.center_[2]);
+    mesh->scale_ = header.scale_;
+    mesh->vertex_count_ = header.vertex_count_;
+    mesh->triangle_count_ = header.triangle_count_;
+    mesh->content_key_ = header.content_key_;
+    mesh->buckets_.resize(static_cast<size_t>(header.bucket_count_));
+    in.read(reinterpret_cast<char *>(mesh->buckets_.data()), static_cast<std::streamsize>(mesh->buckets_.size() * sizeof(Bucket)));
+    if (!in) return nullptr;
+    return mesh;
+}
+
+bool MeshBuckets::LoadBucket(size_t bucket, std::vector<glm::vec3>& vertices, std::vector<unsigned int>& triangles, std::vector<uint64_t> * triangle_ids) const {
+    const Bucket& b = buckets_[bucket];
+    std::vector<Triangle> stored(static_cast<size_t>(b.triangle_count_));
+    std::ifstream in(BucketPath(b).c_str(), std::ios_base::in | std::ios_base::binary);
+    in.read(reinterpret_cast<char *>(stored.data()), static_cast<std::streamsize>(stored.size() * sizeof(Triangle)));
+    if (!in) return false;
+
+    vertices.resize(3 * stored.size());
+    triangles.resize(3 * stored.size());
+    if (triangle_ids) triangle_ids->resize(stored.size());
+    for (size_t i = 0; i < stored.size(); i++) {
+        for (int j = 0; j < 3; j++) {
+            vertices[3 * i + j] = stored[i].vertices_[j];
+            triangles[3 * i + j] = static_cast<unsigned int>(3 * i + j);
+        }
+        if (triangle_ids) (*triangle_ids)[i] = stored[i].id_;
+    }
+    return true;
+}
+
+bool MeshBuckets::BuildOctrees(TrianglesOctreeConfig config, const std::function<bool(size_t bucket, const std::vector<glm::vec3>& vertices, const std::vector<unsigned int>& triangles, const std::vector<uint64_t>& triangle_ids, TrianglesOctreeBase& octree)>& body) const {
+    std::vector<glm::vec3> vertices;
+    std::vector<unsigned int> triangles;
+    std::vector<uint64_t> triangle_ids;
+    for (size_t i = 0; i < buckets_.size(); i++) {
+        if (!LoadBucket(i, vertices, triangles, &triangle_ids)) return false;
+
+        const Bucket& bucket = buckets_[i];
+        Point3D origin({ bucket.origin_.x, bucket.origin_.y, bucket.origin_.z });
+        std::unique_ptr<TrianglesOctreeBase> octree(NewTrianglesOctree(config, origin, bucket.length_, vertices, triangles));
+        if (!octree) return false;
+        octree->CompileTriangleData(vertices, triangles);
+        if (!body(i, vertices, triangles, triangle_ids, *octree)) return false;
+    }
+    return true;
+}
@@ -0,0 +1,141 @@
+#ifndef __MeshBuckets_h__
+#define __MeshBuckets_h__
+
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include <glm/glm.hpp>
+
+#include "TrianglesOctreeConfig.h"
+
+/**
+    A mesh too large for memory, split into spatial buckets stored on disk. The buckets are the
+    cells of an octree over the bounding cube of the mesh, each small enough to be loaded, and
+    to have its triangles octree built, within a memory cap. A triangle is stored in every
+    bucket it overlaps, with its vertex positions and its index in the source mesh.
+
+    The files are named after a prefix: prefix.buckets holds the index, prefix.bucketN the
+    triangles of bucket N. Files built from a bucket are named after its file, prefix.bucketN.*
+*/
+class MeshBuckets {
+public:
+    struct Bucket {
+        /* The cell of the octree the bucket holds */
+        glm::vec3 origin_;
+        float length_;
+        int level_;
+        uint64_t triangle_count_;
+        /* The N of the name of its file */
+        uint32_t file_;
+    };
+
+    /**
+        Split a PLY file into buckets, streaming it in blocks: the vertices are read and bounded
+        in a first pass, then the triangles are spilled into the bucket files. Buckets with more
+        triangles than fit in memory_cap are split again, down to MAX_LEVEL. The files of an
+        earlier ingest with the same prefix are removed, with the files built from its buckets
+        @param prefix The prefix of the files written
+        @param memory_cap The memory a bucket may take once loaded, with its octree
+        @return nullptr if the file can't be read or the buckets can't be written
+    */
+    static std::shared_ptr<MeshBuckets> Ingest(const std::string& ply_path, const std::string& prefix, size_t memory_cap, size_t block_size = 4 << 20);
+
+    /**
+        Open buckets written by Ingest
+        @return nullptr if there are none, or they were written by another version
+    */
+    static std::shared_ptr<MeshBuckets> Open(const std::string& prefix);
+
+    /* The deepest level a bucket is split to */
+    static const int MAX_LEVEL = 8;
+    /* The estimated bytes per triangle of a loaded bucket with its triangles octree */
+    static const size_t BYTES_PER_TRIANGLE = 192;
+
+    /* The bounding cube of the mesh, the root of the octree the buckets are cells of */
+    glm::vec3 Origin() const {
+        return origin_;
+    }
+
+    float Length() const {
+        return length_;
+    }
+
+    /**
+        The transform PLYReader applies to an in memory mesh, position = (position - Center()) / Scale()
+    */
+    glm::vec3 Center() const {
+        return center_;
+    }
+
+    float Scale() const {
+        return scale_;
+    }
+
+    uint64_t VertexCount() const {
+        return vertex_count_;
+    }
+
+    /* The triangles of the source mesh, counted once */
+    uint64_t TriangleCount() const {
+        return triangle_count_;
+    }
+
+    /* A hash of the vertices and the triangles of the source mesh, for the keys of files built from the buckets */
+    uint64_t ContentKey() const {
+        return content_key_;
+    }
+
+    const std::vector<Bucket>& Buckets() const {
+        return buckets_;
+    }
+
+    /**
+        Load the triangles of a bucket, as three unshared vertices each
+        @param triangle_ids The index of each triangle in the source mesh, if not null
+    */
+    bool LoadBucket(size_t bucket, std::vector<glm::vec3>& vertices, std::vector<unsigned int>& triangles, std::vector<uint64_t> * triangle_ids = nullptr) const;
+
+    /**
+        Load the buckets one at a time and build their triangles octrees over their cells.
+        Only one bucket is in memory at a time
+        @param body Called with each bucket, its triangles, their ids and its octree. Returning
+            false stops
+        @return false if a bucket can't be loaded or body returned false
+    */
+    bool BuildOctrees(TrianglesOctreeConfig config, const std::function<bool(size_t bucket, const std::vector<glm::vec3>& vertices, const std::vector<unsigned int>& triangles, const std::vector<uint64_t>& triangle_ids, TrianglesOctreeBase& octree)>& body) const;
+
+    /* The path of the file of a bucket */
+    std::string BucketPath(const Bucket& bucket) const;
+
+private:
+    /* A triangle as stored in a bucket file */
+    struct Triangle {
+        glm::vec3 vertices_[3];
+        uint64_t id_;
+    };
+
+    std::string prefix_;
+    glm::vec3 origin_;
+    float length_;
+    glm::vec3 center_;
+    float scale_;
+    uint64_t vertex_count_;
+    uint64_t triangle_count_;
+    uint64_t content_key_;
+    std::vector<Bucket> buckets_;
+
+    MeshBuckets();
+
+    bool WriteIndex() const;
+    /**
+        Split a bucket into the buckets of its 8 children, streaming its file
+        @return false if it can't be read, or no child is smaller than it
+    */
+    bool Split(const Bucket& bucket, uint32_t& next_file, std::vector<Bucket>& children, size_t block_size) const;
+};
+
+#endif
@@ -0,0 +1,94 @@
+#ifndef __MortonCode_hpp__
+#define __MortonCode_hpp__
+
+#include <algorithm>
+#include <cstdint>
+#include <vector>
+
+#include "ThreadPool.h"
+
+/* Number of bits per axis that fit in a 64 bit Morton code */
+static const int MORTON_MAX_DEPTH = 21;
+
+/**
+    A Morton code and the index of the item it was computed for
+*/
+struct MortonKey {
+    uint64_t key_;
+    unsigned int index_;
+};
+
+/**
+    Spread the lower 21 bits of x, so that two zero bits lie between each of them
+*/
+inline uint64_t MortonSpreadBits(uint64_t x) {
+    x &= 0x1fffff;
+    x = (x | x << 32) & 0x1f00000000ffffull;
+    x = (x | x << 16) & 0x1f0000ff0000ffull;
+    x = (x | x << 8) & 0x100f00f00f00f00full;
+    x = (x | x << 4) & 0x10c30c30c30c30c3ull;
+    x = (x | x << 2) & 0x1249249249249249ull;
+    return x;
+}
+
+/**
+    Interleave the bits of the cell coordinates x, y, z. Each group of three bits is the octant
+    at one level with the same numbering as the octrees (x: 4, y: 2, z: 1), the most significant
+    group is the octant at the root
+*/
+inline uint64_t MortonEncode(uint64_t x, uint64_t y, uint64_t z) {
+    return (MortonSpreadBits(x) << 2) | (MortonSpreadBits(y) << 1) | MortonSpreadBits(z);
+}
+
+/**
+    Stable sort of Morton keys, a least significant digit radix sort with 8 bit digits. Each thread
+    histograms and scatters its own slice of the keys
+    @param keys The keys to sort
+    @param bits The number of lower bits of the keys that are used
+    @param pool The threads to use
+*/
+inline void ParallelRadixSort(std::vector<MortonKey>& keys, int bits, ThreadPool& pool) {
+    const size_t RADIX = 256;
+    size_t n = keys.size();
+    if (n < 2) return;
+
+    size_t slices = pool.Size();
+    size_t slice_size = (n + slices - 1) / slices;
+    std::vector<MortonKey> buffer(n);
+    std::vector<size_t> offsets(slices * RADIX);
+
+    for (int shift = 0; shift < bits; shift += 8) {
+        std::fill(offsets.begin(), offsets.end(), 0);
+
+        /* Count the digits in each slice */
+        pool.ParallelFor(slices, 1, [&](size_t begin, size_t end) {
+            for (size_t s = begin; s < end; s++) {
+                size_t * histogram = &offsets[s * RADIX];
+                for (size_t i = s * slice_size; i < std::min(n, (s + 1) * slice_size); i++)
+                    histogram[(keys[i].key_ >> shift) & 0xff]++;
+            }
+        });
+
+        /* Turn the counts into the output position of each digit of each slice, slices keep their order */
+        size_t sum = 0;
+        for (size_t d = 0; d < RADIX; d++) {
+            for (size_t s = 0; s < slices; s++) {
+                size_t count = offsets[s * RADIX + d];
+                offsets[s * RADIX + d] = sum;
+                sum += count;
+            }
+        }
+
+        pool.ParallelFor(slices, 1, [&](size_t begin, size_t end) {
+            for (size_t s = begin; s < end; s++) {
+                size_t * offset = &offsets[s * RADIX];
+                for (size_t i = s * slice_size; i < std::min(n, (s + 1) * slice_size); i++)
+                    buffer[offset[(keys[i].key_ >> shift) & 0xff]++] = keys[i];
+            }
+        });
+
+        keys.swap(buffer);
+    }
+}
+
+#endif
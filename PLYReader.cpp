@@ -1,142 +1,939 @@
 #include <iostream>
+#include <sstream>
+#include <charconv>
 #include <cstring>
+#include <cstdint>
+#include <algorithm>
+#include <atomic>
 #include <vector>
 #include "PLYReader.h"
+#include "MappedFile.h"
+#include "BlockReader.h"
+#include "ThreadPool.h"
 
-#define min(a,b)            (((a) < (b)) ? (a) : (b))
-#define max(a,b)            (((a) > (b)) ? (a) : (b))
+
+// Vertices and faces are decoded by the threads in chunks of this many records
+static const size_t VERTEX_CHUNK_SIZE = 65536;
+static const size_t FACE_CHUNK_SIZE = 65536;
+// Streamed vertices and triangles are passed on in batches of this many
+static const size_t STREAM_BATCH_SIZE = 65536;
+// The longest record a streamed file can have
+static const size_t STREAM_RECORD_SIZE = 1 << 20;
+// ASCII bodies are split in chunks of about this many bytes, that start at the start of a line
+static const size_t ASCII_CHUNK_SIZE = 1 << 20;
+
+
+static bool hostBigEndian()
+{
+	uint16_t one = 1;
+	unsigned char first;
+
+	memcpy(&first, &one, 1);
+	return first == 0;
+}
+
+static bool blankLine(const char *p, const char *end)
+{
+	for(; p<end; p++)
+		if(*p != ' ' && *p != '\t' && *p != '\r')
+			return false;
+
+	return true;
+}
 
 bool PLYReader::readMesh(const string &filename, TriangleMesh &mesh)
 {
-	ifstream fin;
-	int nVertices, nFaces;
+	MappedFile mapped;
+	Format format;
+	vector<Element> elements;
+	size_t headerSize;
+	File file;
+	int vertexElement = -1;
+	unsigned int i;
 
-	fin.open(filename.c_str(), ios_base::in | ios_base::binary);
-	if(!fin.is_open())
+	if(!mapped.Open(filename))
+		return false;
+	if(!loadHeader(mapped.Data(), mapped.Size(), format, elements, headerSize))
 		return false;
-	if(!loadHeader(fin, nVertices, nFaces))
+	for(i=0; i<elements.size(); i++)
+		if(elements[i].name == "vertex" && vertexElement < 0)
+			vertexElement = i;
+	if(vertexElement < 0 || elements[vertexElement].count == 0)
+		return false;
+
+	file.data = mapped.Data();
+	file.end = mapped.Data() + mapped.Size();
+	file.swap = (format == BINARY_BIG_ENDIAN) != hostBigEndian();
+
+	// Elements are stored one after the other, in the order of the header
+	size_t nVertices = elements[vertexElement].count;
+	glm::vec3 *vertices = mesh.ResizeVertices(nVertices);
+	const char *p = file.data + headerSize;
+	if(format == ASCII && !loadAscii(file, p, elements, vertices, mesh))
+		p = NULL;
+	for(i=0; i<elements.size() && p != NULL && format != ASCII; i++)
+	{
+		if(elements[i].name == "vertex")
+		{
+			if(!loadVertices(file, p, elements[i], vertices))
+				p = NULL;
+			else
+				p = skipElement(file, p, elements[i]);
+		}
+		else if(elements[i].name == "face")
+			p = loadFaces(file, p, elements[i], nVertices, mesh);
+		else
+			p = skipElement(file, p, elements[i]);
+	}
+	if(p == NULL)
 	{
-		fin.close();
+		mesh.ResizeVertices(0);
+		mesh.ResizeTriangles(0);
 		return false;
 	}
 
-	vector<float> plyVertices;
-	vector<int> plyTriangles;
+	rescaleModel(vertices, nVertices);
+
+	return true;
+}
+
+bool PLYReader::streamMesh(const string &filename, size_t blockSize, const function<bool(const glm::vec3 *, size_t)> &vertexBlock, const function<bool(const unsigned int *, size_t)> &triangleBlock)
+{
+	BlockReader reader(blockSize, STREAM_RECORD_SIZE);
+	Format format;
+	vector<Element> elements;
+	size_t headerSize, nVertices = 0;
+	int vertexElement = -1, faceElement = -1;
+	unsigned int i;
+
+	if(!reader.Open(filename))
+		return false;
+	while(!loadHeader(reader.Data(), reader.Available(), format, elements, headerSize))
+		if(!reader.Refill())
+			return false;
+	reader.Advance(headerSize);
+	for(i=0; i<elements.size(); i++)
+	{
+		if(elements[i].name == "vertex" && vertexElement < 0)
+			vertexElement = i;
+		else if(elements[i].name == "face" && faceElement < 0)
+			faceElement = i;
+	}
+	// Triangles are passed on as they are read, they can only refer to vertices read before
+	if(vertexElement < 0 || (faceElement >= 0 && faceElement < vertexElement))
+		return false;
+
+	File file;
+	file.swap = (format == BINARY_BIG_ENDIAN) != hostBigEndian();
+	vector<double> values;
+	vector<size_t> items;
+	const char *list;
+	size_t listSize;
+
+	// Find the end of the next record of an element, reading more of the file if needed
+	auto nextRecord = [&](const Element &element, int listProperty) -> const char *
+	{
+		while(true)
+		{
+			const char *data = reader.Data(), *end = data + reader.Available();
+			if(format != ASCII)
+			{
+				file.data = data;
+				file.end = end;
+				const char *next = skipRecord(file, data, element, listProperty, list, listSize);
+				if(next != NULL || !reader.Refill())
+					return next;
+				continue;
+			}
+			const char *line = (const char *)memchr(data, '\n', end - data);
+			if(line == NULL && reader.Refill())
+				continue;
+			// The last line may have no line break
+			const char *lineEnd = line == NULL ? end : line;
+			if(blankLine(data, lineEnd))
+			{
+				if(line == NULL)
+					return NULL;
+				reader.Advance(line + 1 - data);
+				continue;
+			}
+			if(parseRecord(data, lineEnd, element, listProperty, values, items) == NULL)
+				return NULL;
+			return line == NULL ? end : line + 1;
+		}
+	};
+
+	for(i=0; i<elements.size(); i++)
+	{
+		const Element &element = elements[i];
+		int x = element.findProperty("x"), y = element.findProperty("y"), z = element.findProperty("z");
+		int indices = element.findProperty("vertex_indices");
+		if(indices < 0)
+			indices = element.findProperty("vertex_index");
+		if((int)i == vertexElement && (x < 0 || y < 0 || z < 0 || (format != ASCII && element.size == 0)))
+			return false;
+		if((int)i == faceElement && (indices < 0 || element.properties[indices].countType == INVALID))
+			return false;
+
+		size_t offset[3] = { 0, 0, 0 };
+		if((int)i == vertexElement && format != ASCII)
+		{
+			offset[0] = element.offset(x);
+			offset[1] = element.offset(y);
+			offset[2] = element.offset(z);
+		}
+
+		vector<glm::vec3> vertices;
+		vector<unsigned int> triangles;
+		for(size_t record=0; record<element.count; record++)
+		{
+			const char *next = nextRecord(element, (int)i == faceElement ? indices : -1), *data = reader.Data();
+			if(next == NULL)
+				return false;
+
+			if((int)i == vertexElement)
+			{
+				if(format == ASCII)
+					vertices.push_back(glm::vec3(values[x], values[y], values[z]));
+				else
+					vertices.push_back(glm::vec3(readValue(data + offset[0], element.properties[x].type, file.swap),
+						readValue(data + offset[1], element.properties[y].type, file.swap),
+						readValue(data + offset[2], element.properties[z].type, file.swap)));
+				if(vertices.size() == STREAM_BATCH_SIZE)
+				{
+					if(!vertexBlock(vertices.data(), vertices.size()))
+						return false;
+					vertices.clear();
+				}
+			}
+			else if((int)i == faceElement)
+			{
+				Type type = element.properties[indices].type;
+				size_t nItems = format == ASCII ? items.size() : listSize, tri0 = 0, previous = 0;
+				for(size_t k=0; k<nItems; k++)
+				{
+					size_t index = format == ASCII ? items[k] : readInteger(list + k * typeSize(type), type, file.swap);
+					if(index >= nVertices)
+					{
+						cout << "Face with a vertex index out of range" << endl;
+						return false;
+					}
+					// Polygons are split in a fan around their first vertex
+					if(k == 0)
+						tri0 = index;
+					else if(k > 1)
+					{
+						triangles.push_back((unsigned int)tri0);
+						triangles.push_back((unsigned int)previous);
+						triangles.push_back((unsigned int)index);
+					}
+					previous = index;
+				}
+				if(triangles.size() >= 3 * STREAM_BATCH_SIZE)
+				{
+					if(!triangleBlock(triangles.data(), triangles.size() / 3))
+						return false;
+					triangles.clear();
+				}
+			}
+			reader.Advance(next - data);
+		}
+		if((int)i == vertexElement)
+		{
+			nVertices = element.count;
+			if(!vertices.empty() && !vertexBlock(vertices.data(), vertices.size()))
+				return false;
+		}
+		if(!triangles.empty() && !triangleBlock(triangles.data(), triangles.size() / 3))
+			return false;
+	}
+
+	return true;
+}
 
-	loadVertices(fin, nVertices, plyVertices);
-	loadFaces(fin, nFaces, plyTriangles);
-	fin.close();
+bool PLYReader::loadHeader(const char *data, size_t size, Format &format, vector<Element> &elements, size_t &headerSize)
+{
+	const char *end = data + size, *line = data, *next;
+	bool firstLine = true, hasFormat = false;
+	string keyword;
 
-	rescaleModel(plyVertices);
-	addModelToMesh(plyVertices, plyTriangles, mesh);
+	elements.clear();
+	while(line < end)
+	{
+		next = (const char *)memchr(line, '\n', end - line);
+		if(next == NULL)
+			return false;
+		string text(line, next);
+		if(!text.empty() && text[text.size() - 1] == '\r')
+			text.resize(text.size() - 1);
+		line = next + 1;
+
+		istringstream words(text);
+		keyword.clear();
+		words >> keyword;
+		if(firstLine)
+		{
+			if(keyword != "ply")
+				return false;
+			firstLine = false;
+			continue;
+		}
+		if(keyword == "format")
+		{
+			string name;
+			words >> name;
+			if(name == "ascii")
+				format = ASCII;
+			else if(name == "binary_little_endian")
+				format = BINARY_LITTLE_ENDIAN;
+			else if(name == "binary_big_endian")
+				format = BINARY_BIG_ENDIAN;
+			else
+				return false;
+			hasFormat = true;
+		}
+		else if(keyword == "element")
+		{
+			Element element;
+			long long count = -1;
+			words >> element.name >> count;
+			if(words.fail() || count < 0)
+				return false;
+			element.count = (size_t)count;
+			element.size = 0;
+			elements.push_back(element);
+		}
+		else if(keyword == "property")
+		{
+			Property property;
+			string type;
+			if(elements.empty())
+				return false;
+			words >> type;
+			if(type == "list")
+			{
+				string countType;
+				words >> countType >> type;
+				property.countType = parseType(countType);
+				if(property.countType == INVALID || property.countType == FLOAT32 || property.countType == FLOAT64)
+					return false;
+			}
+			else
+				property.countType = INVALID;
+			property.type = parseType(type);
+			words >> property.name;
+			if(words.fail() || property.type == INVALID)
+				return false;
+			elements.back().properties.push_back(property);
+		}
+		else if(keyword == "end_header")
+		{
+			if(!hasFormat)
+				return false;
+			headerSize = line - data;
+			break;
+		}
+		else if(keyword != "comment" && keyword != "obj_info" && !keyword.empty())
+			return false;
+	}
+	if(keyword != "end_header")
+		return false;
+
+	// Records of elements without lists all have the same size
+	unsigned int i, j;
+	for(i=0; i<elements.size(); i++)
+	{
+		bool fixed = true;
+		for(j=0; j<elements[i].properties.size(); j++)
+		{
+			fixed = fixed && elements[i].properties[j].countType == INVALID;
+			elements[i].size += typeSize(elements[i].properties[j].type);
+		}
+		if(!fixed)
+			elements[i].size = 0;
+	}
+
+	size_t nFaces = 0;
+	for(i=0; i<elements.size(); i++)
+		if(elements[i].name == "face")
+			nFaces = elements[i].count;
+	for(i=0; i<elements.size(); i++)
+		if(elements[i].name == "vertex")
+		{
+			cout << "Loading triangle mesh" << endl;
+			cout << "\tVertices = " << elements[i].count << endl;
+			cout << "\tFaces = " << nFaces << endl;
+			cout << endl;
+		}
 
 	return true;
 }
 
-bool PLYReader::loadHeader(ifstream &fin, int &nVertices, int &nFaces)
+bool PLYReader::loadVertices(const File &file, const char *begin, const Element &element, glm::vec3 *vertices)
 {
-	char line[100];
+	int x = element.findProperty("x"), y = element.findProperty("y"), z = element.findProperty("z");
 
-	fin.getline(line, 100);
-	if(strncmp(line, "ply", 3) != 0)
+	if(x < 0 || y < 0 || z < 0)
 		return false;
-	nVertices = 0;
-	fin.getline(line, 100);
-	while(strncmp(line, "end_header", 10) != 0)
+	if(element.size == 0)
 	{
-		if(strncmp(line, "element vertex", 14) == 0)
-			nVertices = atoi(&line[15]);
-		fin.getline(line, 100);
-		if(strncmp(line, "element face", 12) == 0)
-			nFaces = atoi(&line[13]);
+		cout << "Vertices with list properties are not supported" << endl;
+		return false;
 	}
-	if(nVertices <= 0)
+	if(element.count > (size_t)(file.end - begin) / element.size)
 		return false;
-	cout << "Loading triangle mesh" << endl;
-	cout << "\tVertices = " << nVertices << endl;
-	cout << "\tFaces = " << nFaces << endl;
-	cout << endl;
+
+	size_t size = element.size, offset[3] = { element.offset(x), element.offset(y), element.offset(z) };
+	Type type[3] = { element.properties[x].type, element.properties[y].type, element.properties[z].type };
+	bool swap = file.swap;
+	// The common case of float coordinates in the byte order of the machine is copied as is
+	bool copy = !swap && type[0] == FLOAT32 && type[1] == FLOAT32 && type[2] == FLOAT32;
+
+	ThreadPool::Default().ParallelFor(element.count, VERTEX_CHUNK_SIZE, [&](size_t first, size_t last)
+	{
+		for(size_t i=first; i<last; i++)
+		{
+			const char *record = begin + i * size;
+			for(int c=0; c<3; c++)
+			{
+				if(copy)
+					memcpy(&vertices[i][c], record + offset[c], sizeof(float));
+				else
+					vertices[i][c] = (float)readValue(record + offset[c], type[c], swap);
+			}
+		}
+	});
 
 	return true;
 }
 
-void PLYReader::loadVertices(ifstream &fin, int nVertices, vector<float> &plyVertices)
+const char *PLYReader::loadFaces(const File &file, const char *begin, const Element &element, size_t nVertices, TriangleMesh &mesh)
 {
-	int i;
-	float value;
+	int indices = element.findProperty("vertex_indices");
+	const char *p = begin, *list;
+	size_t listSize, nTriangles = 0, face;
+
+	if(indices < 0)
+		indices = element.findProperty("vertex_index");
+	if(indices < 0 || element.properties[indices].countType == INVALID)
+		return NULL;
+
+	// Polygons have different sizes, so a first pass finds where each chunk of faces starts,
+	// both in the file and in the triangles (a prefix sum of the triangles per polygon)
+	vector<const char *> chunkStart;
+	vector<size_t> chunkTriangle;
+	for(face=0; face<element.count; face++)
+	{
+		if(face % FACE_CHUNK_SIZE == 0)
+		{
+			chunkStart.push_back(p);
+			chunkTriangle.push_back(nTriangles);
+		}
+		p = skipRecord(file, p, element, indices, list, listSize);
+		if(p == NULL)
+			return NULL;
+		if(listSize > 2)
+			nTriangles += listSize - 2;
+	}
 
-	for(i=0; i<nVertices; i++)
+	// The chunks are then triangulated on all the threads, straight into the mesh
+	unsigned int *triangles = mesh.ResizeTriangles(3 * nTriangles);
+	Type type = element.properties[indices].type;
+	size_t indexSize = typeSize(type), nFaces = element.count;
+	atomic<bool> valid(true);
+	ThreadPool::Default().ParallelFor(chunkStart.size(), 1, [&](size_t first, size_t last)
+	{
+		for(size_t chunk=first; chunk<last; chunk++)
+		{
+			const char *q = chunkStart[chunk], *items;
+			unsigned int *out = triangles + 3 * chunkTriangle[chunk];
+			size_t nItems, end = min(nFaces, (chunk + 1) * FACE_CHUNK_SIZE);
+			for(size_t f=chunk*FACE_CHUNK_SIZE; f<end; f++)
+			{
+				size_t tri0 = 0, previous = 0;
+				q = skipRecord(file, q, element, indices, items, nItems);
+				for(size_t k=0; k<nItems; k++)
+				{
+					size_t index = readInteger(items + k * indexSize, type, file.swap);
+					if(index >= nVertices)
+					{
+						valid = false;
+						index = 0;
+					}
+					// Polygons are split in a fan around their first vertex
+					if(k == 0)
+						tri0 = index;
+					else if(k > 1)
+					{
+						*out++ = (unsigned int)tri0;
+						*out++ = (unsigned int)previous;
+						*out++ = (unsigned int)index;
+					}
+					previous = index;
+				}
+			}
+		}
+	});
+	if(!valid)
 	{
-		fin.read((char *)&value, sizeof(float));
-		plyVertices.push_back(value);
-		fin.read((char *)&value, sizeof(float));
-		plyVertices.push_back(value);
-		fin.read((char *)&value, sizeof(float));
-		plyVertices.push_back(value);
+		cout << "Face with a vertex index out of range" << endl;
+		return NULL;
 	}
+
+	return p;
 }
 
-void PLYReader::loadFaces(ifstream &fin, int nFaces, vector<int> &plyTriangles)
+const char *PLYReader::skipElement(const File &file, const char *begin, const Element &element)
 {
-	int i, tri[3];
-	unsigned char nVrtxPerFace;
+	const char *p = begin, *list;
+	size_t listSize, i;
 
-	for(i=0; i<nFaces; i++)
+	if(element.size != 0)
 	{
-		fin.read((char *)&nVrtxPerFace, sizeof(unsigned char));
-		fin.read((char *)&tri[0], sizeof(int));
-		fin.read((char *)&tri[1], sizeof(int));
-		fin.read((char *)&tri[2], sizeof(int));
-		plyTriangles.push_back(tri[0]);
-		plyTriangles.push_back(tri[1]);
-		plyTriangles.push_back(tri[2]);
-		for(; nVrtxPerFace>3; nVrtxPerFace--)
+		if(element.count > (size_t)(file.end - begin) / element.size)
+			return NULL;
+		return begin + element.count * element.size;
+	}
+	for(i=0; i<element.count && p != NULL; i++)
+		p = skipRecord(file, p, element, -1, list, listSize);
+
+	return p;
+}
+
+const char *PLYReader::skipRecord(const File &file, const char *p, const Element &element, int listProperty, const char *&list, size_t &listSize)
+{
+	unsigned int i;
+
+	list = NULL;
+	listSize = 0;
+	for(i=0; i<element.properties.size(); i++)
+	{
+		const Property &property = element.properties[i];
+		size_t size = typeSize(property.type), count = 1;
+		if(property.countType != INVALID)
+		{
+			size_t countSize = typeSize(property.countType);
+			if((size_t)(file.end - p) < countSize)
+				return NULL;
+			count = readInteger(p, property.countType, file.swap);
+			p += countSize;
+		}
+		if(count > (size_t)(file.end - p) / size)
+			return NULL;
+		if((int)i == listProperty)
 		{
-			tri[1] = tri[2];
-			fin.read((char *)&tri[2], sizeof(int));
-			plyTriangles.push_back(tri[0]);
-			plyTriangles.push_back(tri[1]);
-			plyTriangles.push_back(tri[2]);
+			list = p;
+			listSize = count;
 		}
+		p += count * size;
 	}
+
+	return p;
 }
 
-void PLYReader::rescaleModel(vector<float> &plyVertices)
+bool PLYReader::loadAscii(const File &file, const char *begin, const vector<Element> &elements, glm::vec3 *vertices, TriangleMesh &mesh)
 {
+	struct Chunk
+	{
+		const char *begin, *end;
+		size_t firstRecord, nRecords;
+		// The first triangle index of the chunk in the mesh
+		size_t firstTriangle;
+		vector<unsigned int> triangles;
+		bool valid;
+	};
+	int vertexElement = -1, faceElement = -1, x, y, z, indices = -1;
+	vector<size_t> recordStart(1, 0);
 	unsigned int i;
-	glm::vec3 center(0.0f, 0.0f, 0.0f), size[2];
 
-	size[0] = glm::vec3(1e10, 1e10, 1e10);
-	size[1] = glm::vec3(-1e10, -1e10, -1e10);
-	for(i=0; i<plyVertices.size(); i+=3)
+	// Every record is a line, the records of each element follow those of the previous one
+	for(i=0; i<elements.size(); i++)
 	{
-		center += glm::vec3(plyVertices[i], plyVertices[i+1], plyVertices[i+2]);
-		size[0][0] = min(size[0][0], plyVertices[i]);
-		size[0][1] = min(size[0][1], plyVertices[i+1]);
-		size[0][2] = min(size[0][2], plyVertices[i+2]);
-		size[1][0] = max(size[1][0], plyVertices[i]);
-		size[1][1] = max(size[1][1], plyVertices[i+1]);
-		size[1][2] = max(size[1][2], plyVertices[i+2]);
+		if(elements[i].name == "vertex" && vertexElement < 0)
+			vertexElement = i;
+		else if(elements[i].name == "face" && faceElement < 0)
+			faceElement = i;
+		recordStart.push_back(recordStart.back() + elements[i].count);
+	}
+	x = elements[vertexElement].findProperty("x");
+	y = elements[vertexElement].findProperty("y");
+	z = elements[vertexElement].findProperty("z");
+	if(x < 0 || y < 0 || z < 0)
+		return false;
+	if(faceElement >= 0)
+	{
+		indices = elements[faceElement].findProperty("vertex_indices");
+		if(indices < 0)
+			indices = elements[faceElement].findProperty("vertex_index");
+		if(indices < 0 || elements[faceElement].properties[indices].countType == INVALID)
+			return false;
 	}
-	center /= plyVertices.size() / 3;
 
-	float largestSize = max(size[1][0] - size[0][0], max(size[1][1] - size[0][1], size[1][2] - size[0][2]));
+	// Split the body in chunks of whole lines
+	size_t bodySize = file.end - begin, nChunks = max((size_t)1, bodySize / ASCII_CHUNK_SIZE), c;
+	vector<Chunk> chunks;
+	const char *p = begin;
+	for(c=1; c<=nChunks && p<file.end; c++)
+	{
+		const char *q = c == nChunks ? file.end : max(p, begin + bodySize / nChunks * c);
+		if(q < file.end)
+		{
+			q = (const char *)memchr(q, '\n', file.end - q);
+			q = q == NULL ? file.end : q + 1;
+		}
+		Chunk chunk = { p, q, 0, 0, 0, vector<unsigned int>(), true };
+		chunks.push_back(chunk);
+		p = q;
+	}
 
-	for(i=0; i<plyVertices.size(); i+=3)
+	// Count the records of each chunk, so that each chunk knows the index of its first record
+	ThreadPool &pool = ThreadPool::Default();
+	pool.ParallelFor(chunks.size(), 1, [&](size_t first, size_t last)
+	{
+		for(size_t c=first; c<last; c++)
+			for(const char *line=chunks[c].begin, *end; line<chunks[c].end; line=end+1)
+			{
+				end = (const char *)memchr(line, '\n', chunks[c].end - line);
+				if(end == NULL)
+					end = chunks[c].end;
+				if(!blankLine(line, end))
+					chunks[c].nRecords++;
+			}
+	});
+	size_t nRecords = 0;
+	for(c=0; c<chunks.size(); c++)
 	{
-		plyVertices[i] = (plyVertices[i] - center[0]) / largestSize;
-		plyVertices[i+1] = (plyVertices[i+1] - center[1]) / largestSize;
-		plyVertices[i+2] = (plyVertices[i+2] - center[2]) / largestSize;
+		chunks[c].firstRecord = nRecords;
+		nRecords += chunks[c].nRecords;
 	}
+	if(nRecords < recordStart.back())
+		return false;
+
+	// Walk the records of a chunk that belong to an element
+	auto forRecords = [&](const Chunk &chunk, int element, auto body)
+	{
+		size_t record = chunk.firstRecord;
+		for(const char *line=chunk.begin, *end; line<chunk.end && record<recordStart[element + 1]; line=end+1)
+		{
+			end = (const char *)memchr(line, '\n', chunk.end - line);
+			if(end == NULL)
+				end = chunk.end;
+			if(blankLine(line, end))
+				continue;
+			if(record >= recordStart[element] && !body(line, end))
+				return false;
+			record++;
+		}
+		return true;
+	};
+
+	// Parse the vertices, and triangulate the faces of each chunk apart
+	size_t nVertices = elements[vertexElement].count;
+	pool.ParallelFor(chunks.size(), 1, [&](size_t first, size_t last)
+	{
+		vector<double> values;
+		vector<size_t> list;
+		for(size_t c=first; c<last; c++)
+		{
+			Chunk &chunk = chunks[c];
+			size_t vertex = chunk.firstRecord > recordStart[vertexElement] ? chunk.firstRecord - recordStart[vertexElement] : 0;
+			chunk.valid = forRecords(chunk, vertexElement, [&](const char *line, const char *end)
+			{
+				if(parseRecord(line, end, elements[vertexElement], -1, values, list) == NULL)
+					return false;
+				vertices[vertex++] = glm::vec3(values[x], values[y], values[z]);
+				return true;
+			});
+			if(faceElement >= 0 && chunk.valid)
+				chunk.valid = forRecords(chunk, faceElement, [&](const char *line, const char *end)
+				{
+					if(parseRecord(line, end, elements[faceElement], indices, values, list) == NULL)
+						return false;
+					for(size_t k=0; k<list.size(); k++)
+					{
+						if(list[k] >= nVertices)
+						{
+							cout << "Face with a vertex index out of range" << endl;
+							return false;
+						}
+						// Polygons are split in a fan around their first vertex
+						if(k > 1)
+						{
+							chunk.triangles.push_back((unsigned int)list[0]);
+							chunk.triangles.push_back((unsigned int)list[k - 1]);
+							chunk.triangles.push_back((unsigned int)list[k]);
+						}
+					}
+					return true;
+				});
+		}
+	});
+	size_t nIndices = 0;
+	for(c=0; c<chunks.size(); c++)
+	{
+		if(!chunks[c].valid)
+			return false;
+		chunks[c].firstTriangle = nIndices;
+		nIndices += chunks[c].triangles.size();
+	}
+	if(faceElement < 0)
+		return true;
+
+	// Merge the triangles of the chunks in order
+	unsigned int *triangles = mesh.ResizeTriangles(nIndices);
+	pool.ParallelFor(chunks.size(), 1, [&](size_t first, size_t last)
+	{
+		for(size_t c=first; c<last; c++)
+		{
+			copy(chunks[c].triangles.begin(), chunks[c].triangles.end(), triangles + chunks[c].firstTriangle);
+			vector<unsigned int>().swap(chunks[c].triangles);
+		}
+	});
+
+	return true;
 }
 
-void PLYReader::addModelToMesh(const vector<float> &plyVertices, const vector<int> &plyTriangles, TriangleMesh &mesh)
+const char *PLYReader::parseRecord(const char *p, const char *end, const Element &element, int listProperty, vector<double> &values, vector<size_t> &list)
 {
 	unsigned int i;
+	double value;
+
+	values.resize(element.properties.size());
+	list.clear();
+	for(i=0; i<element.properties.size() && p != NULL; i++)
+	{
+		const Property &property = element.properties[i];
+		if(property.countType == INVALID)
+		{
+			p = parseValue(p, end, property.type, values[i]);
+			continue;
+		}
+		p = parseValue(p, end, property.countType, value);
+		if(p == NULL || value < 0.0)
+			return NULL;
+		size_t count = (size_t)value;
+		for(size_t k=0; k<count && p != NULL; k++)
+		{
+			p = parseValue(p, end, property.type, value);
+			if((int)i == listProperty)
+				list.push_back(value < 0.0 ? SIZE_MAX : (size_t)value);
+		}
+	}
 
-	for(i=0; i<plyVertices.size(); i+=3)
-		mesh.addVertex(glm::vec3(plyVertices[i], plyVertices[i+1], plyVertices[i+2]));
-	for(i=0; i<plyTriangles.size(); i+=3)
-		mesh.addTriangle(plyTriangles[i], plyTriangles[i+1], plyTriangles[i+2]);
+	return p;
 }
 
+const char *PLYReader::parseValue(const char *p, const char *end, Type type, double &value)
+{
+	from_chars_result result;
+
+	while(p < end && (*p == ' ' || *p == '\t' || *p == '\r'))
+		p++;
+	if(p < end && *p == '+')
+		p++;
+	// from_chars leaves its output as it is on failure, so it is only converted on success
+	if(type == FLOAT32)
+	{
+		float real;
+		result = from_chars(p, end, real);
+		if(result.ec == errc())
+			value = real;
+	}
+	else if(type == FLOAT64)
+		result = from_chars(p, end, value);
+	else
+	{
+		long long integer;
+		result = from_chars(p, end, integer);
+		if(result.ec == errc())
+			value = (double)integer;
+	}
+	if(result.ec != errc() || result.ptr == p)
+		return NULL;
+	// A number ends at a separator, e.g. 1.5 is not the integer 1
+	if(result.ptr < end && *result.ptr != ' ' && *result.ptr != '\t' && *result.ptr != '\r')
+		return NULL;
+
+	return result.ptr;
+}
+
+void PLYReader::rescaleModel(glm::vec3 *vertices, size_t count)
+{
+	struct Bounds
+	{
+		glm::dvec3 sum;
+		glm::vec3 min, max;
+	};
+	size_t nChunks = (count + VERTEX_CHUNK_SIZE - 1) / VERTEX_CHUNK_SIZE, i;
+	vector<Bounds> chunks(nChunks);
+
+	if(count == 0)
+		return;
+
+	// Each chunk sums and bounds its vertices, then the chunks are combined
+	ThreadPool::Default().ParallelFor(count, VERTEX_CHUNK_SIZE, [&](size_t first, size_t last)
+	{
+		Bounds &bounds = chunks[first / VERTEX_CHUNK_SIZE];
+		bounds.sum = glm::dvec3(0.0);
+		bounds.min = glm::vec3(1e10f);
+		bounds.max = glm::vec3(-1e10f);
+		for(size_t v=first; v<last; v++)
+		{
+			bounds.sum += glm::dvec3(vertices[v]);
+			bounds.min = glm::min(bounds.min, vertices[v]);
+			bounds.max = glm::max(bounds.max, vertices[v]);
+		}
+	});
+
+	glm::dvec3 sum(0.0);
+	glm::vec3 size[2] = { glm::vec3(1e10f), glm::vec3(-1e10f) };
+	for(i=0; i<nChunks; i++)
+	{
+		sum += chunks[i].sum;
+		size[0] = glm::min(size[0], chunks[i].min);
+		size[1] = glm::max(size[1], chunks[i].max);
+	}
+	glm::vec3 center = glm::vec3(sum / double(count));
+	glm::vec3 extent = size[1] - size[0];
+	float largestSize = max(extent[0], max(extent[1], extent[2]));
+
+	ThreadPool::Default().ParallelFor(count, VERTEX_CHUNK_SIZE, [&](size_t first, size_t last)
+	{
+		for(size_t v=first; v<last; v++)
+			vertices[v] = (vertices[v] - center) / largestSize;
+	});
+}
+
+int PLYReader::Element::findProperty(const string &name) const
+{
+	unsigned int i;
+
+	for(i=0; i<properties.size(); i++)
+		if(properties[i].name == name)
+			return i;
+
+	return -1;
+}
+
+size_t PLYReader::Element::offset(int property) const
+{
+	size_t bytes = 0;
+	int i;
+
+	for(i=0; i<property; i++)
+		bytes += typeSize(properties[i].type);
+
+	return bytes;
+}
+
+PLYReader::Type PLYReader::parseType(const string &name)
+{
+	if(name == "char" || name == "int8")
+		return INT8;
+	if(name == "uchar" || name == "uint8")
+		return UINT8;
+	if(name == "short" || name == "int16")
+		return INT16;
+	if(name == "ushort" || name == "uint16")
+		return UINT16;
+	if(name == "int" || name == "int32")
+		return INT32;
+	if(name == "uint" || name == "uint32")
+		return UINT32;
+	if(name == "float" || name == "float32")
+		return FLOAT32;
+	if(name == "double" || name == "float64")
+		return FLOAT64;
+
+	return INVALID;
+}
+
+size_t PLYReader::typeSize(Type type)
+{
+	switch(type)
+	{
+	case INT8:
+	case UINT8:
+		return 1;
+	case INT16:
+	case UINT16:
+		return 2;
+	case INT32:
+	case UINT32:
+	case FLOAT32:
+		return 4;
+	case FLOAT64:
+		return 8;
+	default:
+		return 0;
+	}
+}
+
+// Copy a value of the file, reversing its bytes if the file has the other byte order
+template<typename T>
+static T load(const char *p, bool swap)
+{
+	unsigned char bytes[sizeof(T)];
+	T value;
+
+	memcpy(bytes, p, sizeof(T));
+	if(swap)
+		reverse(bytes, bytes + sizeof(T));
+	memcpy(&value, bytes, sizeof(T));
+
+	return value;
+}
+
+double PLYReader::readValue(const char *p, Type type, bool swap)
+{
+	switch(type)
+	{
+	case INT8:
+		return load<int8_t>(p, swap);
+	case UINT8:
+		return load<uint8_t>(p, swap);
+	case INT16:
+		return load<int16_t>(p, swap);
+	case UINT16:
+		return load<uint16_t>(p, swap);
+	case INT32:
+		return load<int32_t>(p, swap);
+	case UINT32:
+		return load<uint32_t>(p, swap);
+	case FLOAT32:
+		return load<float>(p, swap);
+	case FLOAT64:
+		return load<double>(p, swap);
+	default:
+		return 0.0;
+	}
+}
+
+size_t PLYReader::readInteger(const char *p, Type type, bool swap)
+{
+	long long value;
+
+	switch(type)
+	{
+	case INT8:
+		value = load<int8_t>(p, swap);
+		break;
+	case UINT8:
+		return load<uint8_t>(p, swap);
+	case INT16:
+		value = load<int16_t>(p, swap);
+		break;
+	case UINT16:
+		return load<uint16_t>(p, swap);
+	case INT32:
+		value = load<int32_t>(p, swap);
+		break;
+	case UINT32:
+		return load<uint32_t>(p, swap);
+	default:
+		value = (long long)readValue(p, type, swap);
+		break;
+	}
+
+	return value < 0 ? SIZE_MAX : (size_t)value;
+}
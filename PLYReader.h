@@ -2,25 +2,98 @@
 #define PLYREADER_H
 
 
-#include <fstream>
+#include <cstddef>
+#include <functional>
+#include <string>
+#include <vector>
 #include "TriangleMesh.h"
 
 
 using namespace std;
 
 
+// Reads PLY files, ASCII or binary of either byte order. The file is mapped into memory and
+// decoded straight into the arrays of the mesh, the vertices and the faces on all the threads
 class PLYReader
 {
 
 public:
 	static bool readMesh(const string &filename, TriangleMesh &mesh);
+	// Read a mesh that may not fit in memory, in blocks of blockSize bytes read ahead on another
+	// thread. vertexBlock receives the vertices in order, in batches, then triangleBlock the
+	// triangles, three indices each. Positions are not rescaled. Reading stops when a callback
+	// returns false
+	static bool streamMesh(const string &filename, size_t blockSize, const function<bool(const glm::vec3 *, size_t)> &vertexBlock, const function<bool(const unsigned int *, size_t)> &triangleBlock);
 
 private:
-	static bool loadHeader(ifstream &fin, int &nVertices, int &nFaces);
-	static void loadVertices(ifstream &fin, int nVertices, vector<float> &plyVertices);
-	static void loadFaces(ifstream &fin, int nFaces, vector<int> &plyTriangles);
-	static void rescaleModel(vector<float> &plyVertices);
-	static void addModelToMesh(const vector<float> &plyVertices, const vector<int> &plyTriangles, TriangleMesh &mesh);
+	enum Format
+	{
+		ASCII,
+		BINARY_LITTLE_ENDIAN,
+		BINARY_BIG_ENDIAN
+	};
+
+	enum Type
+	{
+		INVALID,
+		INT8,
+		UINT8,
+		INT16,
+		UINT16,
+		INT32,
+		UINT32,
+		FLOAT32,
+		FLOAT64
+	};
+
+	struct Property
+	{
+		string name;
+		// The type of the value, or of the items of a list
+		Type type;
+		// The type of the item count, INVALID if the property is not a list
+		Type countType;
+	};
+
+	struct Element
+	{
+		string name;
+		size_t count;
+		vector<Property> properties;
+		// Bytes per record, 0 if some property is a list
+		size_t size;
+
+		int findProperty(const string &name) const;
+		// Byte offset of a property in a record of fixed size
+		size_t offset(int property) const;
+	};
+
+	// A file being decoded
+	struct File
+	{
+		const char *data;
+		const char *end;
+		bool swap;
+	};
+
+	static bool loadHeader(const char *data, size_t size, Format &format, vector<Element> &elements, size_t &headerSize);
+	static bool loadVertices(const File &file, const char *begin, const Element &element, glm::vec3 *vertices);
+	static const char *loadFaces(const File &file, const char *begin, const Element &element, size_t nVertices, TriangleMesh &mesh);
+	static const char *skipElement(const File &file, const char *begin, const Element &element);
+	static const char *skipRecord(const File &file, const char *p, const Element &element, int listProperty, const char *&list, size_t &listSize);
+	static bool loadAscii(const File &file, const char *begin, const vector<Element> &elements, glm::vec3 *vertices, TriangleMesh &mesh);
+	// Parse the record of an element on an ASCII line. Scalar properties are stored in values, by
+	// property, the items of listProperty in list
+	// Returns the end of the record, or NULL if the line doesn't hold a valid record
+	static const char *parseRecord(const char *p, const char *end, const Element &element, int listProperty, vector<double> &values, vector<size_t> &list);
+	static const char *parseValue(const char *p, const char *end, Type type, double &value);
+	static void rescaleModel(glm::vec3 *vertices, size_t count);
+
+	static Type parseType(const string &name);
+	static size_t typeSize(Type type);
+	static double readValue(const char *p, Type type, bool swap);
+	// Negative values are returned as SIZE_MAX
+	static size_t readInteger(const char *p, Type type, bool swap);
 
 };
 
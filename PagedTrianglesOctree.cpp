@@ -0,0 +1,362 @@
+#include "PagedTrianglesOctree.h"
+
+#include <algorithm>
+#include <cstring>
+#include <fstream>
+#include <limits>
+
+#include "LeafIntersection.h"
+
+/* Number of new rays a thread of RayCastBatch takes at a time */
+static const size_t RAY_CHUNK_SIZE = 64;
+
+PagedTrianglesOctree::Hit::Hit() : t_(std::numeric_limits<Real_t>::max()), u_(0), v_(0), triangle_(INVALID_TRIANGLE), error_(false) {
+
+}
+
+std::string PagedTrianglesOctree::PagePath(const MeshBuckets& buckets, size_t bucket) {
+    return buckets.BucketPath(buckets.Buckets()[bucket]) + ".octree";
+}
+
+uint64_t PagedTrianglesOctree::PageKey(const MeshBuckets& buckets, size_t bucket, TrianglesOctreeConfig config) {
+    const MeshBuckets::Bucket& b = buckets.Buckets()[bucket];
+    /* The content key tells apart buckets of another mesh ingested with the same prefix */
+    uint64_t key = HashCombine(buckets.ContentKey(), b.file_);
+    key = HashCombine(key, b.triangle_count_);
+    key = HashCombine(key, static_cast<uint64_t>(config.bucket_size_));
+    key = HashCombine(key, static_cast<uint64_t>(config.max_depth_));
+    return HashCombine(key, GetLeafIntersectionKernelWidth());
+}
+
+bool PagedTrianglesOctree::Build(const MeshBuckets& buckets, TrianglesOctreeConfig config) {
+    return buckets.BuildOctrees(config, [&](size_t bucket, const std::vector<glm::vec3>& vertices, const std::vector<unsigned int>& triangles, const std::vector<uint64_t>& triangle_ids, TrianglesOctreeBase& octree) {
+        std::string path = PagePath(buckets, bucket);
+        if (!TrianglesOctreeCache::Save(path, PageKey(buckets, bucket, config), config, vertices, triangles, octree.Compiled())) return false;
+
+        /* The cache holds the mesh of the bucket, the source index of each triangle goes next to it */
+        std::ofstream out((path + ".ids").c_str(), std::ios_base::out | std::ios_base::binary | std::ios_base::trunc);
+        out.write(reinterpret_cast<const char *>(triangle_ids.data()), static_cast<std::streamsize>(triangle_ids.size() * sizeof(uint64_t)));
+        out.close();
+        return static_cast<bool>(out);
+    });
+}
+
+PagedTrianglesOctree::PagedTrianglesOctree(std::shared_ptr<const MeshBuckets> buckets, TrianglesOctreeConfig config, size_t cache_mb) : buckets_(buckets), config_(config), capacity_(cache_mb << 20), used_(0), page_loads_(0), stop_(false) {
+    const std::vector<MeshBuckets::Bucket>& cells = buckets_->Buckets();
+    slots_.resize(cells.size());
+    for (size_t i = 0; i < slots_.size(); i++) {
+        slots_[i].requested_ = false;
+        slots_[i].rays_ = 0;
+    }
+
+    /* The top levels: the octree whose leaves are the cells of the buckets */
+    Node root;
+    root.origin_ = buckets_->Origin();
+    root.length_ = buckets_->Length();
+    std::fill(root.children_, root.children_ + 8, -1);
+    root.bucket_ = -1;
+    nodes_.push_back(root);
+    for (size_t i = 0; i < cells.size(); i++) {
+        glm::vec3 center = cells[i].origin_ + glm::vec3(0.5f * cells[i].length_);
+        int node = 0;
+        for (int level = 0; level < cells[i].level_; level++) {
+            float half = 0.5f * nodes_[node].length_;
+            int child = 0;
+            for (int axis = 0; axis < 3; axis++)
+                if (center[axis] >= nodes_[node].origin_[axis] + half) child |= 1 << axis;
+            if (nodes_[node].children_[child] < 0) {
+                Node node_child;
+                node_child.origin_ = nodes_[node].origin_ + half * glm::vec3(child & 1, (child >> 1) & 1, child >> 2);
+                node_child.length_ = half;
+                std::fill(node_child.children_, node_child.children_ + 8, -1);
+                node_child.bucket_ = -1;
+                nodes_[node].children_[child] = static_cast<int>(nodes_.size());
+                nodes_.push_back(node_child);
+            }
+            node = nodes_[node].children_[child];
+        }
+        nodes_[node].bucket_ = static_cast<int>(i);
+    }
+
+    for (size_t i = 0; i < LOADER_THREADS; i++)
+        loaders_.push_back(std::thread(&PagedTrianglesOctree::LoaderLoop, this));
+}
+
+std::shared_ptr<PagedTrianglesOctree> PagedTrianglesOctree::Open(std::shared_ptr<const MeshBuckets> buckets, TrianglesOctreeConfig config, size_t cache_mb) {
+    for (size_t i = 0; i < buckets->Buckets().size(); i++) {
+        std::string path = PagePath(*buckets, i);
+        std::ifstream page(path.c_str(), std::ios_base::in | std::ios_base::binary);
+        std::ifstream ids((path + ".ids").c_str(), std::ios_base::in | std::ios_base::binary);
+        if (!page.is_open() || !ids.is_open()) return nullptr;
+    }
+    return std::shared_ptr<PagedTrianglesOctree>(new PagedTrianglesOctree(buckets, config, cache_mb));
+}
+
+PagedTrianglesOctree::~PagedTrianglesOctree() {
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        stop_ = true;
+    }
+    load_cv_.notify_all();
+    for (size_t i = 0; i < loaders_.size(); i++)
+        loaders_[i].join();
+}
+
+size_t PagedTrianglesOctree::CacheBytes() const {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return used_;
+}
+
+/* Read a byte of every memory page of a mapped range, so that traversal doesn't wait for the disk */
+static void Touch(const void * data, size_t bytes) {
+    const volatile char * p = static_cast<const volatile char *>(data);
+    for (size_t i = 0; i < bytes; i += 4096)
+        (void)p[i];
+}
+
+std::shared_ptr<PagedTrianglesOctree::Page> PagedTrianglesOctree::LoadPage(uint32_t bucket) {
+    /* A page that can't be loaded is kept without an octree, the rays that reach it fail */
+    std::shared_ptr<Page> page(new Page());
+    page->bytes_ = 0;
+    page_loads_++;
+
+    std::string path = PagePath(*buckets_, bucket);
+    page->cache_ = TrianglesOctreeCache::Load(path, PageKey(*buckets_, bucket, config_));
+    if (!page->cache_ || !(page->cache_->Config() == config_)) return page;
+
+    /* Build writes the triangle data of the leaves, the traversal reads nothing else of the mesh */
+    const TrianglesOctreeCache& cache = *page->cache_;
+    CompiledTrianglesOctree compiled = cache.Octree();
+    if (!compiled.triangle_data_) return page;
+    if (!page->triangle_ids_.Open(path + ".ids") || page->triangle_ids_.Size() != cache.TriangleIndexCount() / 3 * sizeof(uint64_t)) return page;
+
+    size_t triangle_data_size = 9 * (compiled.triangle_count_ + TriangleBuffer::PADDING) * sizeof(float);
+    Touch(compiled.nodes_, compiled.node_count_ * sizeof(LinearOctreeNode));
+    Touch(compiled.triangles_, compiled.triangle_count_ * sizeof(unsigned int));
+    Touch(compiled.triangle_data_, triangle_data_size);
+
+    page->octree_.reset(NewTrianglesOctree(config_, compiled, page->cache_));
+    page->bytes_ = compiled.node_count_ * sizeof(LinearOctreeNode) + compiled.triangle_count_ * sizeof(unsigned int) + triangle_data_size + page->triangle_ids_.Size();
+    return page;
+}
+
+std::shared_ptr<PagedTrianglesOctree::Page> PagedTrianglesOctree::Acquire(uint32_t bucket, bool wait) {
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        Slot& slot = slots_[bucket];
+        if (slot.page_) {
+            lru_.splice(lru_.begin(), lru_, slot.lru_);
+            return slot.page_;
+        }
+        if (!wait) return nullptr;
+    }
+
+    std::shared_ptr<Page> page = LoadPage(bucket);
+    Insert(bucket, page);
+    return page;
+}
+
+std::shared_ptr<PagedTrianglesOctree::Page> PagedTrianglesOctree::Park(Batch& batch, uint32_t bucket, size_t ray) {
+    /* Insert takes the batches of the slot with the lock of the cache, and their rays after */
+    std::lock_guard<std::mutex> batch_lock(batch.mutex_);
+    std::lock_guard<std::mutex> lock(mutex_);
+    Slot& slot = slots_[bucket];
+    if (slot.page_) {
+        lru_.splice(lru_.begin(), lru_, slot.lru_);
+        return slot.page_;
+    }
+
+    batch.parked_[bucket].push_back(ray);
+    if (std::find(slot.batches_.begin(), slot.batches_.end(), &batch) == slot.batches_.end()) slot.batches_.push_back(&batch);
+    slot.rays_++;
+    if (!slot.requested_) {
+        slot.requested_ = true;
+        load_queue_.push_back(bucket);
+        load_cv_.notify_one();
+    }
+    return nullptr;
+}
+
+void PagedTrianglesOctree::Insert(uint32_t bucket, std::shared_ptr<Page> page) {
+    std::vector<Batch *> batches;
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        Slot& slot = slots_[bucket];
+        slot.requested_ = false;
+        slot.rays_ = 0;
+        batches.swap(slot.batches_);
+
+        /* Loaded by another thread meanwhile */
+        if (slot.page_) page = slot.page_;
+        else {
+            slot.page_ = page;
+            lru_.push_front(bucket);
+            slot.lru_ = lru_.begin();
+            used_ += page->bytes_;
+
+            /* Rays still using a dropped page keep it until they are done with it */
+            while (used_ > capacity_ && lru_.size() > 1) {
+                Slot& victim = slots_[lru_.back()];
+                lru_.pop_back();
+                used_ -= victim.page_->bytes_;
+                victim.page_.reset();
+            }
+        }
+    }
+
+    /* A batch may be done and gone once its lock is released, so it is notified under the lock */
+    for (size_t i = 0; i < batches.size(); i++) {
+        std::lock_guard<std::mutex> lock(batches[i]->mutex_);
+        std::vector<size_t> rays;
+        rays.swap(batches[i]->parked_[bucket]);
+        batches[i]->ready_.push_back(std::make_pair(page, std::move(rays)));
+        batches[i]->cv_.notify_one();
+    }
+}
+
+void PagedTrianglesOctree::LoaderLoop() {
+    std::unique_lock<std::mutex> lock(mutex_);
+    while (true) {
+        load_cv_.wait(lock, [this]() {
+            return stop_ || !load_queue_.empty();
+        });
+        if (stop_) return;
+
+        /* The page most rays are parked for */
+        std::deque<uint32_t>::iterator next = std::max_element(load_queue_.begin(), load_queue_.end(), [this](uint32_t a, uint32_t b) {
+            return slots_[a].rays_ < slots_[b].rays_;
+        });
+        uint32_t bucket = *next;
+        load_queue_.erase(next);
+        std::shared_ptr<Page> page = slots_[bucket].page_;
+
+        /* A RayCast may have loaded it meanwhile, Insert still hands it to the parked rays */
+        lock.unlock();
+        if (!page) page = LoadPage(bucket);
+        Insert(bucket, page);
+        lock.lock();
+    }
+}
+
+void PagedTrianglesOctree::FindBuckets(int node, const Real_t origin[3], const Real_t inverse[3], std::vector<std::pair<Real_t, uint32_t> >& buckets) const {
+    const Node& n = nodes_[node];
+
+    /* Slab test of the cell of the node, a zero direction gives NaNs that the min and max ignore */
+    Real_t tmin = 0, tmax = std::numeric_limits<Real_t>::max();
+    for (int axis = 0; axis < 3; axis++) {
+        Real_t t0 = (n.origin_[axis] - origin[axis]) * inverse[axis];
+        Real_t t1 = (n.origin_[axis] + n.length_ - origin[axis]) * inverse[axis];
+        if (t0 > t1) std::swap(t0, t1);
+        tmin = std::max(tmin, t0);
+        tmax = std::min(tmax, t1);
+    }
+    if (tmin > tmax) return;
+
+    if (n.bucket_ >= 0) buckets.push_back(std::make_pair(tmin, static_cast<uint32_t>(n.bucket_)));
+    for (int i = 0; i < 8; i++)
+        if (n.children_[i] >= 0) FindBuckets(n.children_[i], origin, inverse, buckets);
+}
+
+void PagedTrianglesOctree::Start(const Ray3D& ray, RayState& state) const {
+    Real_t origin[3], inverse[3];
+    for (int axis = 0; axis < 3; axis++) {
+        origin[axis] = ray.Origin()[axis];
+        inverse[axis] = 1 / ray.Direction()[axis];
+    }
+
+    state.buckets_.clear();
+    FindBuckets(0, origin, inverse, state.buckets_);
+    std::sort(state.buckets_.begin(), state.buckets_.end());
+    state.next_ = 0;
+}
+
+bool PagedTrianglesOctree::Trace(const Ray3D& ray, RayState& state, Hit& hit, std::shared_ptr<Page> page, Batch * batch, size_t index) {
+    for (; state.next_ < state.buckets_.size(); state.next_++) {
+        /* A bucket entered after the closest hit can't hold a closer one */
+        if (state.buckets_[state.next_].first > hit.t_) break;
+
+        uint32_t bucket = state.buckets_[state.next_].second;
+        if (!page) page = Acquire(bucket, batch == nullptr);
+        if (!page && !(page = Park(*batch, bucket, index))) return false;
+        if (!page->octree_) {
+            /* Dropping the bucket could return a hit behind its triangles */
+            hit = Hit();
+            hit.error_ = true;
+            state.next_ = state.buckets_.size();
+            return true;
+        }
+
+        /* The leaves test their triangle data, the mesh arrays are not read */
+        static const std::vector<glm::vec3> no_vertices;
+        static const std::vector<unsigned int> no_triangles;
+        RayHit bucket_hit;
+        if (page->octree_->RayCast(no_vertices, no_triangles, ray, bucket_hit, 0, hit.t_)) {
+            hit.t_ = bucket_hit.t_;
+            hit.u_ = bucket_hit.u_;
+            hit.v_ = bucket_hit.v_;
+            std::memcpy(&hit.triangle_, page->triangle_ids_.Data() + bucket_hit.triangle_id_ * sizeof(uint64_t), sizeof(uint64_t));
+        }
+        page.reset();
+    }
+    return true;
+}
+
+bool PagedTrianglesOctree::RayCast(Ray3D ray, Hit& hit) {
+    RayState state;
+    Start(ray, state);
+    hit = Hit();
+    Trace(ray, state, hit, nullptr, nullptr, 0);
+    return hit.Valid();
+}
+
+bool PagedTrianglesOctree::RayCastBatch(const std::vector<Ray3D>& rays, std::vector<Hit>& hits, ThreadPool& pool) {
+    hits.assign(rays.size(), Hit());
+    std::vector<RayState> states(rays.size());
+    Batch batch;
+    batch.next_ = 0;
+    batch.done_ = 0;
+    batch.parked_.resize(slots_.size());
+
+    /* Each thread goes on with the rays of loaded pages first, then starts new rays */
+    pool.ParallelFor(pool.Size(), 1, [&](size_t, size_t) {
+        std::unique_lock<std::mutex> lock(batch.mutex_);
+        while (batch.done_ < rays.size()) {
+            std::shared_ptr<Page> page;
+            std::vector<size_t> ready;
+            size_t begin = 0, end = 0;
+            if (!batch.ready_.empty()) {
+                page = batch.ready_.front().first;
+                ready.swap(batch.ready_.front().second);
+                batch.ready_.pop_front();
+            }
+            else if (batch.next_ < rays.size()) {
+                begin = batch.next_;
+                end = std::min(begin + RAY_CHUNK_SIZE, rays.size());
+                batch.next_ = end;
+            }
+            else {
+                /* All the rays left are parked or traced by other threads */
+                batch.cv_.wait(lock);
+                continue;
+            }
+            lock.unlock();
+
+            size_t done = 0;
+            for (size_t i = 0; i < ready.size(); i++)
+                done += Trace(rays[ready[i]], states[ready[i]], hits[ready[i]], page, &batch, ready[i]);
+            for (size_t ray = begin; ray < end; ray++) {
+                Start(rays[ray], states[ray]);
+                done += Trace(rays[ray], states[ray], hits[ray], nullptr, &batch, ray);
+            }
+            page.reset();
+
+            lock.lock();
+            batch.done_ += done;
+        }
+        batch.cv_.notify_all();
+    });
+
+    return std::none_of(hits.begin(), hits.end(), [](const Hit& hit) {
+        return hit.error_;
+    });
+}
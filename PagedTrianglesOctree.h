@@ -0,0 +1,208 @@
+#ifndef __PagedTrianglesOctree_h__
+#define __PagedTrianglesOctree_h__
+
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "MappedFile.h"
+#include "MeshBuckets.h"
+#include "Ray.hpp"
+#include "ThreadPool.h"
+#include "TrianglesOctreeCache.h"
+
+/**
+    A triangles octree too large for memory. The top levels, the cells of the buckets of a
+    MeshBuckets, stay in memory. Below them each bucket has its own triangles octree, a page
+    stored in a cache file, that is loaded when a ray reaches the bucket. Loaded pages are kept
+    in an LRU cache of a given size, the least recently used page is dropped when it is full.
+
+    Batches of rays are traced without waiting for pages: a ray that reaches a bucket that is not
+    in memory is parked and its page loaded by one of the loader threads, while the other rays go 
+    on. Parked rays go on as soon as their page is in
+*/
+class PagedTrianglesOctree {
+public:
+    /* A closest hit, with the index of the triangle in the source mesh */
+    struct Hit {
+        Real_t t_;
+        Real_t u_;
+        Real_t v_;
+        uint64_t triangle_;
+        /* The page of a bucket the ray goes through can't be loaded, the ray has no hit then */
+        bool error_;
+
+        Hit();
+
+        bool Valid() const {
+            return triangle_ != INVALID_TRIANGLE;
+        }
+    };
+
+    static const uint64_t INVALID_TRIANGLE = ~0ull;
+    /* The threads that load pages. Reads of several pages overlap, the disk serves them together */
+    static const size_t LOADER_THREADS = 4;
+
+    /**
+        Build the octree of every bucket and write it to its page file, next to the bucket file.
+        Only one bucket is in memory at a time
+        @return false if a bucket can't be read or a page can't be written
+    */
+    static bool Build(const MeshBuckets& buckets, TrianglesOctreeConfig config);
+
+    /**
+        @param buckets The buckets the pages were built for with Build
+        @param cache_mb The size of the cache of pages in MB. Pages in use by a ray are kept
+            until the ray is done with them, even if the cache is full
+        @return nullptr if a page or its triangle ids are missing. Pages are only read, and
+            checked, when a ray reaches them
+    */
+    static std::shared_ptr<PagedTrianglesOctree> Open(std::shared_ptr<const MeshBuckets> buckets, TrianglesOctreeConfig config, size_t cache_mb);
+
+    ~PagedTrianglesOctree();
+
+    PagedTrianglesOctree(const PagedTrianglesOctree&) = delete;
+    PagedTrianglesOctree& operator=(const PagedTrianglesOctree&) = delete;
+
+    /**
+        Find the closest hit of a ray, loading the pages it needs on the calling thread
+        @return true if a triangle was hit. false if not, or if a page can't be loaded, which
+            sets hit.error_
+    */
+    bool RayCast(Ray3D ray, Hit& hit);
+
+    /**
+        Find the closest hits of a batch of rays, on all the threads of a pool. A ray that 
+        reaches a page not in memory is parked, and the threads go on with other rays. The 
+        loader threads load the pages most rays are parked for first, and hand each page to its 
+        rays, which then go on even if the cache dropped it meanwhile. So a cache too small for 
+        the pages of a batch still makes progress. The threads of the pool only wait when all 
+        the rays left are parked
+        @return false if a page can't be loaded, the rays that reach it have error_ set
+    */
+    bool RayCastBatch(const std::vector<Ray3D>& rays, std::vector<Hit>& hits, ThreadPool& pool = ThreadPool::Default());
+
+    /* The bytes of the pages in the cache */
+    size_t CacheBytes() const;
+
+    /* The pages loaded since Open */
+    size_t PageLoads() const {
+        return page_loads_;
+    }
+
+private:
+    /* A bucket in memory. A page that can't be loaded has no octree, and is kept so that it is only read once */
+    struct Page {
+        /* The octree and the triangle data of its leaves, traversed in place */
+        std::shared_ptr<TrianglesOctreeCache> cache_;
+        /* The index in the source mesh of each triangle of the bucket */
+        MappedFile triangle_ids_;
+        std::unique_ptr<TrianglesOctreeBase> octree_;
+        /* The bytes mapped */
+        size_t bytes_;
+    };
+
+    struct Batch;
+
+    struct Slot {
+        std::shared_ptr<Page> page_;
+        std::list<uint32_t>::iterator lru_;
+        bool requested_;
+        /* The batches with rays parked for the page, and the number of rays */
+        std::vector<Batch *> batches_;
+        size_t rays_;
+    };
+
+    /* A node of the resident top levels, either a bucket or the parent of smaller cells */
+    struct Node {
+        glm::vec3 origin_;
+        float length_;
+        int children_[8];
+        int bucket_;
+    };
+
+    /* A ray of a batch, with the buckets it goes through ordered along it */
+    struct RayState {
+        std::vector<std::pair<Real_t, uint32_t> > buckets_;
+        size_t next_;
+    };
+
+    /* The work of a RayCastBatch call that the threads share */
+    struct Batch {
+        std::mutex mutex_;
+        std::condition_variable cv_;
+        /* The first ray not started yet, and the number of rays done */
+        size_t next_;
+        size_t done_;
+        /* The rays parked for each page */
+        std::vector<std::vector<size_t> > parked_;
+        /* Pages loaded for parked rays, with the rays that go on with them */
+        std::deque<std::pair<std::shared_ptr<Page>, std::vector<size_t> > > ready_;
+    };
+
+    std::shared_ptr<const MeshBuckets> buckets_;
+    TrianglesOctreeConfig config_;
+    std::vector<Node> nodes_;
+
+    /* Protects the cache and the load queue */
+    mutable std::mutex mutex_;
+    std::vector<Slot> slots_;
+    std::list<uint32_t> lru_;
+    size_t capacity_;
+    size_t used_;
+    std::atomic<size_t> page_loads_;
+
+    std::vector<std::thread> loaders_;
+    std::condition_variable load_cv_;
+    std::deque<uint32_t> load_queue_;
+    bool stop_;
+
+    PagedTrianglesOctree(std::shared_ptr<const MeshBuckets> buckets, TrianglesOctreeConfig config, size_t cache_mb);
+
+    static std::string PagePath(const MeshBuckets& buckets, size_t bucket);
+    static uint64_t PageKey(const MeshBuckets& buckets, size_t bucket, TrianglesOctreeConfig config);
+
+    /* Find the buckets a ray goes through, ordered along it */
+    void Start(const Ray3D& ray, RayState& state) const;
+    /* Append the buckets of a node a ray goes through, unordered, with where it enters them */
+    void FindBuckets(int node, const Real_t origin[3], const Real_t inverse[3], std::vector<std::pair<Real_t, uint32_t> >& buckets) const;
+    std::shared_ptr<Page> LoadPage(uint32_t bucket);
+
+    /**
+        @param wait Load the page on the calling thread if it is not in memory
+        @return The page, or nullptr if it is not in memory and wait is false
+    */
+    std::shared_ptr<Page> Acquire(uint32_t bucket, bool wait);
+    /**
+        Park a ray of a batch until a page is loaded, and queue the page for the loader threads
+        @return The page if it came in meanwhile, the ray is not parked then
+    */
+    std::shared_ptr<Page> Park(Batch& batch, uint32_t bucket, size_t ray);
+    /* 
+        Put a loaded page in the cache, dropping the least recently used pages if it is full, 
+        and hand it to the rays parked for it
+    */
+    void Insert(uint32_t bucket, std::shared_ptr<Page> page);
+    /**
+        Trace a ray through its buckets from where it stopped. A ray that reaches a page that 
+        can't be loaded stops with hit.error_ set
+        @param page The page of the bucket the ray stopped at, if it is known
+        @param batch The batch of the ray, to park it in. Without one, pages are loaded on the 
+            calling thread
+        @param index The index of the ray in the batch
+        @return false if the ray was parked
+    */
+    bool Trace(const Ray3D& ray, RayState& state, Hit& hit, std::shared_ptr<Page> page, Batch * batch, size_t index);
+
+    void LoaderLoop();
+};
+
+#endif
@@ -2,9 +2,13 @@
 #define __Point_hpp__
 
 #include <iostream>
+#include <array>
 #include <vector>
 #include <deque>
 #include <algorithm>
+#include <cmath>
+#include <initializer_list>
+#include <limits>
 
 #include <glm/glm.hpp>
 
@@ -19,24 +23,29 @@ template<typename T> bool Equal(const T& a, const T& b, T e = std::numeric_limit
 }
 
 /**
-    A point in K dimensional space
+    A point in K dimensional space. The coordinates are stored inline, so points 
+    can be created and copied without memory allocations
 */
 template<int K>
 class Point {
 public:
-    Point() {
-        coordinates_ = std::vector<Real_t>(K, 0);
+    constexpr Point() : coordinates_() {
     }
 
-    Point(Real_t a) {
-        coordinates_ = std::vector<Real_t>(K, a);
+    constexpr Point(Real_t a) : coordinates_() {
+        for (size_t i = 0; i < K; i++) {
+            coordinates_[i] = a;
+        }
     }
 
-    Point(std::vector<Real_t> coordinates) {
-        coordinates_ = coordinates;
+    constexpr Point(std::initializer_list<Real_t> coordinates) : coordinates_() {
+        size_t i = 0;
+        for (const Real_t * itr = coordinates.begin(); itr != coordinates.end() && i < K; ++itr) {
+            coordinates_[i++] = *itr;
+        }
     }
 
-    Real_t Norm() {
+    Real_t Norm() const {
         Real_t a = 0;
         for (size_t i = 0; i < K; i++) {
             a += coordinates_[i] * coordinates_[i];
@@ -51,29 +60,29 @@ public:
         }
     }
 
-    Point& operator+=(const Point& rhs) {
+    constexpr Point& operator+=(const Point& rhs) {
         for (size_t i = 0; i < K; i++)
             coordinates_[i] += rhs.coordinates_[i];
         return *this;
     }
 
-    friend Point operator+(Point lhs, const Point& rhs) {
+    constexpr friend Point operator+(Point lhs, const Point& rhs) {
         lhs += rhs;
         return lhs; 
     }
 
-    Point& operator-=(const Point& rhs) {
+    constexpr Point& operator-=(const Point& rhs) {
         for (size_t i = 0; i < K; i++)
             coordinates_[i] -= rhs.coordinates_[i];
         return *this;
     }
 
-    friend Point operator-(Point lhs, const Point& rhs) {
+    constexpr friend Point operator-(Point lhs, const Point& rhs) {
         lhs -= rhs;
         return lhs;
     }
 
-    bool operator==(const Point& rhs) {
+    bool operator==(const Point& rhs) const {
         bool ret = true;
         for (size_t i = 0; i < K; i++) {
             ret = ret & Equal(coordinates_[i], rhs.coordinates_[i]);
@@ -81,7 +90,11 @@ public:
         return ret;
     }
 
-    Real_t& operator[](size_t i) {
+    constexpr Real_t& operator[](size_t i) {
+        return coordinates_[i];
+    }
+
+    constexpr const Real_t& operator[](size_t i) const {
         return coordinates_[i];
     }
 
@@ -90,12 +103,12 @@ public:
         for (size_t i = 0; i < K-1; i++) {
             os << h.coordinates_[i] << ", ";
         }
-        os << h.coordinates_[0] << "]";
+        os << h.coordinates_[K-1] << "]";
         return os;
     }
 
 private:
-    std::vector<Real_t> coordinates_;
+    alignas(16) std::array<Real_t, K> coordinates_;
 
 };
 /* The octree is going to used 3D points */
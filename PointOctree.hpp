@@ -3,11 +3,22 @@
 
 #include <iostream>
 #include <deque>
+#include <type_traits>
+#include <vector>
+
+#include "LinearOctree.hpp"
+#include "MortonCode.hpp"
+#include "ThreadPool.h"
+#include "Arena.h"
+#include "InlineBucket.hpp"
 
 /**
-    An octree in which leaf holds BUCKET_SIZE number of Data points
+    An octree in which leaf holds BUCKET_SIZE number of Data points. Leaves at MAX_DEPTH
+    are not split any further and hold any number of points, e.g. coincident points. The nodes
+    are created with Allocator, see Arena.h. With ArenaAllocator they are freed all at once
+    when the octree is destroyed, and the memory of removed points is only reclaimed then
 */
-template<typename Data, int BUCKET_SIZE=1>
+template<typename Data, int BUCKET_SIZE=1, int MAX_DEPTH=32, typename Allocator=ArenaAllocator>
 class PointOctree {
 private:
     class OctreeNode {
@@ -23,13 +34,20 @@ private:
 
         NodeType GetNodeType() { return type_; }
 
-        virtual void Destroy() = 0;
-        virtual OctreeNode * Insert(Point3D point, Data data) = 0;
-        virtual OctreeNode * Remove(Point3D point) = 0;
+        /**
+            Free this node and its subtree
+        */
+        virtual void Destroy(Allocator& allocator) = 0;
+        virtual OctreeNode * Insert(Allocator& allocator, Point3D point, Data data, size_t depth) = 0;
+        virtual OctreeNode * Remove(Allocator& allocator, Point3D point) = 0;
         virtual size_t Depth() = 0;
 
-        virtual void RayCastProcessChild(Real_t tx0, Real_t ty0, Real_t tz0, Real_t tx1, Real_t ty1, Real_t tz1, unsigned char a, std::vector<Data>& results) = 0;
-        
+        /**
+            Write this node to the linear octree at index. Inner nodes append slots for their children
+            and queue them, so that siblings end up next to each other
+        */
+        virtual void Compile(size_t index, std::vector<LinearOctreeNode>& nodes, std::vector<Data>& data, std::deque<std::pair<OctreeNode *, size_t> >& queue) = 0;
+
         virtual void ClusterNodes(size_t depth, size_t current_depth, std::vector<std::vector<Data> >& clusters) = 0;
         virtual void AddLeavesToCluster(std::vector<Data>& cluster) = 0;
 
@@ -79,40 +97,52 @@ private:
             this->type_ = OctreeNode::NodeType::LEAF;
         }
 
-        void Destroy() {
-            
+        void Destroy(Allocator& allocator) {
+            buckets_.Free(allocator);
+            AllocatorDelete(allocator, this);
+        }
+
+        /**
+            Store a point here, without splitting
+        */
+        void Add(Allocator& allocator, const Point3D& point, Data data) {
+            buckets_.PushBack(allocator, Bucket(point, data));
         }
 
-        OctreeNode * Insert(Point3D point, Data data) {
-            /* If this leaf has enough space, store here */
-            if (buckets_.size() < BUCKET_SIZE) {
-                buckets_.push_back(Bucket(point, data));
+        void Reserve(Allocator& allocator, size_t count) {
+            buckets_.Reserve(allocator, count);
+        }
+
+        OctreeNode * Insert(Allocator& allocator, Point3D point, Data data, size_t depth) {
+            /* If this leaf has enough space, or can't be split any further, store here */
+            if (buckets_.Size() < BUCKET_SIZE || depth >= MAX_DEPTH) {
+                buckets_.PushBack(allocator, Bucket(point, data));
                 return this;
             }
 
             /* Either-wise, split the leaf */
-            OctreeInnerNode * temp = new  OctreeInnerNode(this->origin_, this->length_);
-            for (size_t i = 0; i < buckets_.size(); i++) {
-                temp->Insert(buckets_[i].point_, buckets_[i].data_);
+            OctreeInnerNode * temp = AllocatorNew<OctreeInnerNode>(allocator, this->origin_, this->length_);
+            for (size_t i = 0; i < buckets_.Size(); i++) {
+                temp->Insert(allocator, buckets_[i].Point(), buckets_[i].data_, depth);
             }
-            temp->Insert(point, data);
+            temp->Insert(allocator, point, data, depth);
 
-            delete this;
+            Destroy(allocator);
             return temp;
         }
         
-        OctreeLeafNode * Remove(Point3D point) {
+        OctreeLeafNode * Remove(Allocator& allocator, Point3D point) {
             /* Check if the point is stored here, and delete it */
-            for (typename std::deque<Bucket>::iterator itr = buckets_.begin(); itr != buckets_.end(); ++itr) {
-                if ((*itr).point_ == point) {
-                    buckets_.erase(itr);
+            for (size_t i = 0; i < buckets_.Size(); i++) {
+                if (buckets_[i].Point() == point) {
+                    buckets_.Erase(i);
                     break;
                 }
             }
 
             /* If leaf is empty delete leaf */
-            if (buckets_.size() == 0) {
-                delete this;
+            if (buckets_.Size() == 0) {
+                Destroy(allocator);
                 return nullptr;
             }
 
@@ -123,15 +153,12 @@ private:
             return 0;
         }
 
-        void RayCastProcessChild(Real_t tx0, Real_t ty0, Real_t tz0, Real_t tx1, Real_t ty1, Real_t tz1, unsigned char a, std::vector<Data>& results) {
-            
-            if (tx1 < 0 || ty1 < 0 || tz1 < 0) return;
-            
-            /* If ray casting hit a leaf, add all the points to the results */
-            for (size_t i = 0; i < buckets_.size(); i++)
-                results.push_back(buckets_[i].data_);
-
-            return;
+        void Compile(size_t index, std::vector<LinearOctreeNode>& nodes, std::vector<Data>& data, std::deque<std::pair<OctreeNode *, size_t> >& /*queue*/) {
+            nodes[index].first_ = static_cast<unsigned int>(data.size());
+            nodes[index].count_ = static_cast<unsigned int>(buckets_.Size());
+            nodes[index].child_mask_ = 0;
+            for (size_t i = 0; i < buckets_.Size(); i++)
+                data.push_back(buckets_[i].data_);
         }
 
         void ClusterNodes(size_t depth, size_t current_depth, std::vector<std::vector<Data> >& clusters) {
@@ -142,7 +169,7 @@ private:
                 at that sub-space. Create a single cluster with these leaf points
             */
 
-            for (size_t i = 0; i < buckets_.size(); i++)
+            for (size_t i = 0; i < buckets_.Size(); i++)
                 cluster.push_back(buckets_[i].data_);
 
             clusters.push_back(cluster);
@@ -150,25 +177,35 @@ private:
 
         void AddLeavesToCluster(std::vector<Data>& cluster) {
             /* Add all leaf points to that cluster */
-            for (size_t i = 0; i < buckets_.size(); i++)
+            for (size_t i = 0; i < buckets_.Size(); i++)
                 cluster.push_back(buckets_[i].data_);
         }
 
 
     private:
-        /* Holds a data point */
+        /* Holds a data point, the position in single precision */
         struct Bucket {
-            Bucket(Point3D point, Data data) : point_(point), data_(data) {};
-            Point3D point_;
+            Bucket() {};
+            Bucket(const Point3D& point, Data data) : data_(data) {
+                for (size_t i = 0; i < 3; i++) point_[i] = static_cast<float>(point[i]);
+            };
+
+            Point3D Point() const {
+                return Point3D({ point_[0], point_[1], point_[2] });
+            }
+
+            float point_[3];
             Data data_;
         };
-        std::deque<Bucket> buckets_;
+        /* More than BUCKET_SIZE points only at MAX_DEPTH */
+        InlineBucket<Bucket, BUCKET_SIZE> buckets_;
     };
 
     class OctreeInnerNode : public OctreeNode {
     public:
         OctreeInnerNode(Point3D origin, Real_t length) {
-            children_ = std::vector<OctreeNode *>(8, nullptr);
+            for (size_t i = 0; i < 8; i++)
+                children_[i] = nullptr;
 
             this->origin_ = origin;
             this->length_ = length;
@@ -178,31 +215,33 @@ private:
 
         }
 
-        void Destroy() {
-            for (size_t i = 0; i < children_.size(); i++) {
-                if (children_[i] != nullptr) {
-                    children_[i]->Destroy();
-                    delete children_[i];
-                }
+        void Destroy(Allocator& allocator) {
+            for (size_t i = 0; i < 8; i++) {
+                if (children_[i] != nullptr) children_[i]->Destroy(allocator);
             }
+            AllocatorDelete(allocator, this);
         }
 
-        OctreeNode * Insert(Point3D point, Data data) {
+        void SetChild(size_t octant, OctreeNode * child) {
+            children_[octant] = child;
+        }
+
+        OctreeNode * Insert(Allocator& allocator, Point3D point, Data data, size_t depth) {
             /* Find child */
             std::pair<Point3D, size_t> child = OctreeNode::FindChild(point);
 
             /* If null, create leaf */
             if (children_[child.second] == nullptr) {
-                children_[child.second] = new OctreeLeafNode(child.first, this->length_ / 2.0f);
+                children_[child.second] = AllocatorNew<OctreeLeafNode>(allocator, child.first, this->length_ / 2.0f);
             }
 
             /* Insert at that subtree */
-            children_[child.second] = children_[child.second]->Insert(point, data);
+            children_[child.second] = children_[child.second]->Insert(allocator, point, data, depth + 1);
 
             return this;
         }
         
-        OctreeNode * Remove(Point3D point) {
+        OctreeNode * Remove(Allocator& allocator, Point3D point) {
             /* Find child */
             std::pair<Point3D, size_t> child = OctreeNode::FindChild(point);
 
@@ -211,17 +250,17 @@ private:
             }
             
             /* Remove from child */
-            children_[child.second] = children_[child.second]->Remove(point);
+            children_[child.second] = children_[child.second]->Remove(allocator, point);
 
             /* Check the number of children that you have, if zero, delete this node */
             size_t number_of_non_null_children = 0;
-            for (size_t i = 0; i < children_.size(); i++)
+            for (size_t i = 0; i < 8; i++)
                 if (children_[i] != nullptr) {
                     number_of_non_null_children++;
                 }
 
             if (number_of_non_null_children == 0) {
-                delete this;
+                AllocatorDelete(allocator, this);
                 return nullptr;
             }
 
@@ -230,79 +269,35 @@ private:
 
         size_t Depth() {
             size_t current_depth = 0;
-            for (size_t i = 0; i < children_.size(); i++)
+            for (size_t i = 0; i < 8; i++)
                 if (children_[i] != nullptr) current_depth = std::max(current_depth, children_[i]->Depth());
 
             return current_depth + 1;
         }
         
-        void RayCastProcessChild(Real_t tx0, Real_t ty0, Real_t tz0, Real_t tx1, Real_t ty1, Real_t tz1, unsigned char a, std::vector<Data>& results) {
-            Real_t txm, tym, tzm;
-            int current_node;
-
-            if (tx1 < 0 || ty1 < 0 || tz1 < 0) return;
-            
-            /* Calculate the middle of the entry and exit point */
-            txm = Real_t(0.5)*(tx0 + tx1);
-            tym = Real_t(0.5)*(ty0 + ty1);
-            tzm = Real_t(0.5)*(tz0 + tz1);
-
-            /* Calculate the first node to be visited */
-            current_node = RayCastFirstNode(tx0, ty0, tz0, txm, tym, tzm);
-
-            /* Iteratively visit the nodes along the ray */
-            do {
-                int index = current_node ^ a;
-                switch (current_node)
-                {
-                case 0:  {
-                    if (children_[index] != nullptr) children_[index]->RayCastProcessChild(tx0, ty0, tz0, txm, tym, tzm, a, results);
-                    current_node = RayCastNewNode(txm, 4, tym, 2, tzm, 1);
-                    break;  
-                } case 1:  {
-                    if (children_[index] != nullptr) children_[index]->RayCastProcessChild(tx0, ty0, tzm, txm, tym, tz1, a, results);
-                    current_node = RayCastNewNode(txm, 5, tym, 3, tz1, 8);
-                    break; 
-                } case 2:  {
-                    if (children_[index] != nullptr) children_[index]->RayCastProcessChild(tx0, tym, tz0, txm, ty1, tzm, a, results);
-                    current_node = RayCastNewNode(txm, 6, ty1, 8, tzm, 3);
-                    break; 
-                } case 3:  {
-                    if (children_[index] != nullptr) children_[index]->RayCastProcessChild(tx0, tym, tzm, txm, ty1, tz1, a, results);
-                    current_node = RayCastNewNode(txm, 7, ty1, 8, tz1, 8);
-                    break; 
-                } case 4:  {
-                    if (children_[index] != nullptr) children_[index]->RayCastProcessChild(txm, ty0, tz0, tx1, tym, tzm, a, results);
-                    current_node = RayCastNewNode(tx1, 8, tym, 6, tzm, 5);
-                    break; 
-                } case 5: {
-                    if (children_[index] != nullptr) children_[index]->RayCastProcessChild(txm, ty0, tzm, tx1, tym, tz1, a, results);
-                    current_node = RayCastNewNode(tx1, 8, tym, 7, tz1, 8);
-                    break; 
-                } case 6:  {
-                    if (children_[index] != nullptr) children_[index]->RayCastProcessChild(txm, tym, tz0, tx1, ty1, tzm, a, results);
-                    current_node = RayCastNewNode(tx1, 8, ty1, 8, tzm, 7);
-                    break; 
-                } case 7: {
-                    if (children_[index] != nullptr) children_[index]->RayCastProcessChild(txm, tym, tzm, tx1, ty1, tz1, a, results);
-                    current_node = 8;
-                    break; 
-                }
-                }
-            } while (current_node < 8);
+        void Compile(size_t index, std::vector<LinearOctreeNode>& nodes, std::vector<Data>& /*data*/, std::deque<std::pair<OctreeNode *, size_t> >& queue) {
+            nodes[index].first_ = static_cast<unsigned int>(nodes.size());
+            nodes[index].count_ = 0;
+            nodes[index].child_mask_ = 0;
+            for (size_t i = 0; i < 8; i++) {
+                if (children_[i] == nullptr) continue;
+                nodes[index].child_mask_ |= 1 << i;
+                queue.push_back(std::make_pair(children_[i], nodes.size()));
+                nodes.push_back(LinearOctreeNode());
+            }
         }
 
         void ClusterNodes(size_t depth, size_t current_depth, std::vector<std::vector<Data> >& clusters) {
             /* If depth not reached, propagate the call */
             if (current_depth < depth) {
-                for (size_t i = 0; i < children_.size(); i++)
+                for (size_t i = 0; i < 8; i++)
                     if (children_[i] != nullptr) children_[i]->ClusterNodes(depth, current_depth + 1, clusters);
                 return;
             }
 
             /* Either-wise, create cluster and add all leaves below this level to that cluster */
             std::vector<Data> cluster;
-            for (size_t i = 0; i < children_.size(); i++) {
+            for (size_t i = 0; i < 8; i++) {
                 if (children_[i] != nullptr) children_[i]->AddLeavesToCluster(cluster);
             }
 
@@ -312,46 +307,30 @@ private:
 
         void AddLeavesToCluster(std::vector<Data>& cluster) {
             /* Propagate the call */
-            for (size_t i = 0; i < children_.size(); i++)
+            for (size_t i = 0; i < 8; i++)
                 if (children_[i] != nullptr) children_[i]->AddLeavesToCluster(cluster);
         }
 
 
     private:
-        std::vector<OctreeNode *> children_;
-
-        int RayCastFirstNode(Real_t tx0, Real_t ty0, Real_t tz0, Real_t txm, Real_t tym, Real_t tzm) {
-            unsigned char answer = 0;
-            
-            if (tx0 > ty0) {
-                if (tx0 > tz0) {
-                    if (tym < tx0) answer |= 2;
-                    if (tzm < tx0) answer |= 1;
-                    return (int)answer;
-                }
-            } else {
-                if (ty0 > tz0) {
-                    if (txm < ty0) answer |= 4;
-                    if (tzm < ty0) answer |= 1;
-                    return (int)answer;
-                }
-            }
+        OctreeNode * children_[8];
+    };
 
-            if (txm < tz0) answer |= 4;
-            if (tym < tz0) answer |= 2;
-            return (int)answer;
-        }
+    /**
+        Leaf visitor that gathers the data of all the leaves hit
+    */
+    struct GatherVisitor {
+        GatherVisitor(const Data * leaf_data, std::vector<Data>& results) : leaf_data_(leaf_data), results_(results) {};
 
-        int RayCastNewNode(Real_t txm, int x, Real_t tym, int y, Real_t tzm, int z) {
-            if (txm < tym) {
-                if (txm < tzm) { return x; }
-            }
-            else {
-                if (tym < tzm) { return y; }
-            }
-            return z;
+        bool operator()(const LinearOctreeNode& leaf, Real_t /*t_enter*/, Real_t /*t_exit*/) {
+            /* If ray casting hit a leaf, add all the points to the results */
+            for (unsigned int i = leaf.first_; i < leaf.first_ + leaf.count_; i++)
+                results_.push_back(leaf_data_[i]);
+            return false;
         }
 
+        const Data * leaf_data_;
+        std::vector<Data>& results_;
     };
 
 public:
@@ -363,20 +342,80 @@ public:
     PointOctree(Point3D origin, Real_t length) {
         origin_ = origin;
         length_ = length;
-        root_ = new OctreeLeafNode(origin, length);
+        root_ = AllocatorNew<OctreeLeafNode>(allocator_, origin, length);
+    }
+
+    /**
+        Build the octree from all the points at once. The points are sorted by their Morton code, 
+        then the octree is built from the ranges of points that share a key prefix. Sorting and
+        building the top level subtrees run on the thread pool. The octree is compiled
+        @param origin The "bottom left" point in the octree area
+        @param length The size of the octree region in all direction
+        @param points The positions in 3D space
+        @param data The data to store for each point
+        @param pool The threads to use
+    */
+    PointOctree(Point3D origin, Real_t length, const std::vector<Point3D>& points, const std::vector<Data>& data, ThreadPool& pool = ThreadPool::Default()) {
+        origin_ = origin;
+        length_ = length;
+
+        /* The octree can't be deeper than the bits per axis of the keys */
+        const int depth = std::min(MAX_DEPTH, MORTON_MAX_DEPTH);
+        const Real_t cells = Real_t(uint64_t(1) << depth);
+
+        std::vector<MortonKey> keys(points.size());
+        std::vector<char> inside(points.size());
+        pool.ParallelFor(points.size(), 4096, [&](size_t begin, size_t end) {
+            for (size_t i = begin; i < end; i++) {
+                uint64_t cell[3];
+                inside[i] = true;
+                for (size_t c = 0; c < 3; c++) {
+                    /* Rounded like the points of Insert */
+                    Real_t coordinate = static_cast<float>(points[i][c]);
+                    inside[i] = inside[i] && coordinate > origin_[c] && coordinate < origin_[c] + length_;
+                    Real_t cell_coordinate = std::floor((coordinate - origin_[c]) / length_ * cells);
+                    cell[c] = static_cast<uint64_t>(std::min(std::max(cell_coordinate, Real_t(0)), cells - 1));
+                }
+                keys[i].key_ = MortonEncode(cell[0], cell[1], cell[2]);
+                keys[i].index_ = static_cast<unsigned int>(i);
+            }
+        });
+
+        /* Same as Insert, points outside of the region are dropped */
+        size_t kept = 0;
+        for (size_t i = 0; i < keys.size(); i++) {
+            if (!inside[i]) {
+                std::cout << "Point: " << points[i] << " is outside octree region" << std::endl;
+                continue;
+            }
+            keys[kept++] = keys[i];
+        }
+        keys.resize(kept);
+
+        ParallelRadixSort(keys, 3 * depth, pool);
+
+        root_ = BuildNode(allocator_, keys, points, data, 0, keys.size(), 0, depth, origin_, length_, &pool);
+
+        Compile();
     }
 
     ~PointOctree() {
-        delete root_;
+        Destroy();
     }
 
     /**
         Delete everything, don't use after this call
     */
     void Destroy() {
-        root_->Destroy();
-        delete root_;
+        if (root_ == nullptr) return;
+
+        /* Without destructors to run, the allocator frees the nodes at once */
+        if (!Allocator::RELEASES_ALL || !std::is_trivially_destructible<Data>::value) root_->Destroy(allocator_);
+        allocator_.Release();
         root_ = nullptr;
+
+        compiled_nodes_ = std::vector<LinearOctreeNode>();
+        compiled_data_ = std::vector<Data>();
     }
 
     /**
@@ -385,6 +424,7 @@ public:
         @param data The data to store
     */
     void Insert(Point3D point, Data data) {
+        point = Round(point);
         bool inside_x = point[0] > origin_[0] && (point[0] < origin_[0] + length_);
         bool inside_y = point[1] > origin_[1] && (point[1] < origin_[1] + length_);
         bool inside_z = point[2] > origin_[2] && (point[2] < origin_[2] + length_);
@@ -394,7 +434,11 @@ public:
             return;
         }
 
-        root_ = root_->Insert(point, data);
+        root_ = root_->Insert(allocator_, point, data, 0);
+
+        /* The linear octree is out of date */
+        compiled_nodes_.clear();
+        compiled_data_.clear();
     }
 
     /**
@@ -402,9 +446,36 @@ public:
         @param point The 3D space point to remove
     */
     void Remove(Point3D point) {
-        root_ = root_->Remove(point);
+        root_ = root_->Remove(allocator_, Round(point));
         
-        if (root_ == nullptr) root_ = new OctreeLeafNode(origin_, length_);
+        if (root_ == nullptr) root_ = AllocatorNew<OctreeLeafNode>(allocator_, origin_, length_);
+
+        /* The linear octree is out of date */
+        compiled_nodes_.clear();
+        compiled_data_.clear();
+    }
+
+    /**
+        Pack the octree into a linear octree, the layout used by the ray queries. Call once after 
+        the last Insert. Otherwise the first ray query compiles the octree, which is not thread safe
+    */
+    void Compile() {
+        compiled_nodes_.clear();
+        compiled_data_.clear();
+
+        /* Visit breadth first, so that the children of each node are stored next to each other */
+        std::deque<std::pair<OctreeNode *, size_t> > queue;
+        compiled_nodes_.push_back(LinearOctreeNode());
+        queue.push_back(std::make_pair(root_, 0));
+        while (!queue.empty()) {
+            std::pair<OctreeNode *, size_t> item = queue.front();
+            queue.pop_front();
+            item.first->Compile(item.second, compiled_nodes_, compiled_data_, queue);
+        }
+    }
+
+    bool IsCompiled() {
+        return !compiled_nodes_.empty();
     }
 
     size_t Depth() {
@@ -417,46 +488,11 @@ public:
         @param[out] results The results will be pushed back here, in first to hit order
     */
     void RayCast(Ray3D r, std::vector<Data>& results) {
-        unsigned char a = 0;
-
-        /**
-            If ray has negative components calculate the reflection of the ray
-        */
-        if (r.Direction()[0] < 0) {
-            r.Origin()[0] = (origin_[0] + length_ / 2.0) * 2 - r.Origin()[0];
-            r.Direction()[0] = -r.Direction()[0];
-            a |= 4;
-        }
-        if (r.Direction()[1] < 0) {
-            r.Origin()[1] = (origin_[1] + length_ / 2.0) - r.Origin()[1];
-            r.Direction()[1] = -r.Direction()[1];
-            a |= 2;
-        }
-        if (r.Direction()[2] < 0) {
-            r.Origin()[2] = (origin_[2] + length_ / 2.0) - r.Origin()[2];
-            r.Direction()[2] = -r.Direction()[2];
-            a |= 1;
-        }
-
-        /*
-            Compute the starting parametric values of entry and exit for the root node
-        */
-
-        Real_t divx = Real_t(1) / r.Direction()[0];
-        Real_t divy = Real_t(1) / r.Direction()[1];
-        Real_t divz = Real_t(1) / r.Direction()[2];
+        if (!IsCompiled()) Compile();
 
-        Real_t tx0 = (origin_[0] - r.Origin()[0]) * divx;
-        Real_t tx1 = (origin_[0] + length_ - r.Origin()[0]) * divx;
-        Real_t ty0 = (origin_[1] - r.Origin()[1]) * divy;
-        Real_t ty1 = (origin_[1] + length_ - r.Origin()[1]) * divy;
-        Real_t tz0 = (origin_[2] - r.Origin()[2]) * divz;
-        Real_t tz1 = (origin_[2] + length_ - r.Origin()[2]) * divz;
-
-        /* If there is intersection, continue */
-        if (std::max(std::max(tx0, ty0), tz0) < std::min(std::min(tx1, ty1), tz1)) {
-            root_->RayCastProcessChild(tx0, ty0, tz0, tx1, ty1, tz1, a, results);
-        }
+        GatherVisitor visitor(compiled_data_.data(), results);
+        Real_t tmax = std::numeric_limits<Real_t>::max();
+        LinearOctreeTraversal<MAX_DEPTH>::RayCast(compiled_nodes_.data(), origin_, length_, r, 0, tmax, visitor);
     }
 
     /**
@@ -470,9 +506,66 @@ public:
     }
 
 private:
+    /**
+        The leaves store points in single precision. Points are rounded before they are placed, so
+        that splits and Remove find the same octants as the first placement
+    */
+    static Point3D Round(const Point3D& point) {
+        return Point3D({ static_cast<float>(point[0]), static_cast<float>(point[1]), static_cast<float>(point[2]) });
+    }
+
+    /* Declared first, so that it outlives the nodes */
+    Allocator allocator_;
     OctreeNode * root_;
     Point3D origin_;
     Real_t length_;
+
+    /**
+        Build the subtree of the sorted keys [begin, end), which share their first level octants.
+        If a pool is given, the children are built in parallel
+    */
+    static OctreeNode * BuildNode(Allocator& allocator, const std::vector<MortonKey>& keys, const std::vector<Point3D>& points, const std::vector<Data>& data, size_t begin, size_t end, int level, int depth, Point3D origin, Real_t length, ThreadPool * pool) {
+        /* Leaf if the points fit, or if the keys have no more bits to split on */
+        if (end - begin <= BUCKET_SIZE || level >= depth) {
+            OctreeLeafNode * leaf = AllocatorNew<OctreeLeafNode>(allocator, origin, length);
+            leaf->Reserve(allocator, end - begin);
+            for (size_t i = begin; i < end; i++)
+                leaf->Add(allocator, points[keys[i].index_], data[keys[i].index_]);
+            return leaf;
+        }
+
+        /* The keys are sorted, so the points of each octant form a range */
+        int shift = 3 * (depth - 1 - level);
+        size_t octant_begin[9];
+        size_t i = begin;
+        for (int octant = 0; octant < 8; octant++) {
+            octant_begin[octant] = i;
+            while (i < end && static_cast<int>((keys[i].key_ >> shift) & 7) == octant) i++;
+        }
+        octant_begin[8] = end;
+
+        OctreeInnerNode * node = AllocatorNew<OctreeInnerNode>(allocator, origin, length);
+        Real_t H = length / 2.0f;
+        auto build_octants = [&](size_t first, size_t last) {
+            for (size_t octant = first; octant < last; octant++) {
+                if (octant_begin[octant] == octant_begin[octant + 1]) continue;
+                Point3D child_origin = origin;
+                child_origin[0] += H * ((octant >> 2) & 1);
+                child_origin[1] += H * ((octant >> 1) & 1);
+                child_origin[2] += H * (octant & 1);
+                node->SetChild(octant, BuildNode(allocator, keys, points, data, octant_begin[octant], octant_begin[octant + 1], level + 1, depth, child_origin, H, nullptr));
+            }
+        };
+
+        if (pool != nullptr) pool->ParallelFor(8, 1, build_octants);
+        else build_octants(0, 8);
+
+        return node;
+    }
+
+    /* The linear octree */
+    std::vector<LinearOctreeNode> compiled_nodes_;
+    std::vector<Data> compiled_data_;
 };
 
 #endif
\ No newline at end of file
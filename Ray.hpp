@@ -9,18 +9,31 @@
 template<int K>
 class Ray {
 public:
-    Ray(Point<K> origin, Point<K> direction) : origin_(origin), direction_(direction) {
-        direction_.Normalise();
+    /**
+        @param origin The ray origin
+        @param direction The ray direction
+        @param normalise Set to false if the direction is already of unit length
+    */
+    Ray(const Point<K>& origin, const Point<K>& direction, bool normalise = true) : origin_(origin), direction_(direction) {
+        if (normalise) direction_.Normalise();
     };
 
     Point<K>& Origin() {
         return origin_;
     }
 
+    const Point<K>& Origin() const {
+        return origin_;
+    }
+
     Point<K>& Direction() {
         return direction_;
     }
 
+    const Point<K>& Direction() const {
+        return direction_;
+    }
+
 private:
     Point<K> origin_;
     Point<K> direction_;
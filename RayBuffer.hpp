@@ -0,0 +1,88 @@
+#ifndef __RayBuffer_hpp__
+#define __RayBuffer_hpp__
+
+#include <limits>
+#include <vector>
+
+#include "Ray.hpp"
+#include "RayTriangleIntersection.hpp"
+
+/**
+    A batch of rays, stored as a structure of arrays
+*/
+struct RayBuffer {
+    RayBuffer() : unit_directions_(false) {};
+
+    void Resize(size_t size) {
+        origin_x_.resize(size);
+        origin_y_.resize(size);
+        origin_z_.resize(size);
+        direction_x_.resize(size);
+        direction_y_.resize(size);
+        direction_z_.resize(size);
+        tmin_.resize(size, 0);
+        tmax_.resize(size, std::numeric_limits<Real_t>::max());
+    }
+
+    size_t Size() const {
+        return origin_x_.size();
+    }
+
+    void Set(size_t i, Point3D origin, Point3D direction, Real_t tmin = 0, Real_t tmax = std::numeric_limits<Real_t>::max()) {
+        origin_x_[i] = origin[0];
+        origin_y_[i] = origin[1];
+        origin_z_[i] = origin[2];
+        direction_x_[i] = direction[0];
+        direction_y_[i] = direction[1];
+        direction_z_[i] = direction[2];
+        tmin_[i] = tmin;
+        tmax_[i] = tmax;
+    }
+
+    /**
+        @return The ray at index i. The direction is normalised, t values are measured along it
+    */
+    Ray3D Get(size_t i) const {
+        return Ray3D(Point3D({ origin_x_[i], origin_y_[i], origin_z_[i] }), Point3D({ direction_x_[i], direction_y_[i], direction_z_[i] }), !unit_directions_);
+    }
+
+    /* Set to true if all the directions are of unit length, they are then not normalised again */
+    bool unit_directions_;
+
+    std::vector<Real_t> origin_x_, origin_y_, origin_z_;
+    std::vector<Real_t> direction_x_, direction_y_, direction_z_;
+    std::vector<Real_t> tmin_, tmax_;
+};
+
+/**
+    The closest hits of a batch of rays, stored as a structure of arrays. Rays that hit
+    nothing have RayHit::INVALID_TRIANGLE as triangle id
+*/
+struct HitBuffer {
+    void Resize(size_t size) {
+        triangle_id_.resize(size);
+        t_.resize(size);
+        u_.resize(size);
+        v_.resize(size);
+    }
+
+    size_t Size() const {
+        return triangle_id_.size();
+    }
+
+    void Set(size_t i, const RayHit& hit) {
+        triangle_id_[i] = hit.triangle_id_;
+        t_[i] = hit.t_;
+        u_[i] = hit.u_;
+        v_[i] = hit.v_;
+    }
+
+    bool Valid(size_t i) const {
+        return triangle_id_[i] != RayHit::INVALID_TRIANGLE;
+    }
+
+    std::vector<unsigned int> triangle_id_;
+    std::vector<Real_t> t_, u_, v_;
+};
+
+#endif
@@ -0,0 +1,40 @@
+#ifndef __RayPacket_hpp__
+#define __RayPacket_hpp__
+
+#include "SimdFloat.hpp"
+
+/*
+    The rays of a packet in single precision, for the slab tests of the packet traversals, one lane
+    per ray. Inactive lanes have an empty interval. Only plain floats, so that RayPacketAvx2.cpp
+    compiles no inline function of another header
+*/
+struct RayPacket {
+    static const int MAX_WIDTH = 8;
+
+    float ox_[MAX_WIDTH], oy_[MAX_WIDTH], oz_[MAX_WIDTH];
+    /* The inverse of the directions */
+    float ix_[MAX_WIDTH], iy_[MAX_WIDTH], iz_[MAX_WIDTH];
+    float tmin_[MAX_WIDTH], tmax_[MAX_WIDTH];
+};
+
+/**
+    Slab test of the rays of a packet against a cube, SimdFloat::WIDTH lanes
+    @param near_planes The planes of the cube the rays enter through, along x, y and z
+    @param far_planes The planes the rays leave through
+    @return Bit l is set if ray l goes through the cube inside its interval
+*/
+template<typename SimdFloat>
+int RayPacketSlab(const RayPacket& packet, const float near_planes[3], const float far_planes[3]) {
+    SimdFloat ox = SimdFloat::Load(packet.ox_), oy = SimdFloat::Load(packet.oy_), oz = SimdFloat::Load(packet.oz_);
+    SimdFloat ix = SimdFloat::Load(packet.ix_), iy = SimdFloat::Load(packet.iy_), iz = SimdFloat::Load(packet.iz_);
+    SimdFloat t_enter = Max(Max((SimdFloat(near_planes[0]) - ox) * ix, (SimdFloat(near_planes[1]) - oy) * iy), Max((SimdFloat(near_planes[2]) - oz) * iz, SimdFloat::Load(packet.tmin_)));
+    SimdFloat t_exit = Min(Min((SimdFloat(far_planes[0]) - ox) * ix, (SimdFloat(far_planes[1]) - oy) * iy), Min((SimdFloat(far_planes[2]) - oz) * iz, SimdFloat::Load(packet.tmax_)));
+    return LessEqualMask(t_enter, t_exit);
+}
+
+#ifdef SIMD_FLOAT_AVX
+/* RayPacketSlab with 8 lanes in an AVX register, in RayPacketAvx2.cpp. Only call it if the CPU supports AVX2 */
+int RayPacketSlabAvx2(const RayPacket& packet, const float near_planes[3], const float far_planes[3]);
+#endif
+
+#endif
@@ -0,0 +1,12 @@
+#include "RayPacket.hpp"
+
+/* Compiled with AVX2 enabled, see TriangleBoxOverlappingAvx2.cpp */
+#ifdef SIMD_FLOAT_AVX
+#ifndef __AVX2__
+#error "Compile the *Avx2.cpp files with AVX2 enabled, -mavx2 or /arch:AVX2"
+#endif
+
+int RayPacketSlabAvx2(const RayPacket& packet, const float near_planes[3], const float far_planes[3]) {
+    return RayPacketSlab<SimdFloat8>(packet, near_planes, far_planes);
+}
+#endif
@@ -0,0 +1,224 @@
+#ifndef __RayTriangleIntersection_hpp__
+#define __RayTriangleIntersection_hpp__
+
+#include <cmath>
+#include <limits>
+#include <vector>
+
+#include <glm/glm.hpp>
+
+#include "Ray.hpp"
+
+/**
+    The result of a closest hit query
+*/
+struct RayHit {
+    RayHit() : triangle_id_(INVALID_TRIANGLE), t_(std::numeric_limits<Real_t>::max()), u_(0), v_(0) {};
+
+    bool Valid() const { return triangle_id_ != INVALID_TRIANGLE; }
+
+    static const unsigned int INVALID_TRIANGLE = ~0u;
+
+    /* The id of the triangle hit */
+    unsigned int triangle_id_;
+    /* Distance along the ray direction */
+    Real_t t_;
+    /* Barycentric coordinates of the hit point, relative to the second and third vertex */
+    Real_t u_, v_;
+};
+
+/**
+    The triangles a ray has been tested against, so that a triangle referenced by several leaves
+    is tested once per ray. A small direct mapped cache, a triangle evicted by another one is
+    just tested again
+*/
+struct Mailbox {
+    Mailbox() {
+        for (unsigned int i = 0; i < SIZE; i++) ids_[i] = RayHit::INVALID_TRIANGLE;
+    }
+
+    /* Must be a power of two */
+    static const unsigned int SIZE = 16;
+
+    bool Contains(unsigned int triangle_id) const {
+        return ids_[triangle_id & (SIZE - 1)] == triangle_id;
+    }
+
+    void Add(unsigned int triangle_id) {
+        ids_[triangle_id & (SIZE - 1)] = triangle_id;
+    }
+
+    /**
+        @return true if the triangle was already tested, otherwise mark it as tested
+    */
+    bool TestAndAdd(unsigned int triangle_id) {
+        unsigned int& slot = ids_[triangle_id & (SIZE - 1)];
+        if (slot == triangle_id) return true;
+        slot = triangle_id;
+        return false;
+    }
+
+private:
+    unsigned int ids_[SIZE];
+};
+
+/**
+    Triangles stored as a structure of arrays in the form the intersection test uses: the first
+    vertex and the two edges that leave it. The arrays hold PADDING zero triangles past the end,
+    so that the vector leaf kernels can load a full register at the end of any range. The nine
+    arrays lie one after the other in one block, owned by the buffer or, after View, by someone
+    else
+*/
+struct TriangleBuffer {
+    TriangleBuffer() : v0_x_(nullptr), v0_y_(nullptr), v0_z_(nullptr), e1_x_(nullptr), e1_y_(nullptr), e1_z_(nullptr), e2_x_(nullptr), e2_y_(nullptr), e2_z_(nullptr), size_(0) {};
+
+    /* The arrays point into the buffer */
+    TriangleBuffer(const TriangleBuffer&) = delete;
+    TriangleBuffer& operator=(const TriangleBuffer&) = delete;
+
+    /* The width of the widest leaf kernel */
+    static const size_t PADDING = 16;
+
+    void Resize(size_t size) {
+        storage_.assign(9 * (size + PADDING), 0.0f);
+        Point(storage_.data(), size);
+    }
+
+    /**
+        Use triangles stored elsewhere, in the layout of Data(), without copying them
+        @param data The block of the arrays, it must outlive the buffer. Set can't be called
+        @param size The number of triangles
+    */
+    void View(const float * data, size_t size) {
+        std::vector<float>().swap(storage_);
+        Point(data, size);
+    }
+
+    size_t Size() const {
+        return size_;
+    }
+
+    void Clear() {
+        Resize(0);
+    }
+
+    /**
+        @return The nine arrays one after the other, 9 * (Size() + PADDING) floats
+    */
+    const float * Data() const {
+        return v0_x_;
+    }
+
+    /**
+        @return The bytes held by the arrays
+    */
+    size_t MemoryUsage() const {
+        return 9 * (size_ + PADDING) * sizeof(float);
+    }
+
+    void Set(size_t i, const glm::vec3& v0, const glm::vec3& v1, const glm::vec3& v2) {
+        glm::vec3 e1 = v1 - v0;
+        glm::vec3 e2 = v2 - v0;
+        const size_t stride = size_ + PADDING;
+        float * data = storage_.data() + i;
+        data[0] = v0.x;
+        data[stride] = v0.y;
+        data[2 * stride] = v0.z;
+        data[3 * stride] = e1.x;
+        data[4 * stride] = e1.y;
+        data[5 * stride] = e1.z;
+        data[6 * stride] = e2.x;
+        data[7 * stride] = e2.y;
+        data[8 * stride] = e2.z;
+    }
+
+    const float * v0_x_, * v0_y_, * v0_z_;
+    const float * e1_x_, * e1_y_, * e1_z_;
+    const float * e2_x_, * e2_y_, * e2_z_;
+
+private:
+    std::vector<float> storage_;
+    size_t size_;
+
+    void Point(const float * data, size_t size) {
+        const size_t stride = size + PADDING;
+        size_ = size;
+        v0_x_ = data;
+        v0_y_ = data + stride;
+        v0_z_ = data + 2 * stride;
+        e1_x_ = data + 3 * stride;
+        e1_y_ = data + 4 * stride;
+        e1_z_ = data + 5 * stride;
+        e2_x_ = data + 6 * stride;
+        e2_y_ = data + 7 * stride;
+        e2_z_ = data + 8 * stride;
+    }
+};
+
+/**
+    Möller–Trumbore ray/triangle intersection
+    @param origin The ray origin
+    @param direction The ray direction
+    @param v0 The first vertex of the triangle
+    @param e1, e2 The edges from the first vertex to the second and the third one
+    @param[out] t, u, v The hit distance and barycentrics, written only on a hit
+    @return true if the ray hits the triangle at some t, false otherwise
+*/
+inline bool rayTriangleIntersect(const Real_t origin[3], const Real_t direction[3], const Real_t v0[3], const Real_t e1[3], const Real_t e2[3], Real_t& t, Real_t& u, Real_t& v) {
+    /* p = direction x e2 */
+    Real_t p[3] = {
+        direction[1] * e2[2] - direction[2] * e2[1],
+        direction[2] * e2[0] - direction[0] * e2[2],
+        direction[0] * e2[1] - direction[1] * e2[0]
+    };
+
+    /* If the determinant is zero the ray is parallel to the triangle plane */
+    Real_t det = e1[0] * p[0] + e1[1] * p[1] + e1[2] * p[2];
+    if (std::abs(det) < std::numeric_limits<Real_t>::epsilon()) return false;
+    Real_t inv_det = Real_t(1) / det;
+
+    Real_t s[3] = { origin[0] - v0[0], origin[1] - v0[1], origin[2] - v0[2] };
+    Real_t hit_u = (s[0] * p[0] + s[1] * p[1] + s[2] * p[2]) * inv_det;
+    if (hit_u < 0 || hit_u > 1) return false;
+
+    /* q = s x e1 */
+    Real_t q[3] = {
+        s[1] * e1[2] - s[2] * e1[1],
+        s[2] * e1[0] - s[0] * e1[2],
+        s[0] * e1[1] - s[1] * e1[0]
+    };
+    Real_t hit_v = (direction[0] * q[0] + direction[1] * q[1] + direction[2] * q[2]) * inv_det;
+    if (hit_v < 0 || hit_u + hit_v > 1) return false;
+
+    t = (e2[0] * q[0] + e2[1] * q[1] + e2[2] * q[2]) * inv_det;
+    u = hit_u;
+    v = hit_v;
+    return true;
+}
+
+/**
+    Möller–Trumbore ray/triangle intersection
+    @param origin The ray origin
+    @param direction The ray direction
+    @param v0, v1, v2 The triangle vertices
+    @param[out] t, u, v The hit distance and barycentrics, written only on a hit
+    @return true if the ray hits the triangle at some t, false otherwise
+*/
+inline bool rayTriangleIntersect(const Real_t origin[3], const Real_t direction[3], const glm::vec3& v0, const glm::vec3& v1, const glm::vec3& v2, Real_t& t, Real_t& u, Real_t& v) {
+    Real_t p0[3] = { v0.x, v0.y, v0.z };
+    Real_t e1[3] = { Real_t(v1.x) - v0.x, Real_t(v1.y) - v0.y, Real_t(v1.z) - v0.z };
+    Real_t e2[3] = { Real_t(v2.x) - v0.x, Real_t(v2.y) - v0.y, Real_t(v2.z) - v0.z };
+    return rayTriangleIntersect(origin, direction, p0, e1, e2, t, u, v);
+}
+
+/**
+    Möller–Trumbore ray/triangle intersection with triangle i of a triangle buffer
+*/
+inline bool rayTriangleIntersect(const Real_t origin[3], const Real_t direction[3], const TriangleBuffer& buffer, size_t i, Real_t& t, Real_t& u, Real_t& v) {
+    Real_t v0[3] = { buffer.v0_x_[i], buffer.v0_y_[i], buffer.v0_z_[i] };
+    Real_t e1[3] = { buffer.e1_x_[i], buffer.e1_y_[i], buffer.e1_z_[i] };
+    Real_t e2[3] = { buffer.e2_x_[i], buffer.e2_y_[i], buffer.e2_z_[i] };
+    return rayTriangleIntersect(origin, direction, v0, e1, e2, t, u, v);
+}
+
+#endif
@@ -15,6 +15,30 @@
 #include "TriangleBoxOverlapping.hpp"
 
 
+/**
+    A level of detail of a mesh, by vertex clustering at an octree depth, preprocessed. It is
+    loaded from its cache file next to the model if that is up to date, otherwise built and cached
+    @param model The file of the model the mesh was read from
+    @param model_key FileKey of the model
+*/
+static TriangleMesh * LevelOfDetail(TriangleMesh& mesh, size_t depth, const std::string& model, uint64_t model_key) {
+    std::string cache_path = model + ".lod" + std::to_string(depth) + ".octree";
+    uint64_t key = HashCombine(model_key, depth);
+
+    std::cout << "Clustering: " << depth << " ..." << std::endl;
+    TriangleMesh * lod = new TriangleMesh();
+    bool cached = lod->LoadCache(cache_path, key);
+    if (!cached) {
+        delete lod;
+        lod = mesh.VertexClustering(depth);
+    }
+
+    std::cout << "Preprocessing: " << depth << " ..." << std::endl;
+    lod->Preprocess();
+    if (!cached) lod->SaveCache(cache_path, key);
+    return lod;
+}
+
 Scene::Scene()
 {
 }
@@ -29,13 +53,24 @@ void Scene::init() {
 
     PLYReader reader;
 
-    /* Read a mesh */
+    /* 
+        Read a mesh, or its cache if the model did not change since it was written. The cache 
+        holds the accelerator chosen when it was written, so only that one is built on a hit
+    */
     std::cout << "Reading the model..." << std::endl;
+    std::string model = "bunny.ply";
+    uint64_t model_key = FileKey(model);
     TriangleMesh * mesh = new TriangleMesh();
-    reader.readMesh("bunny.ply", *mesh);
+    bool cached = mesh->LoadCache(model + ".octree", model_key);
+    if (!cached) reader.readMesh(model, *mesh);
     /* Preprocess the mesh before sending to OpenGL */
     std::cout << "Preprocessing the model..." << std::endl;
     mesh->Preprocess();
+    if (!cached) {
+        /* Pick the fastest of the octree, the BVH and the grids for this mesh */
+        //mesh->SelectAccelerator(20000);
+        mesh->SaveCache(model + ".octree", model_key);
+    }
     mesh->sendToOpenGL(basicProgram);
     /* Draw a mesh at that position */
     object_ = new GraphicsObject(mesh);
@@ -44,55 +79,46 @@ void Scene::init() {
     /* Gather info for ray tracing, use 5 million rays */
     //mesh->TestRaysPerSecond(5000000);
 
+    /* Check the vector octant test the octree is built with, on this CPU and with these build flags */
+    TestTriBoxOverlapOctants(20000);
+
+    /* Pick the bucket size and the depth of the triangles octree for this mesh */
+    //mesh->TuneOctree(20000);
+
     /* 
         Create a simplified version of that mesh, preprocess, send to opengl, 
         and create an object at that position
     */
-    std::cout << "Clustering: 7 ..." << std::endl;
-    TriangleMesh * mesh_lod_1 = mesh->VertexClustering(7);
+    TriangleMesh * mesh_lod_1 = LevelOfDetail(*mesh, 7, model, model_key);
     //TriangleMesh * mesh_lod_1 = mesh->VertexClustering_GRID(128);
-    std::cout << "Preprocessing: 7 ..." << std::endl;
-    mesh_lod_1->Preprocess();
     mesh_lod_1->sendToOpenGL(basicProgram);
     object_lod_1 = new GraphicsObject(mesh_lod_1);
     object_lod_1->SetPosition(glm::vec3(1, 0, 0));
     std::cout << std::endl;
 
-    std::cout << "Clustering: 6 ..." << std::endl;
-    TriangleMesh * mesh_lod_2 = mesh->VertexClustering(6);
+    TriangleMesh * mesh_lod_2 = LevelOfDetail(*mesh, 6, model, model_key);
     //TriangleMesh * mesh_lod_2 = mesh->VertexClustering_GRID(64);
-    std::cout << "Preprocessing: 6 ..." << std::endl;
-    mesh_lod_2->Preprocess();
     mesh_lod_2->sendToOpenGL(basicProgram);
     object_lod_2 = new GraphicsObject(mesh_lod_2);
     object_lod_2->SetPosition(glm::vec3(2, 0, 0));
     std::cout << std::endl;
 
-    std::cout << "Clustering: 5 ..." << std::endl;
-    TriangleMesh * mesh_lod_3 = mesh->VertexClustering(5);
+    TriangleMesh * mesh_lod_3 = LevelOfDetail(*mesh, 5, model, model_key);
     //TriangleMesh * mesh_lod_3 = mesh->VertexClustering_GRID(32);
-    std::cout << "Preprocessing: 5 ..." << std::endl;
-    mesh_lod_3->Preprocess();
     mesh_lod_3->sendToOpenGL(basicProgram);
     object_lod_3 = new GraphicsObject(mesh_lod_3);
     object_lod_3->SetPosition(glm::vec3(3, 0, 0));
     std::cout << std::endl;
 
-    std::cout << "Clustering: 4 ..." << std::endl;
-    TriangleMesh * mesh_lod_4 = mesh->VertexClustering(4);
+    TriangleMesh * mesh_lod_4 = LevelOfDetail(*mesh, 4, model, model_key);
     //TriangleMesh * mesh_lod_4 = mesh->VertexClustering_GRID(16);
-    std::cout << "Preprocessing: 4 ..." << std::endl;
-    mesh_lod_4->Preprocess();
     mesh_lod_4->sendToOpenGL(basicProgram);
     object_lod_4 = new GraphicsObject(mesh_lod_4);
     object_lod_4->SetPosition(glm::vec3(4, 0, 0));
     std::cout << std::endl;
 
-    std::cout << "Clustering: 3 ..." << std::endl;
-    TriangleMesh * mesh_lod_5 = mesh->VertexClustering(3);
+    TriangleMesh * mesh_lod_5 = LevelOfDetail(*mesh, 3, model, model_key);
     //TriangleMesh * mesh_lod_5 = mesh->VertexClustering_GRID(8);
-    std::cout << "Preprocessing: 3 ..." << std::endl;
-    mesh_lod_5->Preprocess();
     mesh_lod_5->sendToOpenGL(basicProgram);
     object_lod_5 = new GraphicsObject(mesh_lod_5);
     object_lod_5->SetPosition(glm::vec3(5, 0, 0));
@@ -0,0 +1,131 @@
+#ifndef __SimdFloat_hpp__
+#define __SimdFloat_hpp__
+
+#include <algorithm>
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define SIMD_FLOAT_SSE
+#include <emmintrin.h>
+#endif
+
+/*
+    On x86 the *Avx2.cpp files are compiled with AVX2 enabled, see CMakeLists.txt, and SimdFloat8
+    is only available in them. The other files call their functions if the CPU supports AVX2
+*/
+#if defined(__x86_64__) || defined(_M_X64) || defined(__i386__) || defined(_M_IX86)
+#define SIMD_FLOAT_AVX
+#endif
+
+/**
+    A vector of N floats with plain arrays, used where no vector instructions are available
+*/
+template<int N>
+struct SimdFloatN {
+    static const int WIDTH = N;
+
+    SimdFloatN() {}
+
+    explicit SimdFloatN(float a) {
+        for (int i = 0; i < N; i++) v_[i] = a;
+    }
+
+    static SimdFloatN Load(const float * p) {
+        SimdFloatN r;
+        for (int i = 0; i < N; i++) r.v_[i] = p[i];
+        return r;
+    }
+
+    void Store(float * p) const {
+        for (int i = 0; i < N; i++) p[i] = v_[i];
+    }
+
+    friend SimdFloatN operator+(SimdFloatN a, const SimdFloatN& b) {
+        for (int i = 0; i < N; i++) a.v_[i] += b.v_[i];
+        return a;
+    }
+
+    friend SimdFloatN operator-(SimdFloatN a, const SimdFloatN& b) {
+        for (int i = 0; i < N; i++) a.v_[i] -= b.v_[i];
+        return a;
+    }
+
+    friend SimdFloatN operator*(SimdFloatN a, const SimdFloatN& b) {
+        for (int i = 0; i < N; i++) a.v_[i] *= b.v_[i];
+        return a;
+    }
+
+    friend SimdFloatN Min(SimdFloatN a, const SimdFloatN& b) {
+        for (int i = 0; i < N; i++) a.v_[i] = std::min(a.v_[i], b.v_[i]);
+        return a;
+    }
+
+    friend SimdFloatN Max(SimdFloatN a, const SimdFloatN& b) {
+        for (int i = 0; i < N; i++) a.v_[i] = std::max(a.v_[i], b.v_[i]);
+        return a;
+    }
+
+    /* Bit i of the result is set if a[i] <= b[i] */
+    friend int LessEqualMask(const SimdFloatN& a, const SimdFloatN& b) {
+        int mask = 0;
+        for (int i = 0; i < N; i++) mask |= (a.v_[i] <= b.v_[i]) << i;
+        return mask;
+    }
+
+    float v_[N];
+};
+
+#ifdef SIMD_FLOAT_SSE
+/**
+    4 floats in an SSE register
+*/
+struct SimdFloat4 {
+    static const int WIDTH = 4;
+
+    SimdFloat4() {}
+    SimdFloat4(__m128 v) : v_(v) {}
+    explicit SimdFloat4(float a) : v_(_mm_set1_ps(a)) {}
+
+    static SimdFloat4 Load(const float * p) { return _mm_loadu_ps(p); }
+    void Store(float * p) const { _mm_storeu_ps(p, v_); }
+
+    friend SimdFloat4 operator+(const SimdFloat4& a, const SimdFloat4& b) { return _mm_add_ps(a.v_, b.v_); }
+    friend SimdFloat4 operator-(const SimdFloat4& a, const SimdFloat4& b) { return _mm_sub_ps(a.v_, b.v_); }
+    friend SimdFloat4 operator*(const SimdFloat4& a, const SimdFloat4& b) { return _mm_mul_ps(a.v_, b.v_); }
+    friend SimdFloat4 Min(const SimdFloat4& a, const SimdFloat4& b) { return _mm_min_ps(a.v_, b.v_); }
+    friend SimdFloat4 Max(const SimdFloat4& a, const SimdFloat4& b) { return _mm_max_ps(a.v_, b.v_); }
+    friend int LessEqualMask(const SimdFloat4& a, const SimdFloat4& b) { return _mm_movemask_ps(_mm_cmple_ps(a.v_, b.v_)); }
+
+    __m128 v_;
+};
+#else
+typedef SimdFloatN<4> SimdFloat4;
+#endif
+
+#ifdef __AVX2__
+#include <immintrin.h>
+
+/**
+    8 floats in an AVX register, only available in the files compiled with AVX2 enabled
+*/
+struct SimdFloat8 {
+    static const int WIDTH = 8;
+
+    SimdFloat8() {}
+    SimdFloat8(__m256 v) : v_(v) {}
+    explicit SimdFloat8(float a) : v_(_mm256_set1_ps(a)) {}
+
+    static SimdFloat8 Load(const float * p) { return _mm256_loadu_ps(p); }
+    void Store(float * p) const { _mm256_storeu_ps(p, v_); }
+
+    friend SimdFloat8 operator+(const SimdFloat8& a, const SimdFloat8& b) { return _mm256_add_ps(a.v_, b.v_); }
+    friend SimdFloat8 operator-(const SimdFloat8& a, const SimdFloat8& b) { return _mm256_sub_ps(a.v_, b.v_); }
+    friend SimdFloat8 operator*(const SimdFloat8& a, const SimdFloat8& b) { return _mm256_mul_ps(a.v_, b.v_); }
+    friend SimdFloat8 Min(const SimdFloat8& a, const SimdFloat8& b) { return _mm256_min_ps(a.v_, b.v_); }
+    friend SimdFloat8 Max(const SimdFloat8& a, const SimdFloat8& b) { return _mm256_max_ps(a.v_, b.v_); }
+    friend int LessEqualMask(const SimdFloat8& a, const SimdFloat8& b) { return _mm256_movemask_ps(_mm256_cmp_ps(a.v_, b.v_, _CMP_LE_OQ)); }
+
+    __m256 v_;
+};
+#endif
+
+#endif
@@ -0,0 +1,181 @@
+#include "ThreadPool.h"
+
+#include <algorithm>
+
+/* The pool whose worker is the current thread, and the index of the worker */
+static thread_local const ThreadPool * current_pool = nullptr;
+static thread_local size_t current_worker = 0;
+
+ThreadPool::ThreadPool(size_t threads) : queued_tasks_(0), stop_(false), generation_(0), pending_workers_(0), body_(nullptr), count_(0), chunk_size_(1), next_(0) {
+    if (threads == 0) threads = std::max(1u, std::thread::hardware_concurrency());
+
+    /* One queue per worker, the last one is shared by the other threads */
+    for (size_t i = 0; i < threads; i++)
+        queues_.push_back(std::unique_ptr<TaskQueue>(new TaskQueue()));
+
+    for (size_t i = 1; i < threads; i++)
+        workers_.push_back(std::thread(&ThreadPool::WorkerLoop, this, i - 1));
+}
+
+ThreadPool::~ThreadPool() {
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        stop_ = true;
+    }
+    work_cv_.notify_all();
+    for (size_t i = 0; i < workers_.size(); i++)
+        workers_[i].join();
+}
+
+size_t ThreadPool::Size() const {
+    return workers_.size() + 1;
+}
+
+void ThreadPool::ParallelFor(size_t count, size_t chunk_size, const std::function<void(size_t, size_t)>& body) {
+    if (count == 0) return;
+
+    /* Nothing to share */
+    if (workers_.empty() || count <= chunk_size) {
+        body(0, count);
+        return;
+    }
+
+    std::lock_guard<std::mutex> job_lock(job_mutex_);
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        body_ = &body;
+        count_ = count;
+        chunk_size_ = std::max<size_t>(chunk_size, 1);
+        next_ = 0;
+        pending_workers_ = workers_.size();
+        generation_++;
+    }
+    work_cv_.notify_all();
+
+    RunChunks();
+
+    /* Wait for the workers to finish their last chunk */
+    std::unique_lock<std::mutex> lock(mutex_);
+    done_cv_.wait(lock, [this] { return pending_workers_ == 0; });
+    body_ = nullptr;
+}
+
+ThreadPool& ThreadPool::Default() {
+    static ThreadPool pool;
+    return pool;
+}
+
+void ThreadPool::WorkerLoop(size_t index) {
+    current_pool = this;
+    current_worker = index;
+
+    size_t seen_generation = 0;
+    for (;;) {
+        if (RunTask()) continue;
+
+        std::unique_lock<std::mutex> lock(mutex_);
+        work_cv_.wait(lock, [this, seen_generation] { return stop_ || generation_ != seen_generation || queued_tasks_ > 0; });
+        if (stop_) return;
+        if (generation_ == seen_generation) continue;
+        seen_generation = generation_;
+        lock.unlock();
+
+        RunChunks();
+
+        lock.lock();
+        if (--pending_workers_ == 0) done_cv_.notify_one();
+    }
+}
+
+void ThreadPool::RunChunks() {
+    /* Chunks are handed out dynamically, threads that finish early take more */
+    for (;;) {
+        size_t begin = next_.fetch_add(chunk_size_);
+        if (begin >= count_) return;
+        (*body_)(begin, std::min(begin + chunk_size_, count_));
+    }
+}
+
+size_t ThreadPool::QueueIndex() const {
+    return (current_pool == this) ? current_worker : queues_.size() - 1;
+}
+
+void ThreadPool::Push(Task task) {
+    TaskQueue& queue = *queues_[QueueIndex()];
+    {
+        std::lock_guard<std::mutex> lock(queue.mutex_);
+        queue.tasks_.push_back(std::move(task));
+    }
+    {
+        /* Taking the lock makes sure a worker that is about to sleep sees the task */
+        std::lock_guard<std::mutex> lock(mutex_);
+        queued_tasks_++;
+    }
+    work_cv_.notify_one();
+}
+
+bool ThreadPool::RunTask() {
+    if (queued_tasks_ == 0) return false;
+
+    Task task;
+    bool found = false;
+    size_t own = QueueIndex();
+
+    /* Newest task of the own queue first, it is likely still in cache */
+    {
+        TaskQueue& queue = *queues_[own];
+        std::lock_guard<std::mutex> lock(queue.mutex_);
+        if (!queue.tasks_.empty()) {
+            task = std::move(queue.tasks_.back());
+            queue.tasks_.pop_back();
+            found = true;
+        }
+    }
+
+    /* Then steal the oldest task of another queue, usually the largest piece of work */
+    for (size_t i = 1; !found && i < queues_.size(); i++) {
+        TaskQueue& queue = *queues_[(own + i) % queues_.size()];
+        std::lock_guard<std::mutex> lock(queue.mutex_);
+        if (!queue.tasks_.empty()) {
+            task = std::move(queue.tasks_.front());
+            queue.tasks_.pop_front();
+            found = true;
+        }
+    }
+
+    if (!found) return false;
+    queued_tasks_--;
+
+    task.function_();
+    task.group_->pending_--;
+    return true;
+}
+
+TaskGroup::TaskGroup(ThreadPool& pool) : pool_(pool), pending_(0) {
+}
+
+TaskGroup::~TaskGroup() {
+    Wait();
+}
+
+void TaskGroup::Run(std::function<void()> function) {
+    pending_++;
+
+    /* Without workers, nobody else would run it */
+    if (pool_.workers_.empty()) {
+        function();
+        pending_--;
+        return;
+    }
+
+    ThreadPool::Task task;
+    task.function_ = std::move(function);
+    task.group_ = this;
+    pool_.Push(std::move(task));
+}
+
+void TaskGroup::Wait() {
+    while (pending_ > 0) {
+        if (!pool_.RunTask()) std::this_thread::yield();
+    }
+}
@@ -0,0 +1,121 @@
+#ifndef __ThreadPool_h__
+#define __ThreadPool_h__
+
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+class TaskGroup;
+
+/**
+    A fixed set of worker threads that run chunked parallel loops and tasks. The calling 
+    thread takes part in the work, so a pool of size 1 has no worker threads.
+
+    Tasks are pushed to the deque of the thread that creates them. Threads take tasks from 
+    the back of their own deque, and steal from the front of the other deques when theirs 
+    is empty
+*/
+class ThreadPool {
+public:
+    /**
+        @param threads The number of threads that work on a loop, including the calling thread. 
+            Zero uses one thread per hardware thread
+    */
+    ThreadPool(size_t threads = 0);
+    ~ThreadPool();
+
+    /**
+        @return The number of threads that work on a loop, including the calling thread
+    */
+    size_t Size() const;
+
+    /**
+        Split [0, count) into chunks of chunk_size and run body(begin, end) on each chunk, on 
+        all threads of the pool. Returns when all chunks are done. Calls from different threads
+        are serialised. A body or a task must not call ParallelFor on the same pool
+    */
+    void ParallelFor(size_t count, size_t chunk_size, const std::function<void(size_t, size_t)>& body);
+
+    /**
+        @return A pool shared by the whole application, with one thread per hardware thread
+    */
+    static ThreadPool& Default();
+
+private:
+    friend class TaskGroup;
+
+    struct Task {
+        std::function<void()> function_;
+        TaskGroup * group_;
+    };
+
+    /* A deque of tasks, one per worker and one shared by all the other threads */
+    struct TaskQueue {
+        std::mutex mutex_;
+        std::deque<Task> tasks_;
+    };
+
+    std::vector<std::thread> workers_;
+    std::vector<std::unique_ptr<TaskQueue> > queues_;
+    std::atomic<size_t> queued_tasks_;
+
+    /* Serialises ParallelFor calls */
+    std::mutex job_mutex_;
+
+    /* Protects the job state below */
+    std::mutex mutex_;
+    std::condition_variable work_cv_;
+    std::condition_variable done_cv_;
+    bool stop_;
+    size_t generation_;
+    size_t pending_workers_;
+
+    /* The current loop */
+    const std::function<void(size_t, size_t)> * body_;
+    size_t count_;
+    size_t chunk_size_;
+    std::atomic<size_t> next_;
+
+    void WorkerLoop(size_t index);
+    void RunChunks();
+
+    /* The queue of the calling thread */
+    size_t QueueIndex() const;
+    void Push(Task task);
+    /* Run one queued task, if there is any */
+    bool RunTask();
+};
+
+/**
+    A set of tasks that can be waited on. Tasks may create more tasks, in the same group 
+    or in other groups
+*/
+class TaskGroup {
+public:
+    TaskGroup(ThreadPool& pool);
+    ~TaskGroup();
+
+    /**
+        Queue a task
+    */
+    void Run(std::function<void()> function);
+
+    /**
+        Return when all the tasks of the group are done. The calling thread runs queued
+        tasks while waiting
+    */
+    void Wait();
+
+private:
+    friend class ThreadPool;
+
+    ThreadPool& pool_;
+    std::atomic<size_t> pending_;
+};
+
+#endif
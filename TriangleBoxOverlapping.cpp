@@ -1,5 +1,11 @@
 #include "TriangleBoxOverlapping.hpp"
 
+#include <iostream>
+
+#include "LeafIntersection.h"
+#include "MersenneTwister.hpp"
+#include "TriangleBoxOverlappingOctants.hpp"
+
 inline void findMinMax(float x0, float x1, float x2, float &min, float &max) {
     min = max = x0;
     if (x1 < min)
@@ -239,4 +245,43 @@ bool triBoxOverlap(glm::vec3 boxcenter, glm::vec3 boxhalfsize, glm::vec3 tv0, gl
         return false;
 
     return true; /* box and triangle overlaps */
-}
\ No newline at end of file
+}
+
+unsigned char triBoxOverlapOctants(glm::vec3 boxcenter, float boxhalfsize, glm::vec3 tv0,
+    glm::vec3 tv1, glm::vec3 tv2) {
+#ifdef SIMD_FLOAT_AVX
+    /* The AVX2 leaf kernel is there if the CPU and the operating system support AVX2 */
+    static const bool avx2 = GetLeafIntersectionKernel(LeafKernelType::AVX2) != nullptr;
+    if (avx2) return triBoxOverlapOctantsAvx2(&boxcenter.x, boxhalfsize, &tv0.x, &tv1.x, &tv2.x);
+#endif
+    return triBoxOverlapOctantsSimd<SimdFloatN<8> >(&boxcenter.x, boxhalfsize, &tv0.x, &tv1.x, &tv2.x);
+}
+
+size_t TestTriBoxOverlapOctants(size_t total_triangles) {
+    MersenneTwisterGenerator generator(MersenneTwisterGenerator::ONE);
+    glm::vec3 boxcenter(0.25f, -0.5f, 0.75f);
+    float boxhalfsize = 1.0f;
+    float h = boxhalfsize / 2.0f;
+
+    size_t mismatches = 0;
+    for (size_t i = 0; i < total_triangles; i++) {
+        /* A corner around the box, and edges from a thousandth of the box to larger than it */
+        glm::vec3 v[3];
+        float size = powf(10.0f, static_cast<float>(-3.0 * generator.genrand_real3() + 0.5));
+        for (int axis = 0; axis < 3; axis++)
+            v[0][axis] = boxcenter[axis] + 2.4f * boxhalfsize * static_cast<float>(generator.genrand_real3() - 0.5);
+        for (int j = 1; j < 3; j++)
+            for (int axis = 0; axis < 3; axis++)
+                v[j][axis] = v[0][axis] + size * static_cast<float>(generator.genrand_real3() - 0.5);
+
+        unsigned char expected = 0;
+        for (int octant = 0; octant < 8; octant++) {
+            glm::vec3 center = boxcenter + glm::vec3((octant & 4) ? h : -h, (octant & 2) ? h : -h, (octant & 1) ? h : -h);
+            if (triBoxOverlap(center, glm::vec3(h), v[0], v[1], v[2])) expected |= 1 << octant;
+        }
+        if (triBoxOverlapOctants(boxcenter, boxhalfsize, v[0], v[1], v[2]) != expected) mismatches++;
+    }
+
+    std::cout << "Octant overlap tests that differ from the box test: " << mismatches << " of " << total_triangles << std::endl;
+    return mismatches;
+}
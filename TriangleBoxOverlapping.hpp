@@ -38,4 +38,19 @@ inline bool axisTestZ0(float a, float b, float fa, float fb, const glm::vec3 &v0
 bool triBoxOverlap(glm::vec3 boxcenter, glm::vec3 boxhalfsize, glm::vec3 tv0, glm::vec3 tv1,
     glm::vec3 tv2);
 
+/*
+    Test a triangle against the 8 octants of a cube at once. Bit i of the result is set if the
+    triangle overlaps octant i, where bits 4, 2 and 1 of i select the upper half along x, y and z
+*/
+unsigned char triBoxOverlapOctants(glm::vec3 boxcenter, float boxhalfsize, glm::vec3 tv0,
+    glm::vec3 tv1, glm::vec3 tv2);
+
+/*
+    Check triBoxOverlapOctants, with the vector code the CPU runs, against triBoxOverlap on each
+    octant, for random triangles of all sizes around a box. Prints the number of triangles whose
+    octants differ, which should be 0
+    @return The number of triangles whose octants differ
+*/
+size_t TestTriBoxOverlapOctants(size_t total_triangles);
+
 #endif
\ No newline at end of file
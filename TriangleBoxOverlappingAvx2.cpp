@@ -0,0 +1,17 @@
+#include "TriangleBoxOverlappingOctants.hpp"
+
+/*
+    On x86 the *Avx2.cpp files are compiled with AVX2 enabled, see CMakeLists.txt, so that every
+    function that passes vector registers around is compiled for AVX2, even without optimisations.
+    Their functions are only called if the CPU supports AVX2
+*/
+#ifdef SIMD_FLOAT_AVX
+#ifndef __AVX2__
+#error "Compile the *Avx2.cpp files with AVX2 enabled, -mavx2 or /arch:AVX2"
+#endif
+
+unsigned char triBoxOverlapOctantsAvx2(const float boxcenter[3], float boxhalfsize, const float tv0[3],
+    const float tv1[3], const float tv2[3]) {
+    return triBoxOverlapOctantsSimd<SimdFloat8>(boxcenter, boxhalfsize, tv0, tv1, tv2);
+}
+#endif
@@ -0,0 +1,106 @@
+#ifndef __TriangleBoxOverlappingOctants_hpp__
+#define __TriangleBoxOverlappingOctants_hpp__
+
+#include <cmath>
+
+#include "SimdFloat.hpp"
+
+/*
+    The body of triBoxOverlapOctants, shared by the portable version and the AVX2 one in
+    TriangleBoxOverlappingAvx2.cpp. It only takes plain floats, so that the AVX2 file compiles
+    no inline function of another header
+*/
+
+/*
+    The separating axis test of triBoxOverlap, with one lane per octant. All the octants have the
+    same size, so along an axis a they only differ by the projection a.c of their center c: the
+    triangle, projected to [min, max], overlaps the octant along a if min - rad <= a.c <= max + rad.
+    The triangle side of each test is computed once and the 8 octants are compared in one go
+*/
+template<typename SimdFloat>
+unsigned char triBoxOverlapOctantsSimd(const float boxcenter[3], float boxhalfsize, const float tv0[3],
+    const float tv1[3], const float tv2[3]) {
+    float h = boxhalfsize / 2.0f;
+
+    /* The centers of the octants, relative to the center of the box */
+    float cx[8], cy[8], cz[8];
+    for (int i = 0; i < 8; i++) {
+        cx[i] = (i & 4) ? h : -h;
+        cy[i] = (i & 2) ? h : -h;
+        cz[i] = (i & 1) ? h : -h;
+    }
+    const SimdFloat ox = SimdFloat::Load(cx), oy = SimdFloat::Load(cy), oz = SimdFloat::Load(cz);
+
+    float v0[3], v1[3], v2[3];
+    for (int i = 0; i < 3; i++) {
+        v0[i] = tv0[i] - boxcenter[i];
+        v1[i] = tv1[i] - boxcenter[i];
+        v2[i] = tv2[i] - boxcenter[i];
+    }
+
+    auto minMax = [](float x0, float x1, float x2, float& min, float& max) {
+        min = max = x0;
+        if (x1 < min) min = x1;
+        if (x1 > max) max = x1;
+        if (x2 < min) min = x2;
+        if (x2 > max) max = x2;
+    };
+    auto axisTest = [&](float ax, float ay, float az, float min, float max) {
+        float rad = h * (fabsf(ax) + fabsf(ay) + fabsf(az));
+        SimdFloat center = ox * SimdFloat(ax) + oy * SimdFloat(ay) + oz * SimdFloat(az);
+        return LessEqualMask(SimdFloat(min - rad), center) & LessEqualMask(center, SimdFloat(max + rad));
+    };
+    auto edgeTest = [&](float ax, float ay, float az) {
+        float p0 = ax * v0[0] + ay * v0[1] + az * v0[2];
+        float p1 = ax * v1[0] + ay * v1[1] + az * v1[2];
+        float p2 = ax * v2[0] + ay * v2[1] + az * v2[2];
+        float min, max;
+        minMax(p0, p1, p2, min, max);
+        return axisTest(ax, ay, az, min, max);
+    };
+
+    /* Bullet 1 first, the bounding box of the triangle rejects most octants */
+    float min, max;
+    int mask = 0xff;
+    minMax(v0[0], v1[0], v2[0], min, max);
+    mask &= axisTest(1.0f, 0.0f, 0.0f, min, max);
+    minMax(v0[1], v1[1], v2[1], min, max);
+    mask &= axisTest(0.0f, 1.0f, 0.0f, min, max);
+    minMax(v0[2], v1[2], v2[2], min, max);
+    mask &= axisTest(0.0f, 0.0f, 1.0f, min, max);
+    if (mask == 0) return 0;
+
+    /* Bullet 3: crossproduct(edge from tri, {x,y,z}-direction) */
+    float edges[3][3];
+    for (int i = 0; i < 3; i++) {
+        edges[0][i] = v1[i] - v0[i];
+        edges[1][i] = v2[i] - v1[i];
+        edges[2][i] = v0[i] - v2[i];
+    }
+    for (int i = 0; i < 3 && mask; i++) {
+        const float * e = edges[i];
+        mask &= edgeTest(0.0f, e[2], -e[1]);
+        mask &= edgeTest(-e[2], 0.0f, e[0]);
+        mask &= edgeTest(e[1], -e[0], 0.0f);
+    }
+    if (mask == 0) return 0;
+
+    /* Bullet 2: the plane of the triangle */
+    float normal[3] = {
+        edges[0][1] * edges[1][2] - edges[0][2] * edges[1][1],
+        edges[0][2] * edges[1][0] - edges[0][0] * edges[1][2],
+        edges[0][0] * edges[1][1] - edges[0][1] * edges[1][0]
+    };
+    float d = normal[0] * v0[0] + normal[1] * v0[1] + normal[2] * v0[2];
+    mask &= axisTest(normal[0], normal[1], normal[2], d, d);
+
+    return static_cast<unsigned char>(mask);
+}
+
+#ifdef SIMD_FLOAT_AVX
+/* triBoxOverlapOctantsSimd with one AVX register, in TriangleBoxOverlappingAvx2.cpp. Only call it if the CPU supports AVX2 */
+unsigned char triBoxOverlapOctantsAvx2(const float boxcenter[3], float boxhalfsize, const float tv0[3],
+    const float tv1[3], const float tv2[3]);
+#endif
+
+#endif
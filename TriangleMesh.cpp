@@ -7,9 +7,11 @@
 #include <vector>
 #include <unordered_map>
 #include <ctime>
+#include <chrono>
 
 #include "MersenneTwister.hpp"
 #include "UniformGrid.hpp"
+#include "LeafIntersection.h"
 
 static MersenneTwisterGenerator rng(MersenneTwisterGenerator::ONE);
 
@@ -19,11 +21,32 @@ float get_rand() {
 
 using namespace std;
 
+/* 
+    Number of rays each thread takes at a time in batched queries. A multiple of the packet 
+    width, and of 64 so that threads never share a word of an occlusion bitmask
+*/
+static const size_t RAY_BATCH_CHUNK_SIZE = 256;
 
-TriangleMesh::TriangleMesh() {
+/* TuneOctree prefers smaller octrees that are at most this much slower than the fastest one */
+static const double OCTREE_TUNE_TOLERANCE = 0.05;
+/* TuneOctree builds the candidates on a crop of the mesh with about this many triangles */
+static const size_t OCTREE_TUNE_TRIANGLES = 200000;
+/* The deepest level of the octree cube the crop goes down to, in case many triangles share a center */
+static const size_t OCTREE_TUNE_MAX_LEVEL = 10;
+
+
+TriangleMesh::TriangleMesh() : octree_vertices(nullptr), octree_triangles(nullptr), octree_config_{ 5, 15 }, octree_origin_(0), octree_length_(0), bvh_triangles(nullptr), grid_triangles(nullptr), two_level_grid_triangles(nullptr), accelerator_(Accelerator::OCTREE) {
     
 }
 
+TriangleMesh::~TriangleMesh() {
+    delete octree_vertices;
+    delete octree_triangles;
+    delete bvh_triangles;
+    delete grid_triangles;
+    delete two_level_grid_triangles;
+}
+
 void TriangleMesh::addVertex(const glm::vec3 &position)
 {
     /* Add position to mesh, add constant color */
@@ -38,6 +61,17 @@ void TriangleMesh::addTriangle(int v0, int v1, int v2)
   triangles.push_back(v2);
 }
 
+glm::vec3 * TriangleMesh::ResizeVertices(size_t count) {
+    vertices.resize(count);
+    vertex_colors.resize(count, glm::vec3(0.3, 0.3, 0.3));
+    return vertices.data();
+}
+
+unsigned int * TriangleMesh::ResizeTriangles(size_t count) {
+    triangles.resize(count);
+    return triangles.data();
+}
+
 void TriangleMesh::buildCube() {
 
     /* cube's half size */
@@ -156,54 +190,328 @@ void TriangleMesh::Preprocess() {
     */
     octree_origin = std::min(octree_origin, octree_length / 2.0f);
     octree_length = -1.0f * 2.0f * octree_origin;
+    octree_origin_ = octree_origin;
+    octree_length_ = octree_length;
 
     {
-        /* Measure octree creation time */
-        std::clock_t start = clock_t();
+        /* Measure octree creation time, wall clock since the build runs on several threads */
+        auto start = std::chrono::steady_clock::now();
         
-        octree_vertices = new PointOctree<int, 1>(Point3D({ octree_origin, octree_origin, octree_origin }), octree_length);
-
-        /* Insert all vertices to octree */
+        std::vector<Point3D> points(vertices.size());
+        std::vector<int> ids(vertices.size());
         for (size_t v = 0; v < vertices.size(); v++) {
-            octree_vertices->Insert(Point3D({ vertices[v].x, vertices[v].y, vertices[v].z }), v);
+            points[v] = Point3D({ vertices[v].x, vertices[v].y, vertices[v].z });
+            ids[v] = static_cast<int>(v);
         }
+
+        /* Insert all vertices to octree at once */
+        octree_vertices = new PointOctree<int, 1>(Point3D({ octree_origin, octree_origin, octree_origin }), octree_length, points, ids);
         std::cout << "Vertices octree depth: " << octree_vertices->Depth() << std::endl;
 
-        std::clock_t end = clock();
-        double elapsed_secs = double(end - start) / CLOCKS_PER_SEC;
+        auto end = std::chrono::steady_clock::now();
+        double elapsed_secs = std::chrono::duration<double>(end - start).count();
         std::cout << "Vertices octree creation time: " << elapsed_secs << std::endl;
 
     }
 
-    {
-        std::clock_t start = clock();
-        octree_triangles = new TrianglesOctree<5, 15>(Point3D({ octree_origin, octree_origin, octree_origin }), octree_length);
+    /* The other structures are only built when selected */
+    BuildAccelerator(accelerator_);
+}
+
+bool TriangleMesh::LoadCache(const std::string& path, uint64_t key) {
+    std::shared_ptr<TrianglesOctreeCache> cache = TrianglesOctreeCache::Load(path, CacheKey(key));
+    if (!cache || !(cache->Config() == octree_config_)) return false;
+
+    TrianglesOctreeBase * octree = NewTrianglesOctree(octree_config_, cache->Octree(), cache);
+    if (octree == nullptr) return false;
+
+    delete octree_triangles;
+    octree_triangles = octree;
+    if (cache->Accelerator() <= static_cast<uint32_t>(Accelerator::TWO_LEVEL_GRID))
+        accelerator_ = static_cast<Accelerator>(cache->Accelerator());
 
-        for (size_t i = 0; i < triangles.size() / 3; i++) {
-            octree_triangles->Insert(vertices, triangles, i);
+    /* Same as addVertex and addTriangle */
+    vertices.assign(cache->Vertices(), cache->Vertices() + cache->VertexCount());
+    vertex_colors.assign(vertices.size(), glm::vec3(0.3, 0.3, 0.3));
+    triangles.assign(cache->Triangles(), cache->Triangles() + cache->TriangleIndexCount());
+    return true;
+}
+
+bool TriangleMesh::SaveCache(const std::string& path, uint64_t key) const {
+    if (octree_triangles == nullptr) return false;
+    return TrianglesOctreeCache::Save(path, CacheKey(key), octree_config_, vertices, triangles, octree_triangles->Compiled(), static_cast<uint32_t>(accelerator_));
+}
+
+uint64_t TriangleMesh::CacheKey(uint64_t key) const {
+    /* The leaf kernel changes the cost model of the build */
+    key = HashCombine(key, static_cast<uint64_t>(octree_config_.bucket_size_));
+    key = HashCombine(key, static_cast<uint64_t>(octree_config_.max_depth_));
+    return HashCombine(key, GetLeafIntersectionKernelWidth());
+}
+
+void TriangleMesh::SetAccelerator(Accelerator accelerator) {
+    accelerator_ = accelerator;
+
+    /* Before Preprocess there is no mesh to build it on yet, Preprocess builds it */
+    if (octree_vertices == nullptr) return;
+    BuildAccelerator(accelerator_);
+    DeleteAccelerators();
+}
+
+TriangleMesh::Accelerator TriangleMesh::GetAccelerator() const {
+    return accelerator_;
+}
+
+void TriangleMesh::SelectAccelerator(size_t total_rays) {
+    RayBuffer rays;
+    BoundingBoxRays(total_rays, rays);
+
+    const Accelerator accelerators[] = { Accelerator::OCTREE, Accelerator::BVH, Accelerator::GRID, Accelerator::TWO_LEVEL_GRID };
+    const char * names[] = { "Octree", "BVH", "Grid", "Two level grid" };
+    double best_rayss = 0;
+    size_t best = 0;
+    HitBuffer hits;
+    for (size_t i = 0; i < 4; i++) {
+        accelerator_ = accelerators[i];
+        BuildAccelerator(accelerator_);
+        std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+        RayCastBatch(rays, hits);
+        std::chrono::steady_clock::time_point end = std::chrono::steady_clock::now();
+
+        double rayss = total_rays / std::chrono::duration<double>(end - start).count();
+        std::cout << "\t" << names[i] << " Rays/s: " << rayss << std::endl;
+        if (rayss > best_rayss) {
+            best_rayss = rayss;
+            best = i;
         }
-        std::cout << "Triangles octree depth: " << octree_triangles->Depth() << std::endl;
+    }
+
+    accelerator_ = accelerators[best];
+    DeleteAccelerators();
+    std::cout << "Selected accelerator: " << names[best] << std::endl;
+}
+
+void TriangleMesh::BuildAccelerator(Accelerator accelerator) {
+    /* Wall clock time, the builds run on several threads */
+    auto start = std::chrono::steady_clock::now();
+
+    switch (accelerator) {
+    case Accelerator::BVH:
+        if (bvh_triangles != nullptr) return;
+        bvh_triangles = new BVH(vertices, triangles);
+        std::cout << "Triangles BVH depth: " << bvh_triangles->Depth() << std::endl;
+        std::cout << "Triangles BVH creation time: " << std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count() << std::endl;
+        break;
+    case Accelerator::GRID:
+        if (grid_triangles != nullptr) return;
+        grid_triangles = new TrianglesGrid(vertices, triangles);
+        std::cout << "Triangles grid resolution: " << grid_triangles->Resolution(0) << "x" << grid_triangles->Resolution(1) << "x" << grid_triangles->Resolution(2) << std::endl;
+        std::cout << "Triangles grid creation time: " << std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count() << std::endl;
+        break;
+    case Accelerator::TWO_LEVEL_GRID:
+        if (two_level_grid_triangles != nullptr) return;
+        two_level_grid_triangles = new TrianglesTwoLevelGrid(vertices, triangles);
+        std::cout << "Triangles two level grid resolution: " << two_level_grid_triangles->Resolution(0) << "x" << two_level_grid_triangles->Resolution(1) << "x" << two_level_grid_triangles->Resolution(2) << ", Fine cells: " << two_level_grid_triangles->FineCellCount() << std::endl;
+        std::cout << "Triangles two level grid creation time: " << std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count() << std::endl;
+        break;
+    default:
+        /* Built once, or loaded from a cache */
+        if (octree_triangles != nullptr) return;
+        octree_triangles = BuildTrianglesOctree(octree_config_);
+        std::cout << "Triangles octree bucket size: " << octree_config_.bucket_size_ << ", Max depth: " << octree_config_.max_depth_ << std::endl;
+        std::cout << "Triangles octree depth: " << octree_triangles->Depth() << ", Memory: " << octree_triangles->MemoryUsage() / (1024.0 * 1024.0) << " MB" << std::endl;
+        std::cout << "Triangles octree leaf kernel: " << GetLeafIntersectionKernelName() << std::endl;
+        std::cout << "Triangles octree creation time: " << std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count() << std::endl;
+        break;
+    }
+}
+
+void TriangleMesh::DeleteAccelerators() {
+    if (accelerator_ != Accelerator::BVH) {
+        delete bvh_triangles;
+        bvh_triangles = nullptr;
+    }
+    if (accelerator_ != Accelerator::GRID) {
+        delete grid_triangles;
+        grid_triangles = nullptr;
+    }
+    if (accelerator_ != Accelerator::TWO_LEVEL_GRID) {
+        delete two_level_grid_triangles;
+        two_level_grid_triangles = nullptr;
+    }
+}
+
+bool TriangleMesh::SetOctreeConfig(TrianglesOctreeConfig config) {
+    const std::vector<TrianglesOctreeConfig>& configs = TrianglesOctreeConfigs();
+    if (std::find(configs.begin(), configs.end(), config) == configs.end()) return false;
+    if (config == octree_config_) return true;
+
+    octree_config_ = config;
+    if (octree_triangles != nullptr) {
+        delete octree_triangles;
+        octree_triangles = BuildTrianglesOctree(octree_config_);
+    }
+    return true;
+}
+
+TrianglesOctreeConfig TriangleMesh::GetOctreeConfig() const {
+    return octree_config_;
+}
+
+void TriangleMesh::TuneOctree(size_t total_rays) {
+    /*
+        The candidates are built on a crop of the mesh, not on all of it: starting from the cube of 
+        the octree, go down into the octant that holds the most triangle centers until at most 
+        OCTREE_TUNE_TRIANGLES are left, so the crop keeps the densest part of the mesh, with 
+        triangles the same size relative to the cells. Only the selected configuration is built 
+        on the whole mesh
+    */
+    std::vector<unsigned int> ids(triangles.size() / 3);
+    for (size_t i = 0; i < ids.size(); i++) ids[i] = static_cast<unsigned int>(i);
+    auto center = [&](unsigned int id) {
+        return (vertices[triangles[3 * id]] + vertices[triangles[3 * id + 1]] + vertices[triangles[3 * id + 2]]) / 3.0f;
+    };
+
+    glm::vec3 crop_origin(octree_origin_);
+    float crop_length = octree_length_;
+    for (size_t level = 0; ids.size() > OCTREE_TUNE_TRIANGLES && level < OCTREE_TUNE_MAX_LEVEL; level++) {
+        float half = crop_length / 2.0f;
+        std::vector<unsigned int> octants[8];
+        for (unsigned int id : ids) {
+            glm::vec3 c = center(id);
+            int octant = (c.x >= crop_origin.x + half ? 4 : 0) | (c.y >= crop_origin.y + half ? 2 : 0) | (c.z >= crop_origin.z + half ? 1 : 0);
+            octants[octant].push_back(id);
+        }
+
+        int densest = 0;
+        for (int i = 1; i < 8; i++) {
+            if (octants[i].size() > octants[densest].size()) densest = i;
+        }
+        crop_origin += half * glm::vec3((densest & 4) ? 1.0f : 0.0f, (densest & 2) ? 1.0f : 0.0f, (densest & 1) ? 1.0f : 0.0f);
+        crop_length = half;
+        ids.swap(octants[densest]);
+    }
+
+    /* Every triangle whose bounding box overlaps the crop, with vertices of its own */
+    glm::vec3 crop_end = crop_origin + glm::vec3(crop_length);
+    std::vector<glm::vec3> crop_vertices;
+    std::vector<unsigned int> crop_triangles;
+    for (size_t i = 0; i < triangles.size(); i += 3) {
+        const glm::vec3& v0 = vertices[triangles[i]];
+        const glm::vec3& v1 = vertices[triangles[i + 1]];
+        const glm::vec3& v2 = vertices[triangles[i + 2]];
+        glm::vec3 low = glm::min(v0, glm::min(v1, v2));
+        glm::vec3 high = glm::max(v0, glm::max(v1, v2));
+        if (glm::any(glm::lessThan(high, crop_origin)) || glm::any(glm::greaterThan(low, crop_end))) continue;
+
+        for (const glm::vec3& v : { v0, v1, v2 }) {
+            crop_triangles.push_back(static_cast<unsigned int>(crop_vertices.size()));
+            crop_vertices.push_back(v);
+        }
+    }
+    std::cout << "Tuning the octree on " << crop_triangles.size() / 3 << " of " << triangles.size() / 3 << " triangles" << std::endl;
+
+    /* The rays go through the part of the crop inside the bounding box of the mesh */
+    RayBuffer rays;
+    BoxRays(glm::max(crop_origin, glm::vec3(min_x, min_y, min_z)), glm::min(crop_end, glm::vec3(max_x, max_y, max_z)), total_rays, rays);
+
+    const std::vector<TrianglesOctreeConfig>& configs = TrianglesOctreeConfigs();
+    std::vector<double> rayss(configs.size());
+    std::vector<size_t> memory(configs.size());
+    for (size_t i = 0; i < configs.size(); i++) {
+        TrianglesOctreeBase * octree = NewTrianglesOctree(configs[i], Point3D({ crop_origin.x, crop_origin.y, crop_origin.z }), crop_length, crop_vertices, crop_triangles);
+        octree->CompileTriangleData(crop_vertices, crop_triangles);
+
+        std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+        ThreadPool::Default().ParallelFor(rays.Size(), RAY_BATCH_CHUNK_SIZE, [&](size_t begin, size_t end) {
+            RayHit hit;
+            for (size_t r = begin; r < end; r++) {
+                octree->RayCast(crop_vertices, crop_triangles, rays.Get(r), hit, rays.tmin_[r], rays.tmax_[r]);
+            }
+        });
+        std::chrono::steady_clock::time_point end = std::chrono::steady_clock::now();
 
-        std::clock_t end = clock();
-        double elapsed_secs = double(end - start) / CLOCKS_PER_SEC;
-        std::cout << "Triangles octree creation time: " << elapsed_secs << std::endl;
+        rayss[i] = total_rays / std::chrono::duration<double>(end - start).count();
+        memory[i] = octree->MemoryUsage();
+        std::cout << "\tBucket size: " << configs[i].bucket_size_ << ", Max depth: " << configs[i].max_depth_ << ", Rays/s: " << rayss[i] << ", Memory: " << memory[i] / (1024.0 * 1024.0) << " MB" << std::endl;
+        delete octree;
+    }
+
+    double best_rayss = *std::max_element(rayss.begin(), rayss.end());
+    size_t best = 0;
+    for (size_t i = 0; i < configs.size(); i++) {
+        if (rayss[i] < (1.0 - OCTREE_TUNE_TOLERANCE) * best_rayss) continue;
+        if (rayss[best] < (1.0 - OCTREE_TUNE_TOLERANCE) * best_rayss || memory[i] < memory[best]) best = i;
+    }
+
+    SetOctreeConfig(configs[best]);
+    std::cout << "Selected octree, Bucket size: " << configs[best].bucket_size_ << ", Max depth: " << configs[best].max_depth_ << std::endl;
+}
+
+void TriangleMesh::BoundingBoxRays(size_t total_rays, RayBuffer& rays) const {
+    BoxRays(glm::vec3(min_x, min_y, min_z), glm::vec3(max_x, max_y, max_z), total_rays, rays);
+}
+
+void TriangleMesh::BoxRays(glm::vec3 low, glm::vec3 high, size_t total_rays, RayBuffer& rays) {
+    /* A generator of its own, so that the random numbers of the rest of the application do not change */
+    MersenneTwisterGenerator generator(MersenneTwisterGenerator::ONE);
+    auto random_point = [&]() {
+        return Point3D({ low.x + generator.genrand_real3() * (high.x - low.x), low.y + generator.genrand_real3() * (high.y - low.y), low.z + generator.genrand_real3() * (high.z - low.z) });
+    };
+
+    rays.Resize(total_rays);
+    for (size_t ray = 0; ray < total_rays; ray++) {
+        Point3D origin = random_point();
+        rays.Set(ray, origin, random_point() - origin);
+    }
+}
+
+TrianglesOctreeBase * TriangleMesh::BuildTrianglesOctree(TrianglesOctreeConfig config) const {
+    TrianglesOctreeBase * octree = NewTrianglesOctree(config, Point3D({ octree_origin_, octree_origin_, octree_origin_ }), octree_length_, vertices, triangles);
+    if (octree != nullptr) octree->CompileTriangleData(vertices, triangles);
+    return octree;
+}
 
+bool TriangleMesh::ClosestHit(Ray3D ray, RayHit& hit, Real_t tmin, Real_t tmax) const {
+    switch (accelerator_) {
+    case Accelerator::BVH:
+        return bvh_triangles->RayCast(vertices, triangles, ray, hit, tmin, tmax);
+    case Accelerator::GRID:
+        return grid_triangles->RayCast(vertices, triangles, ray, hit, tmin, tmax);
+    case Accelerator::TWO_LEVEL_GRID:
+        return two_level_grid_triangles->RayCast(vertices, triangles, ray, hit, tmin, tmax);
+    default:
+        return octree_triangles->RayCast(vertices, triangles, ray, hit, tmin, tmax);
+    }
+}
+
+bool TriangleMesh::AnyHit(Ray3D ray, Real_t tmax, Real_t tmin) const {
+    switch (accelerator_) {
+    case Accelerator::BVH:
+        return bvh_triangles->Occluded(vertices, triangles, ray, tmax, tmin);
+    case Accelerator::GRID:
+        return grid_triangles->Occluded(vertices, triangles, ray, tmax, tmin);
+    case Accelerator::TWO_LEVEL_GRID:
+        return two_level_grid_triangles->Occluded(vertices, triangles, ray, tmax, tmin);
+    default:
+        return octree_triangles->Occluded(vertices, triangles, ray, tmax, tmin);
     }
 }
 
 int TriangleMesh::RayCast(Ray3D ray, bool use_triangles) {
 
     if (use_triangles) {
-        std::vector<unsigned int> results;
-        octree_triangles->RayCast(vertices, triangles, ray, results);
-
-        for (size_t i = 0; i < results.size(); i++) {
-            vertex_colors[triangles[results[i] * 3]] = glm::vec3(get_rand(), get_rand(), get_rand());
-            vertex_colors[triangles[results[i] * 3 + 1]] = glm::vec3(get_rand(), get_rand(), get_rand());
-            vertex_colors[triangles[results[i] * 3 + 2]] = glm::vec3(get_rand(), get_rand(), get_rand());
+        RayHit hit;
+        ClosestHit(ray, hit);
+
+        /* If a triangle was hit, change the color of its vertices to a random one */
+        if (hit.Valid()) {
+            vertex_colors[triangles[hit.triangle_id_ * 3]] = glm::vec3(get_rand(), get_rand(), get_rand());
+            vertex_colors[triangles[hit.triangle_id_ * 3 + 1]] = glm::vec3(get_rand(), get_rand(), get_rand());
+            vertex_colors[triangles[hit.triangle_id_ * 3 + 2]] = glm::vec3(get_rand(), get_rand(), get_rand());
         }
 
-        return results.size() > 0;
+        return hit.Valid();
     }
 
     std::vector<int> results;
@@ -216,6 +524,50 @@ int TriangleMesh::RayCast(Ray3D ray, bool use_triangles) {
 
 }
 
+void TriangleMesh::RayCastBatch(const RayBuffer& rays, HitBuffer& hits, ThreadPool& pool) const {
+    hits.Resize(rays.Size());
+
+    pool.ParallelFor(rays.Size(), RAY_BATCH_CHUNK_SIZE, [&](size_t begin, size_t end) {
+        RayHit hit;
+        for (size_t i = begin; i < end; i++) {
+            ClosestHit(rays.Get(i), hit, rays.tmin_[i], rays.tmax_[i]);
+            hits.Set(i, hit);
+        }
+    });
+}
+
+void TriangleMesh::RayCastCoherentBatch(const RayBuffer& rays, HitBuffer& hits, ThreadPool& pool) const {
+    /* Only the octree traces packets */
+    if (accelerator_ != Accelerator::OCTREE) {
+        RayCastBatch(rays, hits, pool);
+        return;
+    }
+
+    hits.Resize(rays.Size());
+
+    pool.ParallelFor(rays.Size(), RAY_BATCH_CHUNK_SIZE, [&](size_t begin, size_t end) {
+        const size_t width = TrianglesOctreePacketWidth();
+        for (size_t i = begin; i < end; i += width) {
+            octree_triangles->RayCastPacket(vertices, triangles, rays, i, std::min(width, end - i), hits);
+        }
+    });
+}
+
+bool TriangleMesh::Occluded(Ray3D ray, Real_t tmax) const {
+    return AnyHit(ray, tmax);
+}
+
+void TriangleMesh::OccludedBatch(const RayBuffer& rays, std::vector<uint64_t>& occluded, ThreadPool& pool) const {
+    occluded.assign((rays.Size() + 63) / 64, 0);
+
+    pool.ParallelFor(rays.Size(), RAY_BATCH_CHUNK_SIZE, [&](size_t begin, size_t end) {
+        for (size_t i = begin; i < end; i++) {
+            if (AnyHit(rays.Get(i), rays.tmax_[i], rays.tmin_[i])) 
+                occluded[i / 64] |= uint64_t(1) << (i % 64);
+        }
+    });
+}
+
 TriangleMesh * TriangleMesh::VertexClustering(size_t depth) {
 
     std::clock_t start = clock();
@@ -364,31 +716,78 @@ TriangleMesh * TriangleMesh::VertexClustering_GRID(size_t grid_size) {
 
 void TriangleMesh::TestRaysPerSecond(size_t total_rays) {
 
-    std::clock_t start = clock();
-
-    size_t total_intersections = 0;
     size_t rays_that_hit_the_target = 0;
+    Real_t total_hit_distance = 0;
+
+    RayBuffer rays;
+    rays.Resize(total_rays);
+    for (size_t ray = 0; ray < total_rays; ray++) {
+        rays.Set(ray, Point3D({ get_rand(), get_rand(), get_rand() }), Point3D({ get_rand() - 0.5f, get_rand() - 0.5f, get_rand() - 0.5f }));
+    }
 
-    Point3D origin = octree_triangles->GetOrigin();
-    Real_t length = octree_triangles->GetLength();
+    /* Measure wall clock time, clock() adds up the time of all threads */
+    ThreadPool& pool = ThreadPool::Default();
+    HitBuffer hits;
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    RayCastBatch(rays, hits, pool);
+    std::chrono::steady_clock::time_point end = std::chrono::steady_clock::now();
+    double elapsed_secs = std::chrono::duration<double>(end - start).count();
 
     for (size_t ray = 0; ray < total_rays; ray++) {
-    
-        std::vector<unsigned int> results;
-        Ray3D r(Point3D({ get_rand(), get_rand(), get_rand()}), Point3D({ get_rand() - 0.5f, get_rand() - 0.5f, get_rand() - 0.5f }));
-        
-        octree_triangles->RayCast(vertices, triangles, r, results);
-        total_intersections += results.size();
-        rays_that_hit_the_target += (results.size() > 0) ? 1 : 0;
+        if (!hits.Valid(ray)) continue;
+        rays_that_hit_the_target++;
+        total_hit_distance += hits.t_[ray];
     }
 
-    std::clock_t end = clock();
-    double elapsed_secs = double(end - start) / CLOCKS_PER_SEC;
+    /* The same rays as occlusion queries */
+    std::vector<uint64_t> occluded;
+    start = std::chrono::steady_clock::now();
+    OccludedBatch(rays, occluded, pool);
+    end = std::chrono::steady_clock::now();
+    double occlusion_elapsed_secs = std::chrono::duration<double>(end - start).count();
 
     float rayss = (float)total_rays / elapsed_secs;
-    std::cout << "Rays test, Time: " << elapsed_secs << std::endl;
+    std::cout << "Rays test, Time: " << elapsed_secs << ", Threads: " << pool.Size() << std::endl;
     std::cout << "\tTotal rays: " << total_rays << ", Rays/s: " << rayss << std::endl;
-    std::cout << "\tRays that hit the target: " << rays_that_hit_the_target << "\n\tIntersections: " << total_intersections << ", Intersections/ray: " << (float)total_intersections/rays_that_hit_the_target << std::endl;
+    std::cout << "\tRays that hit the target: " << rays_that_hit_the_target << ", Hit ratio: " << (float)rays_that_hit_the_target / total_rays << "\n\tMean hit distance: " << total_hit_distance / rays_that_hit_the_target << std::endl;
+    std::cout << "\tOcclusion rays/s: " << (float)total_rays / occlusion_elapsed_secs << std::endl;
+}
+
+void TriangleMesh::TestPrimaryRaysPerSecond(size_t resolution) {
+
+    /* 
+        Rays of a pinhole camera at (0, 0, 2) looking at the origin, with a 45 degree field of
+        view, in scanline order
+    */
+    RayBuffer rays;
+    rays.Resize(resolution * resolution);
+    for (size_t y = 0; y < resolution; y++) {
+        for (size_t x = 0; x < resolution; x++) {
+            Real_t px = (2 * (x + 0.5) / resolution - 1) * 0.4142;
+            Real_t py = (2 * (y + 0.5) / resolution - 1) * 0.4142;
+            rays.Set(y * resolution + x, Point3D({ 0, 0, 2 }), Point3D({ px, py, -1 }));
+        }
+    }
+
+    ThreadPool& pool = ThreadPool::Default();
+    HitBuffer hits, packet_hits;
+
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    RayCastBatch(rays, hits, pool);
+    std::chrono::steady_clock::time_point middle = std::chrono::steady_clock::now();
+    RayCastCoherentBatch(rays, packet_hits, pool);
+    std::chrono::steady_clock::time_point end = std::chrono::steady_clock::now();
+
+    double single_secs = std::chrono::duration<double>(middle - start).count();
+    double packet_secs = std::chrono::duration<double>(end - middle).count();
+
+    size_t rays_that_hit_the_target = 0;
+    for (size_t ray = 0; ray < rays.Size(); ray++) rays_that_hit_the_target += hits.Valid(ray) ? 1 : 0;
+
+    std::cout << "Primary rays test, Resolution: " << resolution << "x" << resolution << ", Threads: " << pool.Size() << std::endl;
+    std::cout << "\tRays that hit the target: " << rays_that_hit_the_target << std::endl;
+    std::cout << "\tSingle rays, Rays/s: " << rays.Size() / single_secs << std::endl;
+    std::cout << "\tPackets of " << TrianglesOctreePacketWidth() << ", Rays/s: " << rays.Size() / packet_secs << std::endl;
 }
 
 void TriangleMesh::sendToOpenGL(ShaderProgram &program) {
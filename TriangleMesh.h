@@ -4,14 +4,21 @@
 #include <string>
 #include <vector>
 #include <deque>
+#include <cstdint>
 
 #include <glm/glm.hpp>
 
 #include "ShaderProgram.h"
 
 #include "Ray.hpp"
+#include "RayBuffer.hpp"
+#include "ThreadPool.h"
 #include "PointOctree.hpp"
-#include "TrianglesOctree.hpp"
+#include "TrianglesOctreeConfig.h"
+#include "TrianglesOctreeCache.h"
+#include "BVH.h"
+#include "TrianglesGrid.h"
+#include "TrianglesTwoLevelGrid.h"
 
 
 using namespace std;
@@ -19,22 +26,123 @@ using namespace std;
 class TriangleMesh
 {
 public:
+    /* The structures the triangle queries can run on */
+    enum class Accelerator {
+        OCTREE,
+        BVH,
+        GRID,
+        TWO_LEVEL_GRID,
+    };
+
  	TriangleMesh();
+    ~TriangleMesh();
+
+    /* Owns its acceleration structures */
+    TriangleMesh(const TriangleMesh&) = delete;
+    TriangleMesh& operator=(const TriangleMesh&) = delete;
 
 	void addVertex(const glm::vec3 &position);
 	void addTriangle(int v0, int v1, int v2);
 
+    /**
+        Resize the vertices, so that a loader can decode them in place. New vertices get the
+        constant color of addVertex
+        @return The first vertex
+    */
+    glm::vec3 * ResizeVertices(size_t count);
+    /**
+        Resize the triangle indices, three per triangle, so that a loader can decode them in place
+        @return The first index
+    */
+    unsigned int * ResizeTriangles(size_t count);
+
 	void buildCube();
     void buildTile();
     void buildDot();
 
     void Preprocess();
 
+    /**
+        Load the mesh and its triangles octree from a cache file written by SaveCache, into an
+        empty mesh. The octree is used from the mapped file, Preprocess then skips building it.
+        The accelerator is set to the one saved, so that Preprocess only builds that one
+        @param key The key the cache was saved with, e.g. FileKey of the source model. It is
+            combined with the octree configuration
+        @return false if there is no cache for that key, the mesh is left empty
+    */
+    bool LoadCache(const std::string& path, uint64_t key);
+    /**
+        Save the mesh, its triangles octree and the selected accelerator to a cache file. Call
+        after Preprocess, and after SelectAccelerator to keep its choice
+        @return false if the file can't be written
+    */
+    bool SaveCache(const std::string& path, uint64_t key) const;
+
+    /**
+        Choose the structure used by the triangle queries, the triangles octree by default. Only
+        that structure is built, by Preprocess or here if it is called after Preprocess. The BVH
+        and the grids that are not selected any more are deleted
+    */
+    void SetAccelerator(Accelerator accelerator);
+    Accelerator GetAccelerator() const;
+    /**
+        Build every structure, measure the closest hit rays/s of each on the same random rays 
+        through the bounding box of the mesh, and use the fastest one. The others are deleted, 
+        except the triangles octree that the cache file holds. Call after Preprocess
+        @param total_rays The number of rays to measure with
+    */
+    void SelectAccelerator(size_t total_rays);
+
+    /**
+        Choose the bucket size and the maximum depth of the triangles octree, one of
+        TrianglesOctreeConfigs(). After Preprocess the octree is built again
+        @return false if the configuration is not compiled in, the octree is left as it is
+    */
+    bool SetOctreeConfig(TrianglesOctreeConfig config);
+    TrianglesOctreeConfig GetOctreeConfig() const;
+    /**
+        Build the triangles octree with every configuration of TrianglesOctreeConfigs() on a crop 
+        of the mesh, the densest cell of the octree with at most about 200000 triangles, measure 
+        the closest hit rays/s and the memory of each on random rays through the crop, and keep 
+        the fastest. Of configurations within 5% of the fastest, the one with the least memory is 
+        kept, and only that one is built on the whole mesh. The crop is a few levels below the 
+        root, so the maximum depth of a configuration counts from the crop there. Call after 
+        Preprocess
+        @param total_rays The number of rays to measure with
+    */
+    void TuneOctree(size_t total_rays);
+
     TriangleMesh * VertexClustering(size_t depth);
     TriangleMesh * VertexClustering_GRID(size_t grid_size);
 
     int RayCast(Ray3D ray, bool use_triangles = true);
+    /**
+        Find the closest hit of every ray in a batch. The batch is split in chunks over the 
+        threads of the pool. Call after Preprocess, the mesh is only read
+        @param rays The rays
+        @param[out] hits Resized to the number of rays, holds the closest hit of each ray
+        @param pool The threads to use
+    */
+    void RayCastBatch(const RayBuffer& rays, HitBuffer& hits, ThreadPool& pool = ThreadPool::Default()) const;
+    /**
+        Same as RayCastBatch, for coherent rays, e.g. camera rays in scanline order. Consecutive 
+        rays are traced together as packets of TrianglesOctreePacketWidth() rays
+    */
+    void RayCastCoherentBatch(const RayBuffer& rays, HitBuffer& hits, ThreadPool& pool = ThreadPool::Default()) const;
+    /**
+        Check if a ray hits any triangle of the mesh inside [0, tmax]
+    */
+    bool Occluded(Ray3D ray, Real_t tmax) const;
+    /**
+        Check a batch of rays for any hit inside their [tmin, tmax] interval
+        @param rays The rays
+        @param[out] occluded Bit i % 64 of word i / 64 is set if ray i hits a triangle
+        @param pool The threads to use
+    */
+    void OccludedBatch(const RayBuffer& rays, std::vector<uint64_t>& occluded, ThreadPool& pool = ThreadPool::Default()) const;
+
     void TestRaysPerSecond(size_t total_rays);
+    void TestPrimaryRaysPerSecond(size_t resolution);
 
 	void sendToOpenGL(ShaderProgram &program);
 	void render(ShaderProgram &program) const;
@@ -42,7 +150,31 @@ public:
 	void free();
 
 private:
-    
+    /* Closest hit and any hit queries, on the selected structure */
+    bool ClosestHit(Ray3D ray, RayHit& hit, Real_t tmin = 0, Real_t tmax = std::numeric_limits<Real_t>::max()) const;
+    bool AnyHit(Ray3D ray, Real_t tmax, Real_t tmin = 0) const;
+
+    /**
+        Rays from random points of the bounding box towards other random points of it, the same
+        ones on every call
+    */
+    void BoundingBoxRays(size_t total_rays, RayBuffer& rays) const;
+    /* Rays between random points of a box, the same ones for the same box */
+    static void BoxRays(glm::vec3 low, glm::vec3 high, size_t total_rays, RayBuffer& rays);
+    /**
+        Build the triangles octree of the mesh with a configuration, with its leaf triangle data
+        @return nullptr if the configuration is not compiled in
+    */
+    TrianglesOctreeBase * BuildTrianglesOctree(TrianglesOctreeConfig config) const;
+    /* Build the structure of an accelerator, unless it is there already */
+    void BuildAccelerator(Accelerator accelerator);
+    /* Delete the BVH and the grids, but the selected one */
+    void DeleteAccelerators();
+    /**
+        The key of the cache file of the mesh, from the key of its source and the parameters the
+        triangles octree is built with
+    */
+    uint64_t CacheKey(uint64_t key) const;
 
     vector<glm::vec3> vertices;
     vector<unsigned int> triangles;
@@ -55,7 +187,14 @@ private:
     GLfloat min_x, max_x, min_y, max_y, min_z, max_z;
 
     PointOctree<int, 1> * octree_vertices;
-    TrianglesOctree<5, 15> * octree_triangles;
+    TrianglesOctreeBase * octree_triangles;
+    TrianglesOctreeConfig octree_config_;
+    /* The region of the triangles octree, set by Preprocess */
+    float octree_origin_, octree_length_;
+    BVH * bvh_triangles;
+    TrianglesGrid * grid_triangles;
+    TrianglesTwoLevelGrid * two_level_grid_triangles;
+    Accelerator accelerator_;
 
 	GLuint vao;
     GLuint ebo;
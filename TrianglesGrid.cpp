@@ -0,0 +1,95 @@
+#include "TrianglesGrid.h"
+
+#include <algorithm>
+#include <cmath>
+
+#include "GridTraversal.hpp"
+
+TrianglesGrid::TrianglesGrid(const std::vector<glm::vec3>& in_vertices, const std::vector<unsigned int>& in_triangles, ThreadPool& pool) {
+    size_t triangle_count = in_triangles.size() / 3;
+
+    min_ = glm::vec3(std::numeric_limits<float>::max());
+    max_ = glm::vec3(-std::numeric_limits<float>::max());
+    for (size_t i = 0; i < 3 * triangle_count; i++) {
+        min_ = glm::min(min_, in_vertices[in_triangles[i]]);
+        max_ = glm::max(max_, in_vertices[in_triangles[i]]);
+    }
+    if (triangle_count == 0) min_ = max_ = glm::vec3(0);
+
+    /* Pad the box, so that flat meshes have some thickness and vertices on the border lie inside */
+    glm::vec3 extent = max_ - min_;
+    float max_extent = std::max(std::max(extent.x, extent.y), extent.z);
+    float padding = std::max(max_extent * 1e-4f, 1e-6f);
+    min_ -= glm::vec3(padding);
+    max_ += glm::vec3(padding);
+    extent = max_ - min_;
+    max_extent = std::max(std::max(extent.x, extent.y), extent.z);
+
+    /*
+        Cubic cells, sized so that a mesh that fills a cube has DENSITY cells per triangle. Flat
+        and thin meshes get a single layer of cells along their short axes
+    */
+    float cells_per_unit = std::cbrt(DENSITY * std::max<size_t>(triangle_count, 1)) / max_extent;
+    for (int i = 0; i < 3; i++) {
+        resolution_[i] = std::min(MAX_RESOLUTION, std::max(1, static_cast<int>(std::round(extent[i] * cells_per_unit))));
+        cell_size_[i] = extent[i] / resolution_[i];
+    }
+
+    std::vector<unsigned int> ids(triangle_count);
+    for (size_t i = 0; i < triangle_count; i++)
+        ids[i] = static_cast<unsigned int>(i);
+    BinTriangles(in_vertices, in_triangles, ids.data(), triangle_count, min_, cell_size_, resolution_, cell_offsets_, cell_triangles_, &pool);
+}
+
+bool TrianglesGrid::RayCast(const std::vector<glm::vec3>& in_vertices, const std::vector<unsigned int>& in_triangles, Ray3D r, RayHit& hit, Real_t tmin, Real_t tmax) const {
+    hit = RayHit();
+    hit.t_ = tmax;
+
+    Real_t origin[3] = { r.Origin()[0], r.Origin()[1], r.Origin()[2] };
+    Real_t direction[3] = { r.Direction()[0], r.Direction()[1], r.Direction()[2] };
+
+    auto visitor = [&](int x, int y, int z, Real_t /*cell_enter*/, Real_t cell_exit) {
+        size_t cell = CellIndex(x, y, z);
+        for (unsigned int i = cell_offsets_[cell]; i < cell_offsets_[cell + 1]; i++) {
+            unsigned int triangle_id = cell_triangles_[i];
+            int tp = 3 * triangle_id;
+            Real_t t, u, v;
+            if (!rayTriangleIntersect(origin, direction, in_vertices[in_triangles[tp]], in_vertices[in_triangles[tp + 1]], in_vertices[in_triangles[tp + 2]], t, u, v)) continue;
+            if (t < tmin || t >= hit.t_) continue;
+
+            hit.triangle_id_ = triangle_id;
+            hit.t_ = t;
+            hit.u_ = u;
+            hit.v_ = v;
+        }
+
+        /* Same as the octree, a hit beyond the exit of the cell may still be beaten in the next cells */
+        return hit.Valid() && hit.t_ <= cell_exit;
+    };
+    WalkGrid(min_, max_, cell_size_, resolution_, origin, direction, tmin, hit.t_, visitor);
+
+    return hit.Valid();
+}
+
+bool TrianglesGrid::Occluded(const std::vector<glm::vec3>& in_vertices, const std::vector<unsigned int>& in_triangles, Ray3D r, Real_t tmax, Real_t tmin) const {
+    Real_t origin[3] = { r.Origin()[0], r.Origin()[1], r.Origin()[2] };
+    Real_t direction[3] = { r.Direction()[0], r.Direction()[1], r.Direction()[2] };
+
+    bool occluded = false;
+    auto visitor = [&](int x, int y, int z, Real_t /*cell_enter*/, Real_t /*cell_exit*/) {
+        size_t cell = CellIndex(x, y, z);
+        for (unsigned int i = cell_offsets_[cell]; i < cell_offsets_[cell + 1]; i++) {
+            int tp = 3 * cell_triangles_[i];
+            Real_t t, u, v;
+            if (!rayTriangleIntersect(origin, direction, in_vertices[in_triangles[tp]], in_vertices[in_triangles[tp + 1]], in_vertices[in_triangles[tp + 2]], t, u, v)) continue;
+            if (t < tmin || t > tmax) continue;
+
+            occluded = true;
+            return true;
+        }
+        return false;
+    };
+    WalkGrid(min_, max_, cell_size_, resolution_, origin, direction, tmin, tmax, visitor);
+
+    return occluded;
+}
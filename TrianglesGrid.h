@@ -0,0 +1,74 @@
+#ifndef __TrianglesGrid_h__
+#define __TrianglesGrid_h__
+
+#include <limits>
+#include <vector>
+
+#include <glm/glm.hpp>
+
+#include "Ray.hpp"
+#include "RayTriangleIntersection.hpp"
+#include "ThreadPool.h"
+
+/**
+    A uniform grid over the bounding box of a mesh, every cell references the triangles that
+    overlap it. The references of all cells are stored in one array, cell i owns the range
+    [cell_offsets_[i], cell_offsets_[i + 1]). Rays walk the cells they cross in order with the
+    Amanatides-Woo 3D-DDA. The queries have the same interface as the ones of TrianglesOctree
+*/
+class TrianglesGrid {
+public:
+    /**
+        Build the grid of all the triangles of a mesh. The number of cells is proportional to the
+        number of triangles, the cells are about cubes
+        @param in_vertices The vertices of the mesh
+        @param in_triangles Three vertex indices per triangle
+        @param pool The threads to build with. The grid is the same for any number of threads
+    */
+    TrianglesGrid(const std::vector<glm::vec3>& in_vertices, const std::vector<unsigned int>& in_triangles, ThreadPool& pool = ThreadPool::Default());
+
+    /**
+        Find the closest triangle hit by a ray
+        @param r The 3D space ray
+        @param[out] hit The closest hit. If nothing is hit, hit.Valid() is false
+        @param tmin The start of the ray interval
+        @param tmax The end of the ray interval
+        @return true if a triangle was hit inside [tmin, tmax]
+    */
+    bool RayCast(const std::vector<glm::vec3>& in_vertices, const std::vector<unsigned int>& in_triangles, Ray3D r, RayHit& hit, Real_t tmin = 0, Real_t tmax = std::numeric_limits<Real_t>::max()) const;
+
+    /**
+        Check if a ray hits any triangle. The traversal ends at the first hit found
+        @param r The 3D space ray
+        @param tmax The end of the ray interval
+        @param tmin The start of the ray interval
+        @return true if any triangle is hit inside [tmin, tmax]
+    */
+    bool Occluded(const std::vector<glm::vec3>& in_vertices, const std::vector<unsigned int>& in_triangles, Ray3D r, Real_t tmax, Real_t tmin = 0) const;
+
+    /**
+        @return The number of cells along axis
+    */
+    int Resolution(int axis) const {
+        return resolution_[axis];
+    }
+
+private:
+    /* Cells per triangle */
+    static constexpr float DENSITY = 2.0f;
+    /* Most cells along one axis */
+    static constexpr int MAX_RESOLUTION = 512;
+    size_t CellIndex(int x, int y, int z) const {
+        return (static_cast<size_t>(z) * resolution_[1] + y) * resolution_[0] + x;
+    }
+
+    glm::vec3 min_;
+    glm::vec3 max_;
+    glm::vec3 cell_size_;
+    int resolution_[3];
+
+    std::vector<unsigned int> cell_offsets_;
+    std::vector<unsigned int> cell_triangles_;
+};
+
+#endif
@@ -2,12 +2,29 @@
 #define __TrianglesOctree_hpp__
 
 #include <bitset>
+#include <cmath>
+#include <deque>
+#include <memory>
+#include <vector>
 
 #include <glm/glm.hpp>
 
 #include "TriangleBoxOverlapping.hpp"
-
-template<int BUCKET_SIZE = 5, int MAX_DEPTH = 19>
+#include "RayTriangleIntersection.hpp"
+#include "LeafIntersection.h"
+#include "LinearOctree.hpp"
+#include "RayBuffer.hpp"
+#include "RayPacket.hpp"
+#include "ThreadPool.h"
+#include "Arena.h"
+#include "InlineBucket.hpp"
+#include "TrianglesOctreeConfig.h"
+
+/**
+    The nodes are created with Allocator, see Arena.h. With ArenaAllocator they are freed all at
+    once when the octree is destroyed
+*/
+template<int BUCKET_SIZE = 5, int MAX_DEPTH = 19, typename Allocator = ArenaAllocator>
 class TrianglesOctree {
 private:
 
@@ -23,12 +40,27 @@ private:
 
         NodeType GetNodeType() { return type_; }
 
-        virtual OctreeNode * Insert(std::vector<glm::vec3>& in_vertices, std::vector<unsigned int>& in_triangles, int triangle_id, size_t depth) = 0;
+        /**
+            Free this node and its subtree
+        */
+        virtual void Destroy(Allocator& allocator) = 0;
+        /**
+            Add a triangle to the subtree of this node. A leaf is split where SplitPays, as in the 
+            batch build
+            @param depth The depth of this node, the root is at depth 0
+            @param kernel_width GetLeafIntersectionKernelWidth(), read once by the octree
+            @return The node that takes the place of this one
+        */
+        virtual OctreeNode * Insert(Allocator& allocator, std::vector<glm::vec3>& in_vertices, std::vector<unsigned int>& in_triangles, int triangle_id, size_t depth, size_t kernel_width) = 0;
         virtual size_t Depth() = 0;
 
-        virtual bool RayCastProcessChild(std::vector<glm::vec3>& in_vertices, std::vector<unsigned int>& in_triangles, Ray3D& ray, Real_t tx0, Real_t ty0, Real_t tz0, Real_t tx1, Real_t ty1, Real_t tz1, unsigned char a, std::vector<unsigned int>& results) = 0;
+        /**
+            Write this node to the linear octree at index. Inner nodes append slots for their children
+            and queue them, so that siblings end up next to each other
+        */
+        virtual void Compile(size_t index, std::vector<LinearOctreeNode>& nodes, std::vector<unsigned int>& triangles, std::deque<std::pair<OctreeNode *, size_t> >& queue) = 0;
 
-        bool Overlaps(Point3D origin, Real_t length, std::vector<glm::vec3>& in_vertices, std::vector<unsigned int>& in_triangles, int triangle_id) {
+        static bool Overlaps(Point3D origin, Real_t length, const std::vector<glm::vec3>& in_vertices, const std::vector<unsigned int>& in_triangles, int triangle_id) {
             Real_t half_size = length / 2;
             glm::vec3 box_center = glm::vec3(origin[0], origin[1], origin[2]) + glm::vec3(half_size, half_size, half_size);
             int tp = 3 * triangle_id;
@@ -36,6 +68,16 @@ private:
             return overlaps;
         }
 
+        /**
+            @return Bit i is set if the triangle overlaps octant i of the node at origin with that length
+        */
+        static unsigned char OverlappedOctants(Point3D origin, Real_t length, const std::vector<glm::vec3>& in_vertices, const std::vector<unsigned int>& in_triangles, int triangle_id) {
+            Real_t half_size = length / 2;
+            glm::vec3 box_center = glm::vec3(origin[0], origin[1], origin[2]) + glm::vec3(half_size, half_size, half_size);
+            int tp = 3 * triangle_id;
+            return triBoxOverlapOctants(box_center, static_cast<float>(half_size), in_vertices[in_triangles[tp]], in_vertices[in_triangles[tp + 1]], in_vertices[in_triangles[tp + 2]]);
+        }
+
     protected:
         NodeType type_;
         Point3D origin_;
@@ -94,26 +136,33 @@ private:
             this->type_ = OctreeNode::NodeType::LEAF;
         }
 
-        void Destroy() {
-
+        void Destroy(Allocator& allocator) {
+            buckets_.Free(allocator);
+            AllocatorDelete(allocator, this);
         }
 
-        OctreeNode * Insert(std::vector<glm::vec3>& in_vertices, std::vector<unsigned int>& in_triangles, int triangle_id, size_t depth) {
+        OctreeNode * Insert(Allocator& allocator, std::vector<glm::vec3>& in_vertices, std::vector<unsigned int>& in_triangles, int triangle_id, size_t depth, size_t kernel_width) {
 
             if (!OctreeNode::Overlaps(this->origin_, this->length_, in_vertices, in_triangles, triangle_id)) return this;
 
-            if (buckets_.size() < BUCKET_SIZE || depth >= MAX_DEPTH) {
-                buckets_.push_back(triangle_id);
-                return this;
+            buckets_.PushBack(allocator, triangle_id);
+            if (depth >= MAX_DEPTH) return this;
+
+            std::vector<unsigned int> child_ids[8];
+            for (size_t i = 0; i < buckets_.Size(); i++) {
+                unsigned char mask = OctreeNode::OverlappedOctants(this->origin_, this->length_, in_vertices, in_triangles, buckets_[i]);
+                for (int octant = 0; octant < 8; octant++) {
+                    if ((mask >> octant) & 1) child_ids[octant].push_back(buckets_[i]);
+                }
             }
+            if (!SplitPays(buckets_.Size(), child_ids, depth, in_triangles.size() / 3, kernel_width)) return this;
 
-            OctreeInnerNode * temp = new  OctreeInnerNode(this->origin_, this->length_);
-            for (size_t i = 0; i < buckets_.size(); i++) {
-                temp->Insert(in_vertices, in_triangles, buckets_[i].triangle_id_, depth + 1);
+            OctreeInnerNode * temp = AllocatorNew<OctreeInnerNode>(allocator, this->origin_, this->length_);
+            for (size_t i = 0; i < buckets_.Size(); i++) {
+                temp->Insert(allocator, in_vertices, in_triangles, buckets_[i], depth, kernel_width);
             }
-            temp->Insert(in_vertices, in_triangles, triangle_id, depth + 1);
 
-            delete this;
+            Destroy(allocator);
             return temp;
         }
 
@@ -121,35 +170,36 @@ private:
             return 0;
         }
 
-        bool RayCastProcessChild(std::vector<glm::vec3>& in_vertices, std::vector<unsigned int>& in_triangles, Ray3D& ray, Real_t tx0, Real_t ty0, Real_t tz0, Real_t tx1, Real_t ty1, Real_t tz1, unsigned char a, std::vector<unsigned int>& results) {
-
-            if (tx1 < 0 || ty1 < 0 || tz1 < 0) return false;
+        void Add(Allocator& allocator, unsigned int triangle_id) {
+            buckets_.PushBack(allocator, triangle_id);
+        }
 
-            /* 
-                If ray traversing hit a leaf, check if the triangles stored here actually intersect with the ray
-                Find the first triangle of intersection, calculate the reflected ray, and return
-                If ray does not hit a triangle, return false
-            */
-            /* This is not implemented, I just return all the triangles and end the traversal */
-            for (size_t i = 0; i < buckets_.size(); i++)
-                results.push_back(buckets_[i].triangle_id_);
-            return true;
+        void Reserve(Allocator& allocator, size_t count) {
+            buckets_.Reserve(allocator, count);
+        }
 
+        void Compile(size_t index, std::vector<LinearOctreeNode>& nodes, std::vector<unsigned int>& triangles, std::deque<std::pair<OctreeNode *, size_t> >& /*queue*/) {
+            nodes[index].first_ = static_cast<unsigned int>(triangles.size());
+            nodes[index].count_ = static_cast<unsigned int>(buckets_.Size());
+            nodes[index].child_mask_ = 0;
+            for (size_t i = 0; i < buckets_.Size(); i++)
+                triangles.push_back(buckets_[i]);
         }
 
     private:
-        struct Bucket {
-            Bucket(unsigned int triangle_id) : triangle_id_(triangle_id) {};
-            unsigned int triangle_id_;
-        };
-        std::deque<Bucket> buckets_;
+        /* 
+            The triangle ids. SplitPays decides the size of the leaves, the first BUCKET_SIZE ids
+            are stored in the node and the rest goes to the overflow of the bucket
+        */
+        InlineBucket<unsigned int, BUCKET_SIZE> buckets_;
 
     };
 
     class OctreeInnerNode : public OctreeNode {
     public:
         OctreeInnerNode(Point3D origin, Real_t length) {
-            children_ = std::vector<OctreeNode *>(8, nullptr);
+            for (size_t i = 0; i < 8; i++)
+                children_[i] = nullptr;
 
             this->origin_ = origin;
             this->length_ = length;
@@ -159,15 +209,23 @@ private:
 
         }
 
-        OctreeNode * Insert(std::vector<glm::vec3>& in_vertices, std::vector<unsigned  int>& in_triangles, int triangle_id, size_t depth) {
+        void Destroy(Allocator& allocator) {
+            for (size_t i = 0; i < 8; i++) {
+                if (children_[i] != nullptr) children_[i]->Destroy(allocator);
+            }
+            AllocatorDelete(allocator, this);
+        }
+
+        OctreeNode * Insert(Allocator& allocator, std::vector<glm::vec3>& in_vertices, std::vector<unsigned  int>& in_triangles, int triangle_id, size_t depth, size_t kernel_width) {
 
             Real_t H = this->length_ / 2.0f;
-            for (size_t i = 0; i < children_.size(); i++) {
+            unsigned char mask = OctreeNode::OverlappedOctants(this->origin_, this->length_, in_vertices, in_triangles, triangle_id);
+            for (size_t i = 0; i < 8; i++) {
+                if (!((mask >> i) & 1)) continue;
                 Point3D child_origin = OctreeNode::GetOctantOrigin(i);
-                if (!OctreeNode::Overlaps(child_origin, H, in_vertices, in_triangles, triangle_id)) continue;
 
-                if (children_[i] == nullptr) children_[i] = new OctreeLeafNode(child_origin, H);
-                children_[i] = children_[i]->Insert(in_vertices, in_triangles, triangle_id, depth + 1);
+                if (children_[i] == nullptr) children_[i] = AllocatorNew<OctreeLeafNode>(allocator, child_origin, H);
+                children_[i] = children_[i]->Insert(allocator, in_vertices, in_triangles, triangle_id, depth + 1, kernel_width);
             }
 
             return this;
@@ -175,171 +233,691 @@ private:
 
         size_t Depth() {
             size_t current_depth = 0;
-            for (size_t i = 0; i < children_.size(); i++)
+            for (size_t i = 0; i < 8; i++)
                 if (children_[i] != nullptr) current_depth = std::max(current_depth, children_[i]->Depth());
 
             return current_depth + 1;
         }
 
-        bool RayCastProcessChild(std::vector<glm::vec3>& in_vertices, std::vector<unsigned int>& in_triangles, Ray3D& ray, Real_t tx0, Real_t ty0, Real_t tz0, Real_t tx1, Real_t ty1, Real_t tz1, unsigned char a, std::vector<unsigned int>& results) {
-            Real_t txm, tym, tzm;
-            int current_node;
-
-            if (tx1 < 0 || ty1 < 0 || tz1 < 0) return false;
-
-            /* Calculate the middle of the entry and exit point */
-            txm = Real_t(0.5)*(tx0 + tx1);
-            tym = Real_t(0.5)*(ty0 + ty1);
-            tzm = Real_t(0.5)*(tz0 + tz1);
-
-            /* Calculate the first node to be visited */
-            current_node = RayCastFirstNode(tx0, ty0, tz0, txm, tym, tzm);
-
-            bool found = false;
-            /* Iteratively visit the nodes along the ray */
-            do {
-                int index = current_node ^ a;
-                switch (current_node)
-                {
-                case 0: {
-                    if (children_[index] != nullptr) found = found | children_[index]->RayCastProcessChild(in_vertices, in_triangles, ray, tx0, ty0, tz0, txm, tym, tzm, a, results);
-                    current_node = RayCastNewNode(txm, 4, tym, 2, tzm, 1);
-                    break;
-                } case 1: {
-                    if (children_[index] != nullptr) found = found | children_[index]->RayCastProcessChild(in_vertices, in_triangles, ray, tx0, ty0, tzm, txm, tym, tz1, a, results);
-                    current_node = RayCastNewNode(txm, 5, tym, 3, tz1, 8);
-                    break;
-                } case 2: {
-                    if (children_[index] != nullptr) found = found | children_[index]->RayCastProcessChild(in_vertices, in_triangles, ray, tx0, tym, tz0, txm, ty1, tzm, a, results);
-                    current_node = RayCastNewNode(txm, 6, ty1, 8, tzm, 3);
-                    break;
-                } case 3: {
-                    if (children_[index] != nullptr) found = found | children_[index]->RayCastProcessChild(in_vertices, in_triangles, ray, tx0, tym, tzm, txm, ty1, tz1, a, results);
-                    current_node = RayCastNewNode(txm, 7, ty1, 8, tz1, 8);
-                    break;
-                } case 4: {
-                    if (children_[index] != nullptr) found = found | children_[index]->RayCastProcessChild(in_vertices, in_triangles, ray, txm, ty0, tz0, tx1, tym, tzm, a, results);
-                    current_node = RayCastNewNode(tx1, 8, tym, 6, tzm, 5);
-                    break;
-                } case 5: {
-                    if (children_[index] != nullptr) found = found | children_[index]->RayCastProcessChild(in_vertices, in_triangles, ray, txm, ty0, tzm, tx1, tym, tz1, a, results);
-                    current_node = RayCastNewNode(tx1, 8, tym, 7, tz1, 8);
-                    break;
-                } case 6: {
-                    if (children_[index] != nullptr) found = found | children_[index]->RayCastProcessChild(in_vertices, in_triangles, ray, txm, tym, tz0, tx1, ty1, tzm, a, results);
-                    current_node = RayCastNewNode(tx1, 8, ty1, 8, tzm, 7);
-                    break;
-                } case 7: {
-                    if (children_[index] != nullptr) found = found | children_[index]->RayCastProcessChild(in_vertices, in_triangles, ray, txm, tym, tzm, tx1, ty1, tz1, a, results);
-                    current_node = 8;
-                    break;
-                }
-                }
-                if (found) return true;
-            } while (current_node < 8);
+        void SetChild(size_t octant, OctreeNode * child) {
+            children_[octant] = child;
+        }
 
-            return found;
+        void Compile(size_t index, std::vector<LinearOctreeNode>& nodes, std::vector<unsigned int>& /*triangles*/, std::deque<std::pair<OctreeNode *, size_t> >& queue) {
+            nodes[index].first_ = static_cast<unsigned int>(nodes.size());
+            nodes[index].count_ = 0;
+            nodes[index].child_mask_ = 0;
+            for (size_t i = 0; i < 8; i++) {
+                if (children_[i] == nullptr) continue;
+                nodes[index].child_mask_ |= 1 << i;
+                queue.push_back(std::make_pair(children_[i], nodes.size()));
+                nodes.push_back(LinearOctreeNode());
+            }
         }
 
     private:
-        std::vector<OctreeNode *> children_;
+        OctreeNode * children_[8];
+    };
 
+    /**
+        Mark the triangles of a leaf as tested, for the leaf tests that run on whole leaves. A
+        vector test costs the same with or without the triangles already tested, so a leaf is
+        only skipped if it has none left
+        @return true if some triangle of the leaf was not tested before
+    */
+    static bool MarkTested(Mailbox& mailbox, const unsigned int * leaf_triangles, const LinearOctreeNode& leaf) {
+        bool untested = false;
+        for (unsigned int i = leaf.first_; i < leaf.first_ + leaf.count_; i++)
+            untested = !mailbox.TestAndAdd(leaf_triangles[i]) || untested;
+        return untested;
+    }
 
-        int RayCastFirstNode(Real_t tx0, Real_t ty0, Real_t tz0, Real_t txm, Real_t tym, Real_t tzm) {
-            unsigned char answer = 0;
+    /**
+        Leaf visitor for the any hit query
+    */
+    struct AnyHitVisitor {
+        AnyHitVisitor(const std::vector<glm::vec3>& in_vertices, const std::vector<unsigned int>& in_triangles, const unsigned int * leaf_triangles, const TriangleBuffer * leaf_data, const Real_t origin[3], const Real_t direction[3], Real_t tmin, Real_t tmax, Mailbox& mailbox) 
+            : in_vertices_(in_vertices), in_triangles_(in_triangles), leaf_triangles_(leaf_triangles), leaf_data_(leaf_data), origin_(origin), direction_(direction), tmin_(tmin), tmax_(tmax), occluded_(false), mailbox_(mailbox), kernel_(leaf_data ? GetLeafIntersectionKernel() : nullptr) {
+            for (int i = 0; i < 3; i++) {
+                origin_f_[i] = static_cast<float>(origin[i]);
+                direction_f_[i] = static_cast<float>(direction[i]);
+            }
+        };
 
-            if (tx0 > ty0) {
-                if (tx0 > tz0) {
-                    if (tym < tx0) answer |= 2;
-                    if (tzm < tx0) answer |= 1;
-                    return (int)answer;
-                }
+        bool operator()(const LinearOctreeNode& leaf, Real_t /*t_enter*/, Real_t /*t_exit*/) {
+            /* Any hit inside the ray interval ends the traversal, no matter which leaf it lies in */
+            if (kernel_) {
+                if (!MarkTested(mailbox_, leaf_triangles_, leaf)) return false;
+
+                float t, u, v;
+                float tmax = static_cast<float>(std::min<Real_t>(tmax_, std::numeric_limits<float>::max()));
+                occluded_ = kernel_(origin_f_, direction_f_, *leaf_data_, leaf.first_, leaf.count_, static_cast<float>(tmin_), tmax, t, u, v) >= 0;
+                return occluded_;
+            }
+
+            for (unsigned int i = leaf.first_; i < leaf.first_ + leaf.count_; i++) {
+                if (mailbox_.TestAndAdd(leaf_triangles_[i])) continue;
+                int tp = 3 * leaf_triangles_[i];
+                Real_t t, u, v;
+                bool intersects = leaf_data_ ? rayTriangleIntersect(origin_, direction_, *leaf_data_, i, t, u, v)
+                    : rayTriangleIntersect(origin_, direction_, in_vertices_[in_triangles_[tp]], in_vertices_[in_triangles_[tp + 1]], in_vertices_[in_triangles_[tp + 2]], t, u, v);
+                if (!intersects) continue;
+                if (t < tmin_ || t > tmax_) continue;
+
+                occluded_ = true;
+                return true;
+            }
+            return false;
+        }
+
+        const std::vector<glm::vec3>& in_vertices_;
+        const std::vector<unsigned int>& in_triangles_;
+        const unsigned int * leaf_triangles_;
+        /* The triangles in leaf order, or nullptr to read them from the mesh */
+        const TriangleBuffer * leaf_data_;
+        const Real_t * origin_;
+        const Real_t * direction_;
+        Real_t tmin_;
+        Real_t tmax_;
+        bool occluded_;
+        /* The triangles this ray was already tested against */
+        Mailbox& mailbox_;
+        /* The vector leaf test, used with leaf_data_ */
+        LeafIntersectionKernel kernel_;
+        float origin_f_[3];
+        float direction_f_[3];
+    };
+
+    /**
+        A node waiting to be visited by a ray packet
+    */
+    struct PacketFrame {
+        unsigned int node_;
+        float x_, y_, z_;
+        float length_;
+    };
+
+    /**
+        Leaf visitor for the closest hit query
+    */
+    struct ClosestHitVisitor {
+        ClosestHitVisitor(const std::vector<glm::vec3>& in_vertices, const std::vector<unsigned int>& in_triangles, const unsigned int * leaf_triangles, const TriangleBuffer * leaf_data, const Real_t origin[3], const Real_t direction[3], Real_t tmin, RayHit& hit, Mailbox& mailbox) 
+            : in_vertices_(in_vertices), in_triangles_(in_triangles), leaf_triangles_(leaf_triangles), leaf_data_(leaf_data), origin_(origin), direction_(direction), tmin_(tmin), hit_(hit), mailbox_(mailbox), kernel_(leaf_data ? GetLeafIntersectionKernel() : nullptr) {
+            for (int i = 0; i < 3; i++) {
+                origin_f_[i] = static_cast<float>(origin[i]);
+                direction_f_[i] = static_cast<float>(direction[i]);
             }
-            else {
-                if (ty0 > tz0) {
-                    if (txm < ty0) answer |= 4;
-                    if (tzm < ty0) answer |= 1;
-                    return (int)answer;
+        };
+
+        bool operator()(const LinearOctreeNode& leaf, Real_t /*t_enter*/, Real_t t_exit) {
+            /* 
+                If ray traversing hit a leaf, check if the triangles stored here actually intersect with the ray.
+                hit_.t_ holds the current end of the ray interval, so every hit found shortens the ray
+            */
+            if (kernel_) {
+                /* The kernel tests the whole leaf in single precision and returns the nearest hit */
+                if (!MarkTested(mailbox_, leaf_triangles_, leaf)) return hit_.Valid() && hit_.t_ <= t_exit;
+
+                float t, u, v;
+                float tmax = static_cast<float>(std::min<Real_t>(hit_.t_, std::numeric_limits<float>::max()));
+                int lane = kernel_(origin_f_, direction_f_, *leaf_data_, leaf.first_, leaf.count_, static_cast<float>(tmin_), tmax, t, u, v);
+                if (lane >= 0 && t < hit_.t_) {
+                    hit_.triangle_id_ = leaf_triangles_[leaf.first_ + lane];
+                    hit_.t_ = t;
+                    hit_.u_ = u;
+                    hit_.v_ = v;
                 }
+                return hit_.Valid() && hit_.t_ <= t_exit;
+            }
+
+            for (unsigned int i = leaf.first_; i < leaf.first_ + leaf.count_; i++) {
+                unsigned int triangle_id = leaf_triangles_[i];
+                if (mailbox_.TestAndAdd(triangle_id)) continue;
+                int tp = 3 * triangle_id;
+                Real_t t, u, v;
+                bool intersects = leaf_data_ ? rayTriangleIntersect(origin_, direction_, *leaf_data_, i, t, u, v)
+                    : rayTriangleIntersect(origin_, direction_, in_vertices_[in_triangles_[tp]], in_vertices_[in_triangles_[tp + 1]], in_vertices_[in_triangles_[tp + 2]], t, u, v);
+                if (!intersects) continue;
+                if (t < tmin_ || t >= hit_.t_) continue;
+
+                hit_.triangle_id_ = triangle_id;
+                hit_.t_ = t;
+                hit_.u_ = u;
+                hit_.v_ = v;
             }
 
-            if (txm < tz0) answer |= 4;
-            if (tym < tz0) answer |= 2;
-            return (int)answer;
+            /* 
+                A triangle may extend outside this leaf. The traversal can only end if the closest hit 
+                lies before the exit point of this leaf, otherwise a nearer triangle might still be found
+                in the next leaves
+            */
+            return hit_.Valid() && hit_.t_ <= t_exit;
+        }
+
+        const std::vector<glm::vec3>& in_vertices_;
+        const std::vector<unsigned int>& in_triangles_;
+        const unsigned int * leaf_triangles_;
+        const TriangleBuffer * leaf_data_;
+        const Real_t * origin_;
+        const Real_t * direction_;
+        Real_t tmin_;
+        RayHit& hit_;
+        Mailbox& mailbox_;
+        /* The vector leaf test, used with leaf_data_ */
+        LeafIntersectionKernel kernel_;
+        float origin_f_[3];
+        float direction_f_[3];
+    };
+
+    /* Nodes with more triangles than this build their children as parallel tasks */
+    static const size_t PARALLEL_BUILD_SIZE = 4096;
+    /* Number of triangles per task when partitioning a large node */
+    static const size_t PARTITION_CHUNK_SIZE = 16384;
+
+    /**
+        Axis aligned bounding box of a triangle
+    */
+    struct TriangleBounds {
+        glm::vec3 min_;
+        glm::vec3 max_;
+    };
+
+    /**
+        Find the octants of a node that a triangle overlaps
+        @param bounds The bounding box of the triangle
+        @param origin The origin of the node
+        @param child_origins The origins of the octants
+        @param H The size of the octants
+        @param margin Slack for the box tests, so that they never disagree with the octant test
+        @return Bit i is set if the triangle overlaps octant i
+    */
+    static unsigned char OverlappedOctants(const std::vector<glm::vec3>& in_vertices, const std::vector<unsigned int>& in_triangles, unsigned int triangle_id, const TriangleBounds& bounds, Point3D origin, const Point3D * child_origins, Real_t H, Real_t margin) {
+        /* Deep in the tree most triangles lie inside a single octant and need no further test */
+        int octant = 0;
+        for (int i = 0; i < 3; i++) {
+            if (bounds.min_[i] >= origin[i] + H) octant |= 4 >> i;
         }
+        const Point3D& o = child_origins[octant];
+        bool inside = true;
+        for (int i = 0; i < 3; i++)
+            inside = inside && bounds.min_[i] > o[i] + margin && bounds.max_[i] < o[i] + H - margin;
+        if (inside) return 1 << octant;
+
+        return OctreeNode::OverlappedOctants(origin, 2 * H, in_vertices, in_triangles, triangle_id);
+    }
+
+    /* Cost of visiting a node, relative to one ray/triangle test */
+    static constexpr float TRAVERSAL_COST = 1.0f;
+    /* Cost of one ray/triangle test */
+    static constexpr float INTERSECTION_COST = 1.0f;
+    /* Bytes of a triangle reference of the linear octree, its id and its leaf triangle data */
+    static constexpr float REFERENCE_BYTES = sizeof(unsigned int) + 9 * sizeof(float);
+    /* Bytes of a node of the linear octree */
+    static constexpr float NODE_BYTES = sizeof(LinearOctreeNode);
+    /*
+        The cost of a ray through the root of a whole octree, in ray/triangle tests, and its bytes 
+        per triangle of the mesh, as SplitPays and LeafCost count them. An octree of total 
+        triangles costs RAY_COST / (BYTES_PER_TRIANGLE * total) per byte. The values were taken 
+        from the octrees built with them, of the bundled bunny (15.9 tests, 61 bytes) and of a 
+        500000 triangle height field (12.0 tests, 60 bytes), with the 16 wide kernel. The old 
+        rule, one test per reference, is about 1/40 here, and gave 35-40% more bytes per 
+        triangle for 9-14% fewer tests per ray
+    */
+    static constexpr float RAY_COST = 14.0f;
+    static constexpr float BYTES_PER_TRIANGLE = 60.0f;
+
+    /**
+        Expected cost of testing a leaf of count triangles. The vector leaf kernels test 
+        width triangles at once, see GetLeafIntersectionKernelWidth
+    */
+    static float LeafCost(size_t count, size_t width) {
+        return ((count + width - 1) / width) * INTERSECTION_COST;
+    }
 
-        int RayCastNewNode(Real_t txm, int x, Real_t tym, int y, Real_t tzm, int z) {
-            if (txm < tym) {
-                if (txm < tzm) { return x; }
+    /**
+        Surface area heuristic for the split of a node. A ray through a cube goes through each 
+        of its octants with probability 1/4, the ratio of their surface areas. The triangles 
+        that overlap several octants count once in each of them, so splitting around thin 
+        features or triangles larger than the node pays off less, and costs more references.
+        The saving, weighed by the probability that a ray through the root reaches the node, 
+        and the bytes the split adds are compared as cost per byte: a split pays if it saves 
+        more per byte than the cost per byte of the whole octree. It then makes the cost of a 
+        ray times the bytes of the octree smaller, i.e. rays/s per byte higher. Small nodes 
+        around shared vertices, which look the same at every depth, are not split down to 
+        MAX_DEPTH, and a node of a few large triangles may still be split
+        @param count The number of triangles of the node
+        @param child_ids The triangles of each octant
+        @param depth The depth of the node, the root is at depth 0
+        @param total The number of triangles of the mesh
+        @param width The width of the leaf kernel
+        @return true if the split is expected to pay for the memory it adds
+    */
+    static bool SplitPays(size_t count, const std::vector<unsigned int> child_ids[8], size_t depth, size_t total, size_t width) {
+        float split_cost = TRAVERSAL_COST;
+        size_t references = 0, children = 0;
+        for (int octant = 0; octant < 8; octant++) {
+            split_cost += 0.25f * LeafCost(child_ids[octant].size(), width);
+            references += child_ids[octant].size();
+            children += !child_ids[octant].empty();
+        }
+
+        /* Tests saved per ray through the root, and the bytes it takes */
+        float saving = std::ldexp(LeafCost(count, width) - split_cost, -2 * static_cast<int>(depth));
+        float bytes = (static_cast<float>(references) - count) * REFERENCE_BYTES + children * NODE_BYTES;
+        return saving > 0 && saving / bytes > RAY_COST / (BYTES_PER_TRIANGLE * total);
+    }
+
+    static OctreeNode * BuildLeaf(Allocator& allocator, const std::vector<unsigned int>& ids, Point3D origin, Real_t length) {
+        OctreeLeafNode * leaf = AllocatorNew<OctreeLeafNode>(allocator, origin, length);
+        leaf->Reserve(allocator, ids.size());
+        for (size_t i = 0; i < ids.size(); i++)
+            leaf->Add(allocator, ids[i]);
+        return leaf;
+    }
+
+    /**
+        Build the subtree of a region top down, from all the triangles that overlap it. Each node
+        partitions its triangle list into the lists of its octants, in the order of the parent list.
+        The tree only depends on the triangles, not on the order the tasks run in, so it is the 
+        same for any number of threads. Nodes are split where SplitPays, which depends on the 
+        leaf kernel of the CPU, down to MAX_DEPTH
+        @param bounds The bounding boxes of all the triangles
+        @param ids The triangles that overlap the region
+        @param depth The depth of the node, the root is at depth 0
+        @param kernel_width GetLeafIntersectionKernelWidth(), read once for the whole build
+    */
+    static OctreeNode * BuildNode(Allocator& allocator, const std::vector<glm::vec3>& in_vertices, const std::vector<unsigned int>& in_triangles, const std::vector<TriangleBounds>& bounds, const std::vector<unsigned int>& ids, Point3D origin, Real_t length, size_t depth, size_t kernel_width, ThreadPool& pool) {
+        if (depth >= MAX_DEPTH) return BuildLeaf(allocator, ids, origin, length);
+
+        Real_t H = length / 2.0;
+        Real_t margin = length * 1e-5;
+        Point3D child_origins[8];
+        for (int octant = 0; octant < 8; octant++) {
+            child_origins[octant] = origin;
+            if (octant & 4) child_origins[octant][0] += H;
+            if (octant & 2) child_origins[octant][1] += H;
+            if (octant & 1) child_origins[octant][2] += H;
+        }
+
+        /* Bit i of masks[k] is set if triangle ids[k] overlaps octant i */
+        std::vector<unsigned char> masks(ids.size());
+        auto partition = [&](size_t begin, size_t end) {
+            for (size_t k = begin; k < end; k++)
+                masks[k] = OverlappedOctants(in_vertices, in_triangles, ids[k], bounds[ids[k]], origin, child_origins, H, margin);
+        };
+
+        bool parallel = ids.size() > PARALLEL_BUILD_SIZE && pool.Size() > 1;
+        if (parallel) {
+            TaskGroup tasks(pool);
+            for (size_t begin = 0; begin < ids.size(); begin += PARTITION_CHUNK_SIZE) {
+                size_t end = std::min(begin + PARTITION_CHUNK_SIZE, ids.size());
+                tasks.Run([&partition, begin, end] { partition(begin, end); });
             }
-            else {
-                if (tym < tzm) { return y; }
+            tasks.Wait();
+        }
+        else {
+            partition(0, ids.size());
+        }
+
+        std::vector<unsigned int> child_ids[8];
+        for (size_t k = 0; k < ids.size(); k++) {
+            for (int octant = 0; octant < 8; octant++) {
+                if ((masks[k] >> octant) & 1) child_ids[octant].push_back(ids[k]);
             }
-            return z;
         }
-    };
+        std::vector<unsigned char>().swap(masks);
+
+        if (!SplitPays(ids.size(), child_ids, depth, bounds.size(), kernel_width)) return BuildLeaf(allocator, ids, origin, length);
+
+        OctreeInnerNode * node = AllocatorNew<OctreeInnerNode>(allocator, origin, length);
+        OctreeNode * children[8] = {};
+        TaskGroup tasks(pool);
+        for (int octant = 0; octant < 8; octant++) {
+            if (child_ids[octant].empty()) continue;
+
+            auto build = [&, octant] {
+                children[octant] = BuildNode(allocator, in_vertices, in_triangles, bounds, child_ids[octant], child_origins[octant], H, depth + 1, kernel_width, pool);
+                std::vector<unsigned int>().swap(child_ids[octant]);
+            };
+            if (parallel) tasks.Run(build);
+            else build();
+        }
+        tasks.Wait();
+
+        for (int octant = 0; octant < 8; octant++)
+            node->SetChild(octant, children[octant]);
+        return node;
+    }
 
 public:
 
-    TrianglesOctree(Point3D origin, Real_t length) {
+    TrianglesOctree(Point3D origin, Real_t length) : kernel_width_(GetLeafIntersectionKernelWidth()), nodes_(nullptr), node_count_(0), leaf_triangles_(nullptr), leaf_triangle_count_(0) {
+        origin_ = origin;
+        length_ = length;
+        root_ = AllocatorNew<OctreeLeafNode>(allocator_, origin, length);
+    }
+
+    /**
+        Build the octree of all the triangles of a mesh at once, and compile it
+        @param origin The "bottom left" point of the octree area
+        @param length The size of the octree region in all directions
+        @param in_vertices The vertices of the mesh
+        @param in_triangles Three vertex indices per triangle
+        @param pool The threads to build with. The octree is the same for any number of threads
+    */
+    TrianglesOctree(Point3D origin, Real_t length, const std::vector<glm::vec3>& in_vertices, const std::vector<unsigned int>& in_triangles, ThreadPool& pool = ThreadPool::Default()) : kernel_width_(GetLeafIntersectionKernelWidth()), nodes_(nullptr), node_count_(0), leaf_triangles_(nullptr), leaf_triangle_count_(0) {
         origin_ = origin;
         length_ = length;
-        root_ = new OctreeLeafNode(origin, length);
+
+        /* Same as Insert, triangles outside of the region are ignored */
+        size_t triangle_count = in_triangles.size() / 3;
+        std::vector<unsigned char> inside(triangle_count);
+        std::vector<TriangleBounds> bounds(triangle_count);
+        pool.ParallelFor(triangle_count, PARTITION_CHUNK_SIZE, [&](size_t begin, size_t end) {
+            for (size_t i = begin; i < end; i++) {
+                const glm::vec3& v0 = in_vertices[in_triangles[3 * i]];
+                const glm::vec3& v1 = in_vertices[in_triangles[3 * i + 1]];
+                const glm::vec3& v2 = in_vertices[in_triangles[3 * i + 2]];
+                bounds[i].min_ = glm::min(glm::min(v0, v1), v2);
+                bounds[i].max_ = glm::max(glm::max(v0, v1), v2);
+                inside[i] = OctreeNode::Overlaps(origin, length, in_vertices, in_triangles, static_cast<int>(i));
+            }
+        });
+
+        std::vector<unsigned int> ids;
+        ids.reserve(triangle_count);
+        for (size_t i = 0; i < triangle_count; i++) {
+            if (inside[i]) ids.push_back(static_cast<unsigned int>(i));
+        }
+
+        root_ = BuildNode(allocator_, in_vertices, in_triangles, bounds, ids, origin, length, 0, kernel_width_, pool);
+        Compile();
+    }
+
+    /**
+        An octree over the arrays of a compiled one, e.g. mapped from a cache file. The arrays are
+        used in place, nothing is copied. Such an octree has no nodes to Insert into, and must not 
+        be compiled again
+        @param compiled The arrays, built with the same BUCKET_SIZE and MAX_DEPTH
+        @param owner Keeps the arrays alive as long as the octree
+    */
+    TrianglesOctree(const CompiledTrianglesOctree& compiled, std::shared_ptr<const void> owner) : root_(nullptr), kernel_width_(GetLeafIntersectionKernelWidth()), owner_(owner) {
+        origin_ = compiled.origin_;
+        length_ = compiled.length_;
+        nodes_ = compiled.nodes_;
+        node_count_ = compiled.node_count_;
+        leaf_triangles_ = compiled.triangles_;
+        leaf_triangle_count_ = compiled.triangle_count_;
+        if (compiled.triangle_data_ != nullptr) compiled_triangle_data_.View(compiled.triangle_data_, leaf_triangle_count_);
     }
 
     ~TrianglesOctree() {
-        delete root_;
+        /* The nodes hold nothing but memory of the allocator */
+        if (!Allocator::RELEASES_ALL && root_ != nullptr) root_->Destroy(allocator_);
+        allocator_.Release();
     }
 
     void Insert(std::vector<glm::vec3>& in_vertices, std::vector<unsigned int>& in_triangles, int triangle_id) {
-        root_ = root_->Insert(in_vertices, in_triangles, triangle_id, 0);
+        root_ = root_->Insert(allocator_, in_vertices, in_triangles, triangle_id, 0, kernel_width_);
+
+        /* The linear octree is out of date */
+        compiled_nodes_.clear();
+        compiled_triangles_.clear();
+        compiled_triangle_data_.Clear();
+        nodes_ = nullptr;
+        leaf_triangles_ = nullptr;
     }
 
-    size_t Depth() {
-        return root_->Depth();
+    /**
+        Pack the octree into a linear octree, the layout used by the ray queries. Call once after 
+        the last Insert. Otherwise the first ray query compiles the octree, which is not thread safe
+    */
+    void Compile() {
+        /* An octree over compiled arrays has nothing to compile them from */
+        if (root_ == nullptr) return;
+
+        compiled_nodes_.clear();
+        compiled_triangles_.clear();
+        compiled_triangle_data_.Clear();
+
+        /* Visit breadth first, so that the children of each node are stored next to each other */
+        std::deque<std::pair<OctreeNode *, size_t> > queue;
+        compiled_nodes_.push_back(LinearOctreeNode());
+        queue.push_back(std::make_pair(root_, 0));
+        while (!queue.empty()) {
+            std::pair<OctreeNode *, size_t> item = queue.front();
+            queue.pop_front();
+            item.first->Compile(item.second, compiled_nodes_, compiled_triangles_, queue);
+        }
+
+        nodes_ = compiled_nodes_.data();
+        node_count_ = compiled_nodes_.size();
+        leaf_triangles_ = compiled_triangles_.data();
+        leaf_triangle_count_ = compiled_triangles_.size();
     }
 
-    void RayCast(std::vector<glm::vec3>& in_vertices, std::vector<unsigned int>& in_triangles, Ray3D r, std::vector<unsigned int>& results) {
-        unsigned char a = 0;
+    bool IsCompiled() {
+        return nodes_ != nullptr;
+    }
 
-        /**
-            If ray has negative components calculate the reflection of the ray
-        */
-        if (r.Direction()[0] < 0) {
-            r.Origin()[0] = (origin_[0] + length_ / 2.0) * 2 - r.Origin()[0];
-            r.Direction()[0] = -r.Direction()[0];
-            a |= 4;
+    /**
+        Store a copy of the triangles of every leaf next to each other, in leaf order, as the
+        first vertex and two edges in a structure of arrays. Leaf tests then read one contiguous
+        range instead of three scattered vertices per triangle, for 36 bytes per triangle
+        reference, and are done by the widest vector kernel the CPU supports. Optional, compiles the octree if needed. Call again after Insert or Compile
+    */
+    void CompileTriangleData(const std::vector<glm::vec3>& in_vertices, const std::vector<unsigned int>& in_triangles) {
+        if (!IsCompiled()) Compile();
+
+        compiled_triangle_data_.Resize(leaf_triangle_count_);
+        for (size_t i = 0; i < leaf_triangle_count_; i++) {
+            size_t tp = 3 * static_cast<size_t>(leaf_triangles_[i]);
+            compiled_triangle_data_.Set(i, in_vertices[in_triangles[tp]], in_vertices[in_triangles[tp + 1]], in_vertices[in_triangles[tp + 2]]);
         }
-        if (r.Direction()[1] < 0) {
-            r.Origin()[1] = (origin_[1] + length_ / 2.0) - r.Origin()[1];
-            r.Direction()[1] = -r.Direction()[1];
-            a |= 2;
+    }
+
+    size_t Depth() {
+        if (root_ != nullptr) return root_->Depth();
+        return IsCompiled() ? LinearDepth(0) : 0;
+    }
+
+    /**
+        @return The bytes held by the nodes, the linear octree and the leaf triangle data
+    */
+    size_t MemoryUsage() {
+        return allocator_.Reserved() + node_count_ * sizeof(LinearOctreeNode) + leaf_triangle_count_ * sizeof(unsigned int) + compiled_triangle_data_.MemoryUsage();
+    }
+
+    /**
+        @return The arrays of the linear octree, compiled if needed. Valid until the octree is changed
+    */
+    CompiledTrianglesOctree Compiled() {
+        if (!IsCompiled()) Compile();
+
+        CompiledTrianglesOctree compiled;
+        compiled.origin_ = origin_;
+        compiled.length_ = length_;
+        compiled.nodes_ = nodes_;
+        compiled.node_count_ = node_count_;
+        compiled.triangles_ = leaf_triangles_;
+        compiled.triangle_count_ = leaf_triangle_count_;
+        compiled.triangle_data_ = LeafData() ? compiled_triangle_data_.Data() : nullptr;
+        return compiled;
+    }
+
+    /**
+        Find the closest triangle hit by a ray
+        @param r The 3D space ray
+        @param[out] hit The closest hit. If nothing is hit, hit.Valid() is false
+        @param tmin The start of the ray interval
+        @param tmax The end of the ray interval
+        @return true if a triangle was hit inside [tmin, tmax]
+    */
+    bool RayCast(const std::vector<glm::vec3>& in_vertices, const std::vector<unsigned int>& in_triangles, Ray3D r, RayHit& hit, Real_t tmin = 0, Real_t tmax = std::numeric_limits<Real_t>::max()) {
+        if (!IsCompiled()) Compile();
+
+        hit = RayHit();
+        hit.t_ = tmax;
+
+        /* Triangle tests use the original ray, the traversal reflects its own copy */
+        Real_t origin[3] = { r.Origin()[0], r.Origin()[1], r.Origin()[2] };
+        Real_t direction[3] = { r.Direction()[0], r.Direction()[1], r.Direction()[2] };
+
+        Mailbox mailbox;
+        ClosestHitVisitor visitor(in_vertices, in_triangles, leaf_triangles_, LeafData(), origin, direction, tmin, hit, mailbox);
+        LinearOctreeTraversal<MAX_DEPTH>::RayCast(nodes_, origin_, length_, r, tmin, hit.t_, visitor);
+
+        return hit.Valid();
+    }
+
+    /**
+        Check if a ray hits any triangle, e.g. for shadow and visibility rays. Cheaper than 
+        RayCast, the traversal ends at the first hit found
+        @param r The 3D space ray
+        @param tmax The end of the ray interval
+        @param tmin The start of the ray interval
+        @return true if any triangle is hit inside [tmin, tmax]
+    */
+    bool Occluded(const std::vector<glm::vec3>& in_vertices, const std::vector<unsigned int>& in_triangles, Ray3D r, Real_t tmax, Real_t tmin = 0) {
+        if (!IsCompiled()) Compile();
+
+        Real_t origin[3] = { r.Origin()[0], r.Origin()[1], r.Origin()[2] };
+        Real_t direction[3] = { r.Direction()[0], r.Direction()[1], r.Direction()[2] };
+
+        Mailbox mailbox;
+        AnyHitVisitor visitor(in_vertices, in_triangles, leaf_triangles_, LeafData(), origin, direction, tmin, tmax, mailbox);
+        LinearOctreeTraversal<MAX_DEPTH>::RayCast(nodes_, origin_, length_, r, tmin, tmax, visitor);
+
+        return visitor.occluded_;
+    }
+
+    /**
+        Find the closest hits of a packet of rays, traced together through the octree with one lane
+        per ray. The packet is the rays [first, first + count) of the buffer, count at most W. 
+        Rays that do not share the signs of their direction components can't visit the nodes in
+        the same order, such packets are traced one ray at a time
+        @param rays The ray buffer
+        @param first The first ray of the packet
+        @param count The number of rays in the packet
+        @param[out] hits The closest hit of each ray is written at the index of the ray
+        @param slab The slab test of the nodes with W lanes, e.g. RayPacketSlab<SimdFloat4>
+    */
+    template<int W, typename Slab>
+    void RayCastPacket(const std::vector<glm::vec3>& in_vertices, const std::vector<unsigned int>& in_triangles, const RayBuffer& rays, size_t first, size_t count, HitBuffer& hits, Slab slab) {
+        static_assert(W <= RayPacket::MAX_WIDTH, "The packet is wider than RayPacket");
+        if (!IsCompiled()) Compile();
+
+        Real_t origin[W][3];
+        Real_t direction[W][3];
+        RayHit lane_hits[W];
+        Mailbox mailboxes[W];
+        RayPacket packet;
+
+        /* Octant of the direction, shared by all the rays */
+        unsigned char a = 0;
+        bool coherent = true;
+        int lanes = 0;
+        for (int l = 0; l < W; l++) {
+            if (l >= (int)count) {
+                /* Inactive lane, an empty interval */
+                packet.ox_[l] = packet.oy_[l] = packet.oz_[l] = packet.ix_[l] = packet.iy_[l] = packet.iz_[l] = 0;
+                packet.tmin_[l] = 1;
+                packet.tmax_[l] = 0;
+                continue;
+            }
+            lanes |= 1 << l;
+
+            Ray3D r = rays.Get(first + l);
+            unsigned char lane_a = 0;
+            float inverse[3];
+            for (int i = 0; i < 3; i++) {
+                origin[l][i] = r.Origin()[i];
+                direction[l][i] = r.Direction()[i];
+                if (direction[l][i] < 0) lane_a |= 4 >> i;
+                /* Same as the single ray traversal, a zero component is tilted by a negligible amount */
+                Real_t d = (direction[l][i] == 0) ? std::numeric_limits<Real_t>::epsilon() : direction[l][i];
+                inverse[i] = static_cast<float>(Real_t(1) / d);
+            }
+            if (l == 0) a = lane_a;
+            coherent = coherent && (lane_a == a);
+
+            packet.ox_[l] = static_cast<float>(origin[l][0]);
+            packet.oy_[l] = static_cast<float>(origin[l][1]);
+            packet.oz_[l] = static_cast<float>(origin[l][2]);
+            packet.ix_[l] = inverse[0];
+            packet.iy_[l] = inverse[1];
+            packet.iz_[l] = inverse[2];
+            packet.tmin_[l] = static_cast<float>(rays.tmin_[first + l]);
+            packet.tmax_[l] = static_cast<float>(std::min<Real_t>(rays.tmax_[first + l], std::numeric_limits<float>::max()));
+            lane_hits[l].t_ = rays.tmax_[first + l];
         }
-        if (r.Direction()[2] < 0) {
-            r.Origin()[2] = (origin_[2] + length_ / 2.0) - r.Origin()[2];
-            r.Direction()[2] = -r.Direction()[2];
-            a |= 1;
+
+        if (!coherent) {
+            RayHit hit;
+            for (size_t l = 0; l < count; l++) {
+                RayCast(in_vertices, in_triangles, rays.Get(first + l), hit, rays.tmin_[first + l], rays.tmax_[first + l]);
+                hits.Set(first + l, hit);
+            }
+            return;
         }
 
-        /*
-            Compute the starting parametric values of entry and exit for the root node
+        /* 
+            All the rays move in the same direction along each axis, so visiting the children in 
+            increasing octant order, after reflecting with a, is a front to back order for every ray.
+            Children are pushed in reverse, a node pushes at most 8 and all but one of them stay 
+            on the stack while the first is processed
         */
+        PacketFrame stack[7 * MAX_DEPTH + 8];
+        int top = 0;
+        stack[0].node_ = 0;
+        stack[0].x_ = static_cast<float>(origin_[0]);
+        stack[0].y_ = static_cast<float>(origin_[1]);
+        stack[0].z_ = static_cast<float>(origin_[2]);
+        stack[0].length_ = static_cast<float>(length_);
+
+        while (top >= 0) {
+            PacketFrame frame = stack[top--];
+
+            /* Near and far planes of the node along each axis, they depend on the direction */
+            float near_planes[3] = {
+                (a & 4) ? frame.x_ + frame.length_ : frame.x_,
+                (a & 2) ? frame.y_ + frame.length_ : frame.y_,
+                (a & 1) ? frame.z_ + frame.length_ : frame.z_
+            };
+            float far_planes[3] = {
+                (a & 4) ? frame.x_ : frame.x_ + frame.length_,
+                (a & 2) ? frame.y_ : frame.y_ + frame.length_,
+                (a & 1) ? frame.z_ : frame.z_ + frame.length_
+            };
+            int active = slab(packet, near_planes, far_planes) & lanes;
+            if (active == 0) continue;
+
+            const LinearOctreeNode& node = nodes_[frame.node_];
+            if (node.IsLeaf()) {
+                for (int l = 0; l < W; l++) {
+                    if (!((active >> l) & 1)) continue;
+                    ClosestHitVisitor visitor(in_vertices, in_triangles, leaf_triangles_, LeafData(), origin[l], direction[l], rays.tmin_[first + l], lane_hits[l], mailboxes[l]);
+                    visitor(node, 0, 0);
+                    packet.tmax_[l] = std::min(packet.tmax_[l], static_cast<float>(lane_hits[l].t_));
+                }
+                continue;
+            }
 
-        Real_t divx = Real_t(1) / r.Direction()[0];
-        Real_t divy = Real_t(1) / r.Direction()[1];
-        Real_t divz = Real_t(1) / r.Direction()[2];
-
-        Real_t tx0 = (origin_[0] - r.Origin()[0]) * divx;
-        Real_t tx1 = (origin_[0] + length_ - r.Origin()[0]) * divx;
-        Real_t ty0 = (origin_[1] - r.Origin()[1]) * divy;
-        Real_t ty1 = (origin_[1] + length_ - r.Origin()[1]) * divy;
-        Real_t tz0 = (origin_[2] - r.Origin()[2]) * divz;
-        Real_t tz1 = (origin_[2] + length_ - r.Origin()[2]) * divz;
-
-        /* If there is intersection, continue */
-        if (std::max(std::max(tx0, ty0), tz0) < std::min(std::min(tx1, ty1), tz1)) {
-            root_->RayCastProcessChild(in_vertices, in_triangles, r, tx0, ty0, tz0, tx1, ty1, tz1, a, results);
+            float half = frame.length_ / 2.0f;
+            for (int k = 7; k >= 0; k--) {
+                int octant = k ^ a;
+                if (!node.HasChild(octant)) continue;
+                PacketFrame& child = stack[++top];
+                child.node_ = node.Child(octant);
+                child.x_ = frame.x_ + ((octant & 4) ? half : 0.0f);
+                child.y_ = frame.y_ + ((octant & 2) ? half : 0.0f);
+                child.z_ = frame.z_ + ((octant & 1) ? half : 0.0f);
+                child.length_ = half;
+            }
         }
+
+        for (size_t l = 0; l < count; l++)
+            hits.Set(first + l, lane_hits[l]);
     }
 
     Point3D GetOrigin() {
@@ -351,9 +929,40 @@ public:
     }
 
 private:
+    /* Declared first, so that it outlives the nodes */
+    Allocator allocator_;
     OctreeNode * root_;
     Point3D origin_;
     Real_t length_;
+    /* GetLeafIntersectionKernelWidth() when the octree was created, for the split decisions */
+    size_t kernel_width_;
+
+    /* The linear octree */
+    std::vector<LinearOctreeNode> compiled_nodes_;
+    std::vector<unsigned int> compiled_triangles_;
+    /* The triangles of leaf_triangles_, empty unless CompileTriangleData was called */
+    TriangleBuffer compiled_triangle_data_;
+
+    /* The linear octree the queries read, in the vectors above or in memory kept by owner_ */
+    const LinearOctreeNode * nodes_;
+    size_t node_count_;
+    const unsigned int * leaf_triangles_;
+    size_t leaf_triangle_count_;
+    std::shared_ptr<const void> owner_;
+
+    const TriangleBuffer * LeafData() const {
+        return compiled_triangle_data_.Size() ? &compiled_triangle_data_ : nullptr;
+    }
+
+    size_t LinearDepth(unsigned int index) const {
+        const LinearOctreeNode& node = nodes_[index];
+        if (node.IsLeaf()) return 0;
+
+        size_t depth = 0;
+        for (unsigned int i = 0; i < PopCount8(node.child_mask_); i++)
+            depth = std::max(depth, LinearDepth(node.first_ + i));
+        return depth + 1;
+    }
 };
 
 #endif
@@ -0,0 +1,289 @@
+#include "TrianglesOctreeCache.h"
+
+#include <cstdio>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <limits>
+#include <vector>
+
+#include "RayTriangleIntersection.hpp"
+
+/* Bump whenever the layout of the file, or of a struct stored in it, changes */
+static const uint32_t CACHE_VERSION = 2;
+static const char CACHE_MAGIC[8] = { 'R', 'T', 'O', 'C', 'T', 'R', 'E', 'E' };
+/* Reads back differently on a machine with the other byte order */
+static const uint32_t CACHE_BYTE_ORDER = 0x01020304;
+/* Sections start at multiples of a cache line */
+static const uint64_t CACHE_ALIGNMENT = 64;
+
+struct TrianglesOctreeCache::Header {
+    char magic_[8];
+    uint32_t version_;
+    uint32_t byte_order_;
+    uint64_t key_;
+    /* The size of the file */
+    uint64_t size_;
+
+    int32_t bucket_size_;
+    int32_t max_depth_;
+    uint32_t node_size_;
+    uint32_t padding_;
+    uint32_t accelerator_;
+    uint32_t reserved_;
+    double origin_[3];
+    double length_;
+
+    uint64_t vertex_count_;
+    uint64_t index_count_;
+    uint64_t node_count_;
+    uint64_t triangle_count_;
+
+    /* Offsets of the sections from the start of the file. triangle_data_ is 0 if there is none */
+    uint64_t vertices_;
+    uint64_t indices_;
+    uint64_t nodes_;
+    uint64_t triangles_;
+    uint64_t triangle_data_;
+};
+
+/* The record FileKey keeps next to a file, the hash of its contents at that size and time */
+struct FileKeyRecord {
+    char magic_[8];
+    uint64_t size_;
+    int64_t time_;
+    uint64_t hash_;
+};
+static const char FILE_KEY_MAGIC[8] = { 'R', 'T', 'F', 'I', 'L', 'E', 'K', '1' };
+
+uint64_t HashFile(const std::string& path) {
+    MappedFile file;
+    if (!file.Open(path)) return 0;
+
+    /* FNV-1a over 64 bit words, then over the bytes of the tail */
+    const uint64_t prime = 0x100000001b3ull;
+    uint64_t hash = 0xcbf29ce484222325ull;
+    size_t words = file.Size() / 8;
+    for (size_t i = 0; i < words; i++) {
+        uint64_t word;
+        std::memcpy(&word, file.Data() + 8 * i, 8);
+        hash = (hash ^ word) * prime;
+    }
+    for (size_t i = 8 * words; i < file.Size(); i++)
+        hash = (hash ^ static_cast<unsigned char>(file.Data()[i])) * prime;
+    return hash;
+}
+
+uint64_t FileKey(const std::string& path) {
+    /* The size and the time are read first, a file written meanwhile doesn't match them next time */
+    std::error_code error;
+    uint64_t size = std::filesystem::file_size(path, error);
+    if (error) return 0;
+    std::filesystem::file_time_type time = std::filesystem::last_write_time(path, error);
+    if (error) return 0;
+    int64_t ticks = static_cast<int64_t>(time.time_since_epoch().count());
+
+    std::string record_path = path + ".key";
+    FileKeyRecord record;
+    std::ifstream in(record_path.c_str(), std::ios_base::in | std::ios_base::binary);
+    if (in.read(reinterpret_cast<char *>(&record), sizeof(record)) && std::memcmp(record.magic_, FILE_KEY_MAGIC, sizeof(FILE_KEY_MAGIC)) == 0 && record.size_ == size && record.time_ == ticks) return record.hash_;
+    in.close();
+
+    uint64_t hash = HashFile(path);
+    if (hash == 0) return 0;
+
+    /* Without the record, e.g. in a read only directory, the next call hashes the file again */
+    std::memcpy(record.magic_, FILE_KEY_MAGIC, sizeof(FILE_KEY_MAGIC));
+    record.size_ = size;
+    record.time_ = ticks;
+    record.hash_ = hash;
+    std::ofstream out(record_path.c_str(), std::ios_base::out | std::ios_base::binary | std::ios_base::trunc);
+    out.write(reinterpret_cast<const char *>(&record), sizeof(record));
+    return hash;
+}
+
+uint64_t HashCombine(uint64_t seed, uint64_t value) {
+    /* The finaliser of MurmurHash3, so that close values give unrelated hashes */
+    uint64_t x = seed ^ (value + 0x9e3779b97f4a7c15ull + (seed << 6) + (seed >> 2));
+    x ^= x >> 33;
+    x *= 0xff51afd7ed558ccdull;
+    x ^= x >> 33;
+    x *= 0xc4ceb9fe1a85ec53ull;
+    x ^= x >> 33;
+    return x;
+}
+
+static uint64_t Align(uint64_t offset) {
+    return (offset + CACHE_ALIGNMENT - 1) / CACHE_ALIGNMENT * CACHE_ALIGNMENT;
+}
+
+bool TrianglesOctreeCache::Save(const std::string& path, uint64_t key, TrianglesOctreeConfig config, const std::vector<glm::vec3>& vertices, const std::vector<unsigned int>& triangles, const CompiledTrianglesOctree& octree, uint32_t accelerator) {
+    size_t triangle_data_size = octree.triangle_data_ ? 9 * (octree.triangle_count_ + TriangleBuffer::PADDING) * sizeof(float) : 0;
+
+    Header header;
+    std::memset(&header, 0, sizeof(header));
+    std::memcpy(header.magic_, CACHE_MAGIC, sizeof(CACHE_MAGIC));
+    header.version_ = CACHE_VERSION;
+    header.byte_order_ = CACHE_BYTE_ORDER;
+    header.key_ = key;
+    header.bucket_size_ = config.bucket_size_;
+    header.max_depth_ = config.max_depth_;
+    header.node_size_ = sizeof(LinearOctreeNode);
+    header.padding_ = TriangleBuffer::PADDING;
+    header.accelerator_ = accelerator;
+    for (int i = 0; i < 3; i++)
+        header.origin_[i] = octree.origin_[i];
+    header.length_ = octree.length_;
+    header.vertex_count_ = vertices.size();
+    header.index_count_ = triangles.size();
+    header.node_count_ = octree.node_count_;
+    header.triangle_count_ = octree.triangle_count_;
+
+    header.vertices_ = Align(sizeof(Header));
+    header.indices_ = Align(header.vertices_ + vertices.size() * sizeof(glm::vec3));
+    header.nodes_ = Align(header.indices_ + triangles.size() * sizeof(unsigned int));
+    header.triangles_ = Align(header.nodes_ + octree.node_count_ * sizeof(LinearOctreeNode));
+    uint64_t end = header.triangles_ + octree.triangle_count_ * sizeof(unsigned int);
+    if (triangle_data_size) {
+        header.triangle_data_ = Align(end);
+        end = header.triangle_data_ + triangle_data_size;
+    }
+    header.size_ = end;
+
+    std::string temporary_path = path + ".tmp";
+    {
+        std::ofstream out(temporary_path.c_str(), std::ios_base::out | std::ios_base::binary | std::ios_base::trunc);
+        if (!out.is_open()) return false;
+
+        uint64_t position = 0;
+        auto write = [&](uint64_t offset, const void * data, size_t size) {
+            static const char zeros[CACHE_ALIGNMENT] = {};
+            out.write(zeros, static_cast<std::streamsize>(offset - position));
+            out.write(static_cast<const char *>(data), static_cast<std::streamsize>(size));
+            position = offset + size;
+        };
+        write(0, &header, sizeof(header));
+        write(header.vertices_, vertices.data(), vertices.size() * sizeof(glm::vec3));
+        write(header.indices_, triangles.data(), triangles.size() * sizeof(unsigned int));
+        write(header.nodes_, octree.nodes_, octree.node_count_ * sizeof(LinearOctreeNode));
+        write(header.triangles_, octree.triangles_, octree.triangle_count_ * sizeof(unsigned int));
+        if (triangle_data_size) write(header.triangle_data_, octree.triangle_data_, triangle_data_size);
+
+        out.close();
+        if (!out) {
+            std::remove(temporary_path.c_str());
+            return false;
+        }
+    }
+
+    /* Replace the old file, rename does not overwrite on every platform */
+    std::remove(path.c_str());
+    return std::rename(temporary_path.c_str(), path.c_str()) == 0;
+}
+
+TrianglesOctreeCache::TrianglesOctreeCache() : header_(nullptr) {
+
+}
+
+std::shared_ptr<TrianglesOctreeCache> TrianglesOctreeCache::Load(const std::string& path, uint64_t key) {
+    std::shared_ptr<TrianglesOctreeCache> cache(new TrianglesOctreeCache());
+    if (!cache->file_.Open(path) || cache->file_.Size() < sizeof(Header)) return nullptr;
+
+    const Header& header = *reinterpret_cast<const Header *>(cache->file_.Data());
+    if (std::memcmp(header.magic_, CACHE_MAGIC, sizeof(CACHE_MAGIC)) != 0) return nullptr;
+    if (header.version_ != CACHE_VERSION || header.byte_order_ != CACHE_BYTE_ORDER || header.key_ != key) return nullptr;
+    if (header.node_size_ != sizeof(LinearOctreeNode) || header.padding_ != TriangleBuffer::PADDING) return nullptr;
+
+    /* Every section must lie inside the file, a truncated file is not used */
+    uint64_t size = cache->file_.Size();
+    auto inside = [size](uint64_t offset, uint64_t count, uint64_t item_size) {
+        return offset <= size && count <= (size - offset) / item_size;
+    };
+    if (header.size_ != size) return nullptr;
+    if (!inside(header.vertices_, header.vertex_count_, sizeof(glm::vec3))) return nullptr;
+    if (!inside(header.indices_, header.index_count_, sizeof(unsigned int))) return nullptr;
+    if (!inside(header.nodes_, header.node_count_, sizeof(LinearOctreeNode)) || header.node_count_ == 0) return nullptr;
+    if (!inside(header.triangles_, header.triangle_count_, sizeof(unsigned int))) return nullptr;
+    if (header.triangle_data_ && !inside(header.triangle_data_, 9 * (header.triangle_count_ + TriangleBuffer::PADDING), sizeof(float))) return nullptr;
+
+    cache->header_ = &header;
+    if (!cache->Validate()) return nullptr;
+    return cache;
+}
+
+bool TrianglesOctreeCache::Validate() const {
+    const Header& header = *header_;
+    /* The counts fit in the unsigned int of the node fields and of the triangle ids */
+    const uint64_t limit = std::numeric_limits<unsigned int>::max();
+    if (header.node_count_ > limit || header.triangle_count_ > limit || header.index_count_ % 3 != 0) return false;
+    if (header.max_depth_ <= 0) return false;
+
+    const unsigned int * indices = Section<unsigned int>(header.indices_);
+    for (uint64_t i = 0; i < header.index_count_; i++) {
+        if (indices[i] >= header.vertex_count_) return false;
+    }
+
+    const unsigned int * triangles = Section<unsigned int>(header.triangles_);
+    uint64_t triangle_ids = header.index_count_ / 3;
+    for (uint64_t i = 0; i < header.triangle_count_; i++) {
+        if (triangles[i] >= triangle_ids) return false;
+    }
+
+    /*
+        Compile stores the children of a node after it, so a node whose children all come
+        later can't be part of a cycle, and its depth is known before its children are reached.
+        The traversals keep MAX_DEPTH inner nodes on their stack
+    */
+    const LinearOctreeNode * nodes = Section<LinearOctreeNode>(header.nodes_);
+    std::vector<unsigned int> depths(static_cast<size_t>(header.node_count_), 0);
+    for (uint64_t i = 0; i < header.node_count_; i++) {
+        const LinearOctreeNode& node = nodes[i];
+        if (node.IsLeaf()) {
+            if (static_cast<uint64_t>(node.first_) + node.count_ > header.triangle_count_) return false;
+            continue;
+        }
+
+        if (depths[i] >= static_cast<unsigned int>(header.max_depth_)) return false;
+        uint64_t children = PopCount8(node.child_mask_);
+        if (node.first_ <= i || node.first_ + children > header.node_count_) return false;
+        for (uint64_t child = node.first_; child < node.first_ + children; child++)
+            depths[child] = depths[i] + 1;
+    }
+    return true;
+}
+
+TrianglesOctreeConfig TrianglesOctreeCache::Config() const {
+    return TrianglesOctreeConfig{ header_->bucket_size_, header_->max_depth_ };
+}
+
+uint32_t TrianglesOctreeCache::Accelerator() const {
+    return header_->accelerator_;
+}
+
+const glm::vec3 * TrianglesOctreeCache::Vertices() const {
+    return Section<glm::vec3>(header_->vertices_);
+}
+
+size_t TrianglesOctreeCache::VertexCount() const {
+    return static_cast<size_t>(header_->vertex_count_);
+}
+
+const unsigned int * TrianglesOctreeCache::Triangles() const {
+    return Section<unsigned int>(header_->indices_);
+}
+
+size_t TrianglesOctreeCache::TriangleIndexCount() const {
+    return static_cast<size_t>(header_->index_count_);
+}
+
+CompiledTrianglesOctree TrianglesOctreeCache::Octree() const {
+    CompiledTrianglesOctree octree;
+    octree.origin_ = Point3D({ header_->origin_[0], header_->origin_[1], header_->origin_[2] });
+    octree.length_ = header_->length_;
+    octree.nodes_ = Section<LinearOctreeNode>(header_->nodes_);
+    octree.node_count_ = static_cast<size_t>(header_->node_count_);
+    octree.triangles_ = Section<unsigned int>(header_->triangles_);
+    octree.triangle_count_ = static_cast<size_t>(header_->triangle_count_);
+    octree.triangle_data_ = header_->triangle_data_ ? Section<float>(header_->triangle_data_) : nullptr;
+    return octree;
+}
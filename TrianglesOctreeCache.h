@@ -0,0 +1,95 @@
+#ifndef __TrianglesOctreeCache_h__
+#define __TrianglesOctreeCache_h__
+
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include <glm/glm.hpp>
+
+#include "MappedFile.h"
+#include "TrianglesOctreeConfig.h"
+
+/**
+    @return A 64 bit FNV-1a hash of the contents of a file, 0 if it can't be read
+*/
+uint64_t HashFile(const std::string& path);
+
+/**
+    HashFile of a file, without reading it again while it keeps its size and modification time.
+    The hash is kept with them in path + ".key", and the file is only hashed again once they 
+    change. A file touched but not changed keeps its key
+    @return The hash, 0 if the file can't be read
+*/
+uint64_t FileKey(const std::string& path);
+
+/**
+    @return A hash of a hash and a value, e.g. to add a build parameter to the hash of a file
+*/
+uint64_t HashCombine(uint64_t seed, uint64_t value);
+
+/**
+    A mesh and its compiled triangles octree, stored in a binary file that is mapped into memory
+    when loaded. The octree arrays are used in place, only the mesh arrays are copied out. The
+    file holds a format version and a key given by the caller, e.g. a hash of the source model
+    and of the build parameters. A file with a different version, key or layout is not loaded.
+    The file is only valid on machines with the same byte order and struct layout, which is
+    checked as well. The nodes, leaves and triangle ids are checked to stay inside the file
+    when it is loaded, so that a corrupt file is never traversed
+*/
+class TrianglesOctreeCache {
+public:
+    /**
+        Write a cache file. The file is written next to path first and renamed once complete,
+        so that a crash never leaves a truncated cache behind
+        @param key The key Load must be called with
+        @param config The configuration the octree was built with
+        @param accelerator The structure the mesh queries run on, see TriangleMesh::Accelerator.
+            Stored as it is, for Accelerator()
+        @return false if the file can't be written
+    */
+    static bool Save(const std::string& path, uint64_t key, TrianglesOctreeConfig config, const std::vector<glm::vec3>& vertices, const std::vector<unsigned int>& triangles, const CompiledTrianglesOctree& octree, uint32_t accelerator = 0);
+
+    /**
+        Map a cache file
+        @return The cache, or nullptr if the file is missing, corrupt, or was written with
+            another key or by another version
+    */
+    static std::shared_ptr<TrianglesOctreeCache> Load(const std::string& path, uint64_t key);
+
+    TrianglesOctreeConfig Config() const;
+    /* The accelerator given to Save */
+    uint32_t Accelerator() const;
+
+    const glm::vec3 * Vertices() const;
+    size_t VertexCount() const;
+    /* Three vertex indices per triangle */
+    const unsigned int * Triangles() const;
+    size_t TriangleIndexCount() const;
+
+    /**
+        @return The arrays of the octree, inside the mapped file. They are valid as long as the
+            cache, pass the cache as the owner of an octree built on them
+    */
+    CompiledTrianglesOctree Octree() const;
+
+private:
+    struct Header;
+
+    TrianglesOctreeCache();
+
+    /* Check that the nodes only refer to nodes, leaf triangles and triangles of the file */
+    bool Validate() const;
+
+    MappedFile file_;
+    const Header * header_;
+
+    template<typename T>
+    const T * Section(uint64_t offset) const {
+        return reinterpret_cast<const T *>(file_.Data() + offset);
+    }
+};
+
+#endif
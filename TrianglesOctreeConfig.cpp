@@ -0,0 +1,106 @@
+#include "TrianglesOctreeConfig.h"
+
+#include "LeafIntersection.h"
+#include "TrianglesOctree.hpp"
+#include "RayPacket.hpp"
+
+size_t TrianglesOctreePacketWidth() {
+#ifdef SIMD_FLOAT_AVX
+    /* The AVX2 leaf kernel is there if the CPU and the operating system support AVX2 */
+    static const size_t width = GetLeafIntersectionKernel(LeafKernelType::AVX2) ? 8 : SimdFloat4::WIDTH;
+    return width;
+#else
+    return SimdFloat4::WIDTH;
+#endif
+}
+
+template<int BUCKET_SIZE, int MAX_DEPTH>
+class TrianglesOctreeInstance : public TrianglesOctreeBase {
+public:
+    TrianglesOctreeInstance(Point3D origin, Real_t length, const std::vector<glm::vec3>& in_vertices, const std::vector<unsigned int>& in_triangles, ThreadPool& pool)
+        : octree_(origin, length, in_vertices, in_triangles, pool) {
+    }
+
+    TrianglesOctreeInstance(const CompiledTrianglesOctree& compiled, std::shared_ptr<const void> owner)
+        : octree_(compiled, owner) {
+    }
+
+    TrianglesOctreeConfig Config() const {
+        return TrianglesOctreeConfig{ BUCKET_SIZE, MAX_DEPTH };
+    }
+
+    void CompileTriangleData(const std::vector<glm::vec3>& in_vertices, const std::vector<unsigned int>& in_triangles) {
+        octree_.CompileTriangleData(in_vertices, in_triangles);
+    }
+
+    bool RayCast(const std::vector<glm::vec3>& in_vertices, const std::vector<unsigned int>& in_triangles, Ray3D r, RayHit& hit, Real_t tmin, Real_t tmax) {
+        return octree_.RayCast(in_vertices, in_triangles, r, hit, tmin, tmax);
+    }
+
+    bool Occluded(const std::vector<glm::vec3>& in_vertices, const std::vector<unsigned int>& in_triangles, Ray3D r, Real_t tmax, Real_t tmin) {
+        return octree_.Occluded(in_vertices, in_triangles, r, tmax, tmin);
+    }
+
+    void RayCastPacket(const std::vector<glm::vec3>& in_vertices, const std::vector<unsigned int>& in_triangles, const RayBuffer& rays, size_t first, size_t count, HitBuffer& hits) {
+#ifdef SIMD_FLOAT_AVX
+        /* The slab tests run in RayPacketAvx2.cpp, compiled for AVX2 */
+        if (TrianglesOctreePacketWidth() == 8) {
+            octree_.template RayCastPacket<8>(in_vertices, in_triangles, rays, first, count, hits, RayPacketSlabAvx2);
+            return;
+        }
+#endif
+        octree_.template RayCastPacket<SimdFloat4::WIDTH>(in_vertices, in_triangles, rays, first, count, hits, [](const RayPacket& packet, const float near_planes[3], const float far_planes[3]) {
+            return RayPacketSlab<SimdFloat4>(packet, near_planes, far_planes);
+        });
+    }
+
+    size_t Depth() {
+        return octree_.Depth();
+    }
+
+    size_t MemoryUsage() {
+        return octree_.MemoryUsage();
+    }
+
+    CompiledTrianglesOctree Compiled() {
+        return octree_.Compiled();
+    }
+
+private:
+    TrianglesOctree<BUCKET_SIZE, MAX_DEPTH> octree_;
+};
+
+/**
+    Each configuration instantiates the whole octree, keep the list short. Buckets of 8 and 16
+    fill the 8 and 16 lanes of the AVX2 and AVX-512 leaf kernels
+*/
+#define TRIANGLES_OCTREE_CONFIGS(X) \
+    X(2, 12) X(2, 15) X(2, 19) \
+    X(5, 12) X(5, 15) X(5, 19) \
+    X(8, 12) X(8, 15) X(8, 19) \
+    X(16, 12) X(16, 15) X(16, 19)
+
+const std::vector<TrianglesOctreeConfig>& TrianglesOctreeConfigs() {
+#define TRIANGLES_OCTREE_CONFIG(bucket_size, max_depth) TrianglesOctreeConfig{ bucket_size, max_depth },
+    static const std::vector<TrianglesOctreeConfig> configs = { TRIANGLES_OCTREE_CONFIGS(TRIANGLES_OCTREE_CONFIG) };
+#undef TRIANGLES_OCTREE_CONFIG
+    return configs;
+}
+
+TrianglesOctreeBase * NewTrianglesOctree(TrianglesOctreeConfig config, Point3D origin, Real_t length, const std::vector<glm::vec3>& in_vertices, const std::vector<unsigned int>& in_triangles, ThreadPool& pool) {
+#define TRIANGLES_OCTREE_CONFIG(bucket_size, max_depth) \
+    if (config.bucket_size_ == bucket_size && config.max_depth_ == max_depth) \
+        return new TrianglesOctreeInstance<bucket_size, max_depth>(origin, length, in_vertices, in_triangles, pool);
+    TRIANGLES_OCTREE_CONFIGS(TRIANGLES_OCTREE_CONFIG)
+#undef TRIANGLES_OCTREE_CONFIG
+    return nullptr;
+}
+
+TrianglesOctreeBase * NewTrianglesOctree(TrianglesOctreeConfig config, const CompiledTrianglesOctree& compiled, std::shared_ptr<const void> owner) {
+#define TRIANGLES_OCTREE_CONFIG(bucket_size, max_depth) \
+    if (config.bucket_size_ == bucket_size && config.max_depth_ == max_depth) \
+        return new TrianglesOctreeInstance<bucket_size, max_depth>(compiled, owner);
+    TRIANGLES_OCTREE_CONFIGS(TRIANGLES_OCTREE_CONFIG)
+#undef TRIANGLES_OCTREE_CONFIG
+    return nullptr;
+}
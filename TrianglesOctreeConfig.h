@@ -0,0 +1,106 @@
+#ifndef __TrianglesOctreeConfig_h__
+#define __TrianglesOctreeConfig_h__
+
+#include <cstddef>
+#include <limits>
+#include <memory>
+#include <vector>
+
+#include <glm/glm.hpp>
+
+#include "LinearOctree.hpp"
+#include "Point.hpp"
+#include "Ray.hpp"
+#include "RayBuffer.hpp"
+#include "RayTriangleIntersection.hpp"
+#include "ThreadPool.h"
+
+/**
+    The template parameters of a TrianglesOctree, chosen at runtime
+*/
+struct TrianglesOctreeConfig {
+    /* Leaves hold this many triangles in the node itself, more go to an array of their own */
+    int bucket_size_;
+    /* Leaves at this depth are not split any further */
+    int max_depth_;
+
+    bool operator==(const TrianglesOctreeConfig& other) const {
+        return bucket_size_ == other.bucket_size_ && max_depth_ == other.max_depth_;
+    }
+};
+
+/**
+    The arrays of a compiled TrianglesOctree, everything the ray queries read. They are owned by
+    the octree or by whoever keeps them, e.g. a mapped cache file
+*/
+struct CompiledTrianglesOctree {
+    Point3D origin_;
+    Real_t length_;
+    const LinearOctreeNode * nodes_;
+    size_t node_count_;
+    /* The triangle ids of the leaves */
+    const unsigned int * triangles_;
+    size_t triangle_count_;
+    /* TriangleBuffer::Data() of the leaf triangles, nullptr if there is none */
+    const float * triangle_data_;
+};
+
+/**
+    A TrianglesOctree of any of the configurations returned by TrianglesOctreeConfigs. The
+    queries are the ones of TrianglesOctree, packets are TrianglesOctreePacketWidth() rays wide
+*/
+class TrianglesOctreeBase {
+public:
+    virtual ~TrianglesOctreeBase() {
+    }
+
+    virtual TrianglesOctreeConfig Config() const = 0;
+
+    virtual void CompileTriangleData(const std::vector<glm::vec3>& in_vertices, const std::vector<unsigned int>& in_triangles) = 0;
+
+    virtual bool RayCast(const std::vector<glm::vec3>& in_vertices, const std::vector<unsigned int>& in_triangles, Ray3D r, RayHit& hit, Real_t tmin = 0, Real_t tmax = std::numeric_limits<Real_t>::max()) = 0;
+
+    virtual bool Occluded(const std::vector<glm::vec3>& in_vertices, const std::vector<unsigned int>& in_triangles, Ray3D r, Real_t tmax, Real_t tmin = 0) = 0;
+
+    virtual void RayCastPacket(const std::vector<glm::vec3>& in_vertices, const std::vector<unsigned int>& in_triangles, const RayBuffer& rays, size_t first, size_t count, HitBuffer& hits) = 0;
+
+    virtual size_t Depth() = 0;
+
+    /**
+        @return The bytes held by the octree
+    */
+    virtual size_t MemoryUsage() = 0;
+
+    /**
+        @return The arrays of the octree, valid as long as it is not changed
+    */
+    virtual CompiledTrianglesOctree Compiled() = 0;
+};
+
+/**
+    @return The number of rays of the packets of TrianglesOctreeBase::RayCastPacket, 8 if the CPU
+        supports AVX2 and 4 otherwise, detected once
+*/
+size_t TrianglesOctreePacketWidth();
+
+/**
+    @return The configurations compiled in, the ones NewTrianglesOctree can build
+*/
+const std::vector<TrianglesOctreeConfig>& TrianglesOctreeConfigs();
+
+/**
+    Build and compile the octree of all the triangles of a mesh, see TrianglesOctree
+    @param config The bucket size and the maximum depth
+    @return The octree, or nullptr if the configuration is not compiled in
+*/
+TrianglesOctreeBase * NewTrianglesOctree(TrianglesOctreeConfig config, Point3D origin, Real_t length, const std::vector<glm::vec3>& in_vertices, const std::vector<unsigned int>& in_triangles, ThreadPool& pool = ThreadPool::Default());
+
+/**
+    An octree over the arrays of a compiled one, used in place
+    @param config The configuration the arrays were built with
+    @param owner Keeps the arrays alive as long as the octree
+    @return The octree, or nullptr if the configuration is not compiled in
+*/
+TrianglesOctreeBase * NewTrianglesOctree(TrianglesOctreeConfig config, const CompiledTrianglesOctree& compiled, std::shared_ptr<const void> owner);
+
+#endif
@@ -0,0 +1,150 @@
+#include "TrianglesTwoLevelGrid.h"
+
+#include <algorithm>
+#include <cmath>
+
+#include "GridTraversal.hpp"
+
+TrianglesTwoLevelGrid::TrianglesTwoLevelGrid(const std::vector<glm::vec3>& in_vertices, const std::vector<unsigned int>& in_triangles, ThreadPool& pool) {
+    size_t triangle_count = in_triangles.size() / 3;
+
+    min_ = glm::vec3(std::numeric_limits<float>::max());
+    max_ = glm::vec3(-std::numeric_limits<float>::max());
+    for (size_t i = 0; i < 3 * triangle_count; i++) {
+        min_ = glm::min(min_, in_vertices[in_triangles[i]]);
+        max_ = glm::max(max_, in_vertices[in_triangles[i]]);
+    }
+    if (triangle_count == 0) min_ = max_ = glm::vec3(0);
+
+    /* Same as TrianglesGrid, a padded box and cubic cells */
+    glm::vec3 extent = max_ - min_;
+    float max_extent = std::max(std::max(extent.x, extent.y), extent.z);
+    float padding = std::max(max_extent * 1e-4f, 1e-6f);
+    min_ -= glm::vec3(padding);
+    max_ += glm::vec3(padding);
+    extent = max_ - min_;
+    max_extent = std::max(std::max(extent.x, extent.y), extent.z);
+
+    float cells_per_unit = std::cbrt(COARSE_DENSITY * std::max<size_t>(triangle_count, 1)) / max_extent;
+    for (int i = 0; i < 3; i++) {
+        resolution_[i] = std::min(MAX_RESOLUTION, std::max(1, static_cast<int>(std::round(extent[i] * cells_per_unit))));
+        cell_size_[i] = extent[i] / resolution_[i];
+    }
+
+    std::vector<unsigned int> ids(triangle_count);
+    for (size_t i = 0; i < triangle_count; i++)
+        ids[i] = static_cast<unsigned int>(i);
+    std::vector<unsigned int> coarse_offsets, coarse_triangles;
+    BinTriangles(in_vertices, in_triangles, ids.data(), triangle_count, min_, cell_size_, resolution_, coarse_offsets, coarse_triangles, &pool);
+
+    /* Bin the triangles of every occupied coarse cell into its own fine grid */
+    size_t cell_count = coarse_offsets.size() - 1;
+    cells_.resize(cell_count);
+    std::vector<std::vector<unsigned int> > local_offsets(cell_count), local_triangles(cell_count);
+    pool.ParallelFor(cell_count, CELL_CHUNK_SIZE, [&](size_t begin, size_t end) {
+        for (size_t c = begin; c < end; c++) {
+            size_t count = coarse_offsets[c + 1] - coarse_offsets[c];
+            int fine_resolution = (count == 0) ? 0 : std::min(MAX_FINE_RESOLUTION, std::max(1, static_cast<int>(std::round(std::cbrt(FINE_DENSITY * count)))));
+            for (int i = 0; i < 3; i++) cells_[c].resolution_[i] = fine_resolution;
+            if (count == 0) continue;
+
+            int x = static_cast<int>(c % resolution_[0]);
+            int y = static_cast<int>((c / resolution_[0]) % resolution_[1]);
+            int z = static_cast<int>(c / (static_cast<size_t>(resolution_[0]) * resolution_[1]));
+            glm::vec3 cell_min = min_ + glm::vec3(x, y, z) * cell_size_;
+            BinTriangles(in_vertices, in_triangles, &coarse_triangles[coarse_offsets[c]], count, cell_min, cell_size_ / float(fine_resolution), cells_[c].resolution_, local_offsets[c], local_triangles[c], nullptr);
+        }
+    });
+
+    /* Concatenate the fine grids in coarse cell order */
+    size_t fine_cells = 0, references = 0;
+    for (size_t c = 0; c < cell_count; c++) {
+        if (local_offsets[c].empty()) continue;
+        fine_cells += local_offsets[c].size() - 1;
+        references += local_triangles[c].size();
+    }
+
+    fine_offsets_.reserve(fine_cells + 1);
+    fine_triangles_.reserve(references);
+    for (size_t c = 0; c < cell_count; c++) {
+        cells_[c].first_ = static_cast<unsigned int>(fine_offsets_.size());
+        if (local_offsets[c].empty()) continue;
+
+        unsigned int base = static_cast<unsigned int>(fine_triangles_.size());
+        for (size_t i = 0; i + 1 < local_offsets[c].size(); i++)
+            fine_offsets_.push_back(base + local_offsets[c][i]);
+        fine_triangles_.insert(fine_triangles_.end(), local_triangles[c].begin(), local_triangles[c].end());
+    }
+    fine_offsets_.push_back(static_cast<unsigned int>(fine_triangles_.size()));
+}
+
+template<typename CellVisitor>
+void TrianglesTwoLevelGrid::Walk(const Real_t origin[3], const Real_t direction[3], Real_t tmin, const Real_t& tmax, CellVisitor& visitor) const {
+    const CoarseCell * cell = nullptr;
+    auto fine_visitor = [&](int x, int y, int z, Real_t /*t_enter*/, Real_t t_exit) {
+        size_t fine_cell = cell->first_ + (static_cast<size_t>(z) * cell->resolution_[1] + y) * cell->resolution_[0] + x;
+        return visitor(fine_cell, t_exit);
+    };
+
+    auto coarse_visitor = [&](int x, int y, int z, Real_t /*t_enter*/, Real_t /*t_exit*/) {
+        cell = &cells_[CellIndex(x, y, z)];
+        if (cell->resolution_[0] == 0) return false;
+
+        /* Continue with the fine grid of this cell, from the entry point into the cell */
+        glm::vec3 cell_min = min_ + glm::vec3(x, y, z) * cell_size_;
+        glm::vec3 fine_size = cell_size_ / float(cell->resolution_[0]);
+        return WalkGrid(cell_min, cell_min + cell_size_, fine_size, cell->resolution_, origin, direction, tmin, tmax, fine_visitor);
+    };
+
+    WalkGrid(min_, max_, cell_size_, resolution_, origin, direction, tmin, tmax, coarse_visitor);
+}
+
+bool TrianglesTwoLevelGrid::RayCast(const std::vector<glm::vec3>& in_vertices, const std::vector<unsigned int>& in_triangles, Ray3D r, RayHit& hit, Real_t tmin, Real_t tmax) const {
+    hit = RayHit();
+    hit.t_ = tmax;
+
+    Real_t origin[3] = { r.Origin()[0], r.Origin()[1], r.Origin()[2] };
+    Real_t direction[3] = { r.Direction()[0], r.Direction()[1], r.Direction()[2] };
+
+    auto visitor = [&](size_t fine_cell, Real_t cell_exit) {
+        for (unsigned int i = fine_offsets_[fine_cell]; i < fine_offsets_[fine_cell + 1]; i++) {
+            unsigned int triangle_id = fine_triangles_[i];
+            int tp = 3 * triangle_id;
+            Real_t t, u, v;
+            if (!rayTriangleIntersect(origin, direction, in_vertices[in_triangles[tp]], in_vertices[in_triangles[tp + 1]], in_vertices[in_triangles[tp + 2]], t, u, v)) continue;
+            if (t < tmin || t >= hit.t_) continue;
+
+            hit.triangle_id_ = triangle_id;
+            hit.t_ = t;
+            hit.u_ = u;
+            hit.v_ = v;
+        }
+
+        return hit.Valid() && hit.t_ <= cell_exit;
+    };
+    Walk(origin, direction, tmin, hit.t_, visitor);
+
+    return hit.Valid();
+}
+
+bool TrianglesTwoLevelGrid::Occluded(const std::vector<glm::vec3>& in_vertices, const std::vector<unsigned int>& in_triangles, Ray3D r, Real_t tmax, Real_t tmin) const {
+    Real_t origin[3] = { r.Origin()[0], r.Origin()[1], r.Origin()[2] };
+    Real_t direction[3] = { r.Direction()[0], r.Direction()[1], r.Direction()[2] };
+
+    bool occluded = false;
+    auto visitor = [&](size_t fine_cell, Real_t /*cell_exit*/) {
+        for (unsigned int i = fine_offsets_[fine_cell]; i < fine_offsets_[fine_cell + 1]; i++) {
+            int tp = 3 * fine_triangles_[i];
+            Real_t t, u, v;
+            if (!rayTriangleIntersect(origin, direction, in_vertices[in_triangles[tp]], in_vertices[in_triangles[tp + 1]], in_vertices[in_triangles[tp + 2]], t, u, v)) continue;
+            if (t < tmin || t > tmax) continue;
+
+            occluded = true;
+            return true;
+        }
+        return false;
+    };
+    Walk(origin, direction, tmin, tmax, visitor);
+
+    return occluded;
+}
@@ -0,0 +1,107 @@
+#ifndef __TrianglesTwoLevelGrid_h__
+#define __TrianglesTwoLevelGrid_h__
+
+#include <limits>
+#include <vector>
+
+#include <glm/glm.hpp>
+
+#include "Ray.hpp"
+#include "RayTriangleIntersection.hpp"
+#include "ThreadPool.h"
+
+/**
+    A coarse uniform grid over the bounding box of a mesh, every occupied cell holds a finer
+    uniform grid of its own. The resolution of each fine grid follows the number of triangles
+    in its cell, so dense regions get small cells and empty regions cost nothing. Rays walk
+    the coarse cells in order, and the fine cells of every occupied coarse cell they cross.
+    The queries have the same interface as the ones of TrianglesOctree
+*/
+class TrianglesTwoLevelGrid {
+public:
+    /**
+        Build the grids of all the triangles of a mesh
+        @param in_vertices The vertices of the mesh
+        @param in_triangles Three vertex indices per triangle
+        @param pool The threads to build with. The grids are the same for any number of threads
+    */
+    TrianglesTwoLevelGrid(const std::vector<glm::vec3>& in_vertices, const std::vector<unsigned int>& in_triangles, ThreadPool& pool = ThreadPool::Default());
+
+    /**
+        Find the closest triangle hit by a ray
+        @param r The 3D space ray
+        @param[out] hit The closest hit. If nothing is hit, hit.Valid() is false
+        @param tmin The start of the ray interval
+        @param tmax The end of the ray interval
+        @return true if a triangle was hit inside [tmin, tmax]
+    */
+    bool RayCast(const std::vector<glm::vec3>& in_vertices, const std::vector<unsigned int>& in_triangles, Ray3D r, RayHit& hit, Real_t tmin = 0, Real_t tmax = std::numeric_limits<Real_t>::max()) const;
+
+    /**
+        Check if a ray hits any triangle. The traversal ends at the first hit found
+        @param r The 3D space ray
+        @param tmax The end of the ray interval
+        @param tmin The start of the ray interval
+        @return true if any triangle is hit inside [tmin, tmax]
+    */
+    bool Occluded(const std::vector<glm::vec3>& in_vertices, const std::vector<unsigned int>& in_triangles, Ray3D r, Real_t tmax, Real_t tmin = 0) const;
+
+    /**
+        @return The number of coarse cells along axis
+    */
+    int Resolution(int axis) const {
+        return resolution_[axis];
+    }
+
+    /**
+        @return The number of fine cells of all the coarse cells
+    */
+    size_t FineCellCount() const {
+        return fine_offsets_.empty() ? 0 : fine_offsets_.size() - 1;
+    }
+
+private:
+    /* Coarse cells per triangle */
+    static constexpr float COARSE_DENSITY = 1.0f / 8.0f;
+    /* Fine cells per triangle of a coarse cell */
+    static constexpr float FINE_DENSITY = 2.0f;
+    /* Most cells along one axis */
+    static constexpr int MAX_RESOLUTION = 256;
+    static constexpr int MAX_FINE_RESOLUTION = 16;
+    /* Coarse cells per task when building the fine grids */
+    static const size_t CELL_CHUNK_SIZE = 64;
+
+    /**
+        A cell of the coarse grid
+    */
+    struct CoarseCell {
+        /* Index of the first fine cell in fine_offsets_ */
+        unsigned int first_;
+        /* Fine cells along each axis, zero if the cell is empty */
+        int resolution_[3];
+    };
+
+    /**
+        Walk the fine cells crossed by a ray inside [tmin, tmax] in order. The visitor is called
+        as visitor(fine_cell, t_exit) and returns true to end the walk
+        @param tmax The end of the ray interval. A reference, the visitor can shorten the ray
+    */
+    template<typename CellVisitor>
+    void Walk(const Real_t origin[3], const Real_t direction[3], Real_t tmin, const Real_t& tmax, CellVisitor& visitor) const;
+
+    size_t CellIndex(int x, int y, int z) const {
+        return (static_cast<size_t>(z) * resolution_[1] + y) * resolution_[0] + x;
+    }
+
+    glm::vec3 min_;
+    glm::vec3 max_;
+    glm::vec3 cell_size_;
+    int resolution_[3];
+
+    std::vector<CoarseCell> cells_;
+    /* Fine cell i owns the references [fine_offsets_[i], fine_offsets_[i + 1]) */
+    std::vector<unsigned int> fine_offsets_;
+    std::vector<unsigned int> fine_triangles_;
+};
+
+#endif